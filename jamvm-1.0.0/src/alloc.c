@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <errno.h>
@@ -28,6 +30,7 @@
 #include "jam.h"
 #include "alloc.h"
 #include "thread.h"
+#include "lock_md.h"
 
 /* Trace GC heap mark/sweep phases - useful for debugging heap
  * corruption */
@@ -52,10 +55,10 @@
 #endif
 
 #define OBJECT_GRAIN		8
-#define	ALLOC_BIT		1
+#define PINNED_BIT		4
 
 #define HEADER(ptr)		*((unsigned int*)ptr)
-#define HDR_SIZE(hdr)		(hdr & ~(ALLOC_BIT|FLC_BIT))
+#define HDR_SIZE(hdr)		(hdr & ~(ALLOC_BIT|FLC_BIT|PINNED_BIT))
 #define HDR_ALLOCED(hdr)	(hdr & ALLOC_BIT)
 
 /* 1 word header format
@@ -65,6 +68,7 @@
    -------------------------------------------
                                              ^ alloc bit
                                             ^ flc bit
+                                           ^ pinned bit
 */
 
 static int verbosegc;
@@ -74,16 +78,47 @@ typedef struct chunk {
     struct chunk *next;
 } Chunk;
 
-static Chunk *freelist;
-static Chunk **chunkpp = &freelist;
-
+/* Free chunks are held in segregated lists.  Chunks smaller than
+   BIN_LIMIT are kept in exact-fit bins indexed by size in object
+   grains, with a bitmap recording which bins are non-empty.  Larger
+   chunks are kept in unordered bins, one per power of two, so a chunk
+   is added in constant time.  The best fit is the smallest chunk big
+   enough in the request's own large bin, or failing that the smallest
+   in the next non-empty bin */
+
+#define NUM_BINS		64
+#define LOG_BIN_LIMIT		(6+LOG_OBJECT_GRAIN)
+#define BIN_LIMIT		(1<<LOG_BIN_LIMIT)
+#define BIN_INDEX(size)		((size)>>LOG_OBJECT_GRAIN)
+
+#define NUM_LARGE_BINS		(32-LOG_BIN_LIMIT)
+#define LARGE_BIN_INDEX(size)	(31-__builtin_clz(size)-LOG_BIN_LIMIT)
+
+static Chunk *bins[NUM_BINS];
+static unsigned int binmap[NUM_BINS/32];
+static Chunk *largebins[NUM_LARGE_BINS];
+
+/* The heap.  If a nursery has been configured it lies immediately
+   below the old generation, in the same mapping - nurserybase is the
+   start of the whole heap, and equals heapbase if there's no nursery.
+   Mark and alloc bits cover both generations */
+
+static char *nurserybase;
+static char *nurserylimit;
 static char *heapbase;
 static char *heaplimit;
 static char *heapmax;
 
+/* Free space within the nursery, in address order */
+static Chunk *nursery_free;
+
+static unsigned char *card_table;
+unsigned char *card_table_base;
+
 static int heapfree;
 
 static unsigned int *markBits;
+static unsigned int *allocBits;
 static int markBitSize;
 
 static Object **has_finaliser_list = NULL;
@@ -98,29 +133,61 @@ static int run_finaliser_size     = 0;
 static VMLock heap_lock;
 static VMLock has_fnlzr_lock;
 static VMWaitLock run_fnlzr_lock;
+static VMWaitLock gc_work_lock;
+static VMWaitLock conc_lock;
+static VMLock satb_lock;
 
 static Object *oom;
 
+static void initialiseMarkStacks();
+static void checkFragmentation();
+
 #define LIST_INCREMENT		1000
 
 #define LOG_BYTESPERBIT		LOG_OBJECT_GRAIN /* 1 mark bit for every OBJECT_GRAIN bytes of heap */
 #define LOG_MARKSIZEBITS	5
 #define MARKSIZEBITS		32
 
-#define MARKENTRY(ptr)	((((char*)ptr)-heapbase)>>(LOG_BYTESPERBIT+LOG_MARKSIZEBITS))
-#define MARKOFFSET(ptr)	(((((char*)ptr)-heapbase)>>LOG_BYTESPERBIT)&(MARKSIZEBITS-1))
+#define MARKENTRY(ptr)	((((char*)ptr)-nurserybase)>>(LOG_BYTESPERBIT+LOG_MARKSIZEBITS))
+#define MARKOFFSET(ptr)	(((((char*)ptr)-nurserybase)>>LOG_BYTESPERBIT)&(MARKSIZEBITS-1))
 #define MARK(ptr)	markBits[MARKENTRY(ptr)]|=1<<MARKOFFSET(ptr)
 #define IS_MARKED(ptr)	(markBits[MARKENTRY(ptr)]&(1<<MARKOFFSET(ptr)))
 
-#define IS_OBJECT(ptr)	(((char*)ptr) > heapbase) && \
+/* The alloc bits record the start of every allocated object, and
+   are used to validate conservatively found references.  Objects
+   allocated from a TLAB are recorded when the TLAB is retired */
+#define SET_ALLOCED(ptr) allocBits[MARKENTRY(ptr)]|=1<<MARKOFFSET(ptr)
+#define IS_ALLOCED(ptr)	(allocBits[MARKENTRY(ptr)]&(1<<MARKOFFSET(ptr)))
+
+#define IS_OBJECT(ptr)	(((char*)ptr) > nurserybase) && \
                         (((char*)ptr) < heaplimit) && \
                         !(((unsigned int)ptr)&(OBJECT_GRAIN-1))
 
+#define IS_YOUNG(ptr)	((((char*)ptr) > nurserybase) && (((char*)ptr) < nurserylimit))
+#define IS_OLD(ptr)	((((char*)ptr) > heapbase) && (((char*)ptr) < heaplimit))
+
+/* When the heap is to be compacted, the pin bits record the objects
+   which must not be moved.  They're set for the roots while marking,
+   and for all other immovable objects when compaction starts */
+static unsigned int *pinBits;
+static int pinBitSize = 0;
+static int compacting = FALSE;
+
+#define PIN(ptr)	pinBits[MARKENTRY(ptr)]|=1<<MARKOFFSET(ptr)
+#define IS_PINNED(ptr)	(pinBits[MARKENTRY(ptr)]&(1<<MARKOFFSET(ptr)))
+
+/* Allocate the mark and alloc bits to cover the heap.  When the
+   heap is expanded the existing alloc bits must be preserved */
+
 void allocMarkBits() {
-    int no_of_bits = (heaplimit-heapbase)>>LOG_BYTESPERBIT;
+    int no_of_bits = (heaplimit-nurserybase)>>LOG_BYTESPERBIT;
+    int old_size = markBitSize;
+
     markBitSize = (no_of_bits+MARKSIZEBITS-1)>>LOG_MARKSIZEBITS;
 
-    markBits = (unsigned int *) malloc(markBitSize*sizeof(*markBits));
+    markBits = (unsigned int *) realloc(markBits, markBitSize*sizeof(*markBits));
+    allocBits = (unsigned int *) realloc(allocBits, markBitSize*sizeof(*allocBits));
+    memset(allocBits + old_size, 0, (markBitSize-old_size)*sizeof(*allocBits));
 
     TRACE_GC(("Allocated mark bits - size is %d\n", markBitSize));
 }
@@ -129,14 +196,113 @@ void clearMarkBits() {
     memset(markBits, 0, markBitSize*sizeof(*markBits));
 }
 
-void initialiseAlloc(int min, int max, int verbose) {
+/* Add a free chunk onto the appropriate free list */
+
+static void addChunk(Chunk *chunk) {
+    int size = chunk->header;
+
+    if(size < BIN_LIMIT) {
+        int i = BIN_INDEX(size);
+
+        chunk->next = bins[i];
+        bins[i] = chunk;
+        binmap[i>>5] |= 1<<(i&31);
+    } else {
+        int i = LARGE_BIN_INDEX(size);
+
+        chunk->next = largebins[i];
+        largebins[i] = chunk;
+    }
+}
+
+/* Remove and return the smallest free chunk of at least n
+   bytes.  Small requests are satisfied from the first non-empty
+   bin of the right size or above, falling back to the large bins */
+
+static Chunk *findChunk(int n) {
+    Chunk *chunk, **cpp, **best = NULL;
+    int i;
+
+    if(n < BIN_LIMIT) {
+        int word;
+
+        i = BIN_INDEX(n);
+        word = i>>5;
+        unsigned int bits = binmap[word] & (~0U<<(i&31));
+
+        for(;;) {
+            if(bits) {
+                i = (word<<5) + ffs(bits) - 1;
+                chunk = bins[i];
+
+                if((bins[i] = chunk->next) == NULL)
+                    binmap[word] &= ~(1<<(i&31));
+
+                return chunk;
+            }
+
+            if(++word == NUM_BINS/32)
+                break;
+
+            bits = binmap[word];
+        }
+    }
+
+    /* Every chunk in a bin above the request's is big enough, so
+       only the first bin searched can have no fit */
+
+    for(i = n < BIN_LIMIT ? 0 : LARGE_BIN_INDEX(n); i < NUM_LARGE_BINS && best == NULL; i++)
+        for(cpp = &largebins[i]; *cpp; cpp = &(*cpp)->next)
+            if((*cpp)->header >= n && (best == NULL || (*cpp)->header < (*best)->header))
+                best = cpp;
+
+    if(best == NULL)
+        return NULL;
+
+    chunk = *best;
+    *best = chunk->next;
+    return chunk;
+}
+
+static void printFreeLists() {
+    int i, large = 0, large_size = 0;
+    Chunk *chunk;
+
+    printf("<GC: Free bins (size:chunks)");
+
+    for(i = 1; i < NUM_BINS; i++)
+        if(bins[i] != NULL) {
+            int count = 0;
+
+            for(chunk = bins[i]; chunk != NULL; chunk = chunk->next)
+                count++;
+
+            printf(" %d:%d", i<<LOG_OBJECT_GRAIN, count);
+        }
+
+    for(i = 0; i < NUM_LARGE_BINS; i++)
+        for(chunk = largebins[i]; chunk != NULL; chunk = chunk->next) {
+            large_size += chunk->header;
+            large++;
+        }
+
+    printf(">\n<GC: Large free chunks: %d using %d bytes>\n", large, large_size);
+}
+
+void initialiseAlloc(int min, int max, int nursery, int verbose) {
+    char *mem;
+    int cards;
+
+    /* The nursery is a whole number of cards, so
+       its mark bits fill a whole number of words */
+    nursery = (nursery+CARD_SIZE-1)&~(CARD_SIZE-1);
 
 #ifdef USE_MALLOC
     /* Don't use mmap - malloc max heap size */
-    char *mem = (char*)malloc(max);
+    mem = (char*)malloc(max+nursery);
     min = max;
 #else
-    char *mem = (char*)mmap(0, max, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    mem = (char*)mmap(0, max+nursery, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 #endif
 
     if((int)mem == 0) {
@@ -144,41 +310,456 @@ void initialiseAlloc(int min, int max, int verbose) {
 	exit(0);
     }
 
-    /* Align heapbase so that start of heap + HEADER_SIZE is object aligned */
-    heapbase = (char*)(((int)mem+HEADER_SIZE+OBJECT_GRAIN-1)&~(OBJECT_GRAIN-1))-HEADER_SIZE;
+    /* Align nurserybase so that start of heap + HEADER_SIZE is object aligned */
+    nurserybase = (char*)(((int)mem+HEADER_SIZE+OBJECT_GRAIN-1)&~(OBJECT_GRAIN-1))-HEADER_SIZE;
+    nurserylimit = heapbase = nurserybase+nursery;
 
     /* Ensure size of heap is multiple of OBJECT_GRAIN */
-    heaplimit = heapbase+((min-(heapbase-mem))&~(OBJECT_GRAIN-1));
+    heaplimit = heapbase+((min-(nurserybase-mem))&~(OBJECT_GRAIN-1));
+
+    heapmax = heapbase+((max-(nurserybase-mem))&~(OBJECT_GRAIN-1));
+
+    ((Chunk*)heapbase)->header = heapfree = heaplimit-heapbase;
+    addChunk((Chunk*)heapbase);
 
-    heapmax = heapbase+((max-(heapbase-mem))&~(OBJECT_GRAIN-1));
+    if(nursery) {
+        nursery_free = (Chunk*)nurserybase;
+        nursery_free->header = nursery;
+        nursery_free->next = NULL;
+    }
+
+    /* The card table covers the whole possible heap.  It's allocated
+       even without a nursery, as the write barrier is unconditional */
 
-    freelist = (Chunk*)heapbase;
-    freelist->header = heapfree = heaplimit-heapbase;
-    freelist->next = NULL;
+    cards = ((heapmax-nurserybase)>>LOG_CARD_SIZE)+2;
+    card_table = (unsigned char*)calloc(cards, 1);
+    card_table_base = card_table-(((unsigned int)nurserybase)>>LOG_CARD_SIZE);
 
-    TRACE_GC(("Alloced heap size 0x%x\n",heaplimit-heapbase));
+    TRACE_GC(("Alloced heap size 0x%x nursery size 0x%x\n",heaplimit-heapbase, nursery));
     allocMarkBits();
 
     initVMLock(heap_lock);
     initVMLock(has_fnlzr_lock);
     initVMWaitLock(run_fnlzr_lock);
+    initVMWaitLock(gc_work_lock);
+    initVMWaitLock(conc_lock);
+    initVMLock(satb_lock);
+    initialiseMarkStacks();
 
     verbosegc = verbose;
 }
 
+static long long getTime() {
+   struct timeval tv;
+
+   gettimeofday(&tv, 0);
+   return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static long endTime(long long start) {
+    return getTime() - start;
+}
+
+/* The mark stacks.  Marking is iterative - an object is pushed onto
+   a mark stack when it is first marked, and its children are marked
+   (and pushed) when it is popped.  The stacks grow as needed.  If a
+   stack can't be grown the object is left marked but unscanned, and
+   the heap is rescanned afterwards to find and scan any such objects.
+
+   Each gc thread owns a mark stack, which is also a work-stealing
+   deque.  The owner pushes and pops at the tail without locking,
+   while idle threads steal from the head under the stack's lock,
+   using the THE protocol (Frigo et al, "The Implementation of the
+   Cilk-5 Multithreaded Language").  Stack 0 belongs to the thread
+   doing the collection, and is where all roots are pushed */
+
+#define MARK_STACK_INIT		1024
+#define MARK_STACK_MAX		(1<<20)
+
+/* Maximum number of gc threads (including the collecting thread) */
+#define MAX_GC_THREADS		64
+
+/* Work is only shared with the gc worker threads once the
+   collecting thread's stack holds at least this many objects */
+#define PARALLEL_MARK_MIN	64
+
+typedef struct mark_stack {
+    Object **stack;
+    int size;
+    volatile int head;
+    volatile int tail;
+    pthread_mutex_t lock;
+
+    /* Variables used to store verbose gc info */
+    int high;
+    int marked;
+} MarkStack;
+
+static MarkStack mark_stacks[MAX_GC_THREADS];
+
+static int gc_threads = 1;
+
+/* Set while worker threads are marking - mark bits must then be
+   set atomically */
+static int parallel_marking = FALSE;
+
+/* Set while the heap is being marked concurrently with the mutators
+   (see below) - mark bits are then also set by allocating threads */
+volatile int satb_marking = FALSE;
+
+static volatile int mark_stack_overflow;
+static int mark_stack_overflows;
+
+static void initialiseMarkStacks() {
+    int i;
+
+    for(i = 0; i < MAX_GC_THREADS; i++)
+        pthread_mutex_init(&mark_stacks[i].lock, NULL);
+}
+
+static void atomicAdd(volatile int *addr, int delta) {
+    int old;
+
+    do {
+        old = *addr;
+    } while(!COMPARE_AND_SWAP(addr, old, old + delta));
+}
+
+/* Set the object's mark bit, returning FALSE if
+   it was already set */
+
+static int setMarkBit(Object *ob) {
+    unsigned int *word = &markBits[MARKENTRY(ob)];
+    unsigned int bit = 1<<MARKOFFSET(ob);
+    unsigned int old;
+
+    if(!parallel_marking && !satb_marking) {
+        if(*word & bit)
+            return FALSE;
+
+        *word |= bit;
+        return TRUE;
+    }
+
+    do {
+        old = *word;
+        if(old & bit)
+            return FALSE;
+    } while(!COMPARE_AND_SWAP(word, old, old | bit));
+
+    return TRUE;
+}
+
+/* Make room at the tail of a full mark stack, by discarding
+   the space at the head freed by steals or by growing it */
+
+static int growMarkStack(MarkStack *ms) {
+    int grown = TRUE;
+
+    pthread_mutex_lock(&ms->lock);
+
+    if(ms->head > 0) {
+        memmove(ms->stack, ms->stack + ms->head, (ms->tail - ms->head) * sizeof(Object*));
+        ms->tail -= ms->head;
+        ms->head = 0;
+    } else {
+        int new_size = ms->size ? ms->size*2 : MARK_STACK_INIT;
+        Object **new_stack;
+
+        if(new_size > MARK_STACK_MAX || (new_stack = (Object**)realloc(ms->stack,
+                                                   new_size*sizeof(Object*))) == NULL)
+            grown = FALSE;
+        else {
+            ms->stack = new_stack;
+            ms->size = new_size;
+        }
+    }
+
+    pthread_mutex_unlock(&ms->lock);
+    return grown;
+}
+
+static void markAndPush(Object *ob, MarkStack *ms) {
+    int tail;
+
+    if(!setMarkBit(ob))
+        return;
+
+    ms->marked++;
+
+    if((tail = ms->tail) == ms->size) {
+        if(!growMarkStack(ms)) {
+            TRACE_GC(("Mark stack overflow - object @0x%x left for rescan\n", ob));
+            mark_stack_overflow = TRUE;
+            return;
+        }
+        tail = ms->tail;
+    }
+
+    ms->stack[tail] = ob;
+    WMBARRIER();
+    ms->tail = tail + 1;
+
+    if(tail >= ms->high)
+        ms->high = tail + 1;
+}
+
+static Object *popMarkStack(MarkStack *ms) {
+    int tail = ms->tail - 1;
+
+    /* No thieves when marking serially */
+    if(!parallel_marking) {
+        if(tail < ms->head) {
+            ms->head = ms->tail = 0;
+            return NULL;
+        }
+
+        ms->tail = tail;
+        return ms->stack[tail];
+    }
+
+    ms->tail = tail;
+    MBARRIER();
+
+    if(ms->head > tail) {
+        /* Stack is empty, or we're racing a thief for the
+           last object - resolve under the lock */
+        ms->tail = tail + 1;
+        pthread_mutex_lock(&ms->lock);
+
+        tail = ms->tail - 1;
+        ms->tail = tail;
+        MBARRIER();
+
+        if(ms->head > tail) {
+            ms->head = ms->tail = 0;
+            pthread_mutex_unlock(&ms->lock);
+            return NULL;
+        }
+
+        pthread_mutex_unlock(&ms->lock);
+    }
+
+    return ms->stack[tail];
+}
+
+static Object *stealMarkStack(MarkStack *ms) {
+    Object *ob = NULL;
+    int head;
+
+    if(ms->tail - ms->head <= 0 || pthread_mutex_trylock(&ms->lock))
+        return NULL;
+
+    head = ms->head;
+    ms->head = head + 1;
+    MBARRIER();
+
+    if(ms->head > ms->tail)
+        ms->head = head;
+    else
+        ob = ms->stack[head];
+
+    pthread_mutex_unlock(&ms->lock);
+    return ob;
+}
+
+void markChildren(Object *ob, MarkStack *ms);
+void markObject(Object *object);
+
+/* The gc worker threads wait on gc_work_lock for a new phase of work
+   to be started by the collecting thread, identified by the phase
+   number.  The phase's task is then run by every participating thread,
+   including the collecting thread (which has id 0).
+
+   When marking, each thread marks from its own stack, stealing from
+   the others when it runs out.  The phase ends when all threads are
+   idle with nothing left to steal */
+
+typedef void (*GCTask)(int id, int active);
+
+static GCTask gc_work_task;
+static int gc_work_phase = 0;
+static int gc_workers = 0;
+static int gc_workers_active;
+static int gc_workers_finished;
+static volatile int gc_workers_idle;
+
+static int workAvailable(int active) {
+    int i;
+
+    for(i = 0; i < active; i++)
+        if(mark_stacks[i].tail - mark_stacks[i].head > 0)
+            return TRUE;
+
+    return FALSE;
+}
+
+static void traceWorker(int id, int active) {
+    MarkStack *ms = &mark_stacks[id];
+    Object *ob;
+    int i;
+
+    for(;;) {
+        while((ob = popMarkStack(ms)) != NULL)
+            markChildren(ob, ms);
+
+        /* Own stack is empty - try to steal from the others */
+
+        for(i = 1; i < active; i++)
+            if((ob = stealMarkStack(&mark_stacks[(id + i) % active])) != NULL)
+                break;
+
+        if(ob != NULL) {
+            markChildren(ob, ms);
+            continue;
+        }
+
+        /* Nothing to steal.  Wait until either more work appears,
+           or all threads are idle, in which case marking is done */
+
+        atomicAdd(&gc_workers_idle, 1);
+
+        for(;;) {
+            if(gc_workers_idle == active)
+                return;
+
+            if(workAvailable(active)) {
+                atomicAdd(&gc_workers_idle, -1);
+                break;
+            }
+
+            sched_yield();
+        }
+    }
+}
+
+void gcWorkerThreadLoop(Thread *self) {
+    int id, phase;
+
+    disableSuspend0(self, &self);
+    lockVMWaitLock(gc_work_lock, self);
+
+    id = ++gc_workers;
+    phase = gc_work_phase;
+
+    for(;;) {
+        while(phase == gc_work_phase)
+            waitVMWaitLock(gc_work_lock, self);
+
+        phase = gc_work_phase;
+
+        if(id < gc_workers_active) {
+            unlockVMWaitLock(gc_work_lock, self);
+            (*gc_work_task)(id, gc_workers_active);
+            lockVMWaitLock(gc_work_lock, self);
+
+            gc_workers_finished++;
+            notifyAllVMWaitLock(gc_work_lock, self);
+        }
+    }
+}
+
+/* Called by the collecting thread to run a task in parallel
+   with all the currently available worker threads */
+
+static void runGCWorkers(Thread *self, GCTask task) {
+    int active;
+
+    lockVMWaitLock(gc_work_lock, self);
+
+    active = gc_workers_active = gc_workers + 1;
+    gc_workers_finished = 0;
+    gc_workers_idle = 0;
+    gc_work_task = task;
+
+    gc_work_phase++;
+    notifyAllVMWaitLock(gc_work_lock, self);
+    unlockVMWaitLock(gc_work_lock, self);
+
+    (*task)(0, active);
+
+    lockVMWaitLock(gc_work_lock, self);
+    while(gc_workers_finished < active - 1)
+        waitVMWaitLock(gc_work_lock, self);
+
+    unlockVMWaitLock(gc_work_lock, self);
+}
+
+static void parallelTrace(Thread *self) {
+    parallel_marking = TRUE;
+    runGCWorkers(self, traceWorker);
+    parallel_marking = FALSE;
+}
+
+/* Mark everything reachable from the objects on the collecting
+   thread's mark stack.  If a stack overflowed, scan the heap for
+   marked objects and rescan them - objects whose children are already
+   marked push nothing, so this repeats until no further overflow */
+
+static void completeMark(Thread *self) {
+    MarkStack *ms = &mark_stacks[0];
+    Object *ob;
+    char *ptr;
+
+    for(;;) {
+        while((ob = popMarkStack(ms)) != NULL) {
+            markChildren(ob, ms);
+
+            if(gc_workers && (ms->tail - ms->head) >= PARALLEL_MARK_MIN) {
+                parallelTrace(self);
+                break;
+            }
+        }
+
+        if(!mark_stack_overflow)
+            break;
+
+        mark_stack_overflow = FALSE;
+        mark_stack_overflows++;
+
+        for(ptr = nurserybase; ptr < heaplimit;) {
+            unsigned int hdr = HEADER(ptr);
+            int size = HDR_SIZE(hdr);
+
+#ifdef DEBUG
+            printf("Block @0x%x size %d alloced %d\n", ptr, size, HDR_ALLOCED(hdr));
+#endif
+
+            if(HDR_ALLOCED(hdr)) {
+                Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+                if(IS_MARKED(ob)) {
+                    markChildren(ob, ms);
+
+                    while((ob = popMarkStack(ms)) != NULL)
+                        markChildren(ob, ms);
+                }
+            }
+
+            /* Skip to next block */
+            ptr += size;
+        }
+    }
+}
+
 extern void markInternedStrings();
 extern void markClasses();
 extern void markJNIGlobalRefs();
 extern void scanThreads();
-void markChildren(Object *ob);
+extern void updateThreads();
+extern void retireTLABs();
+extern void flushSATBBuffers();
 
-static void doMark(Thread *self) {
-    char *ptr;
-    int i, j;
+/* Mark the roots, leaving them on the collecting thread's mark stack */
 
-    clearMarkBits();
+static void markRoots(Thread *self) {
+    int i;
 
-    if(oom) MARK(oom);
+    for(i = 0; i <= gc_workers; i++)
+        mark_stacks[i].high = mark_stacks[i].marked = 0;
+    mark_stack_overflows = 0;
+
+    if(oom) markObject(oom);
     markClasses();
     markInternedStrings();
     markJNIGlobalRefs();
@@ -199,50 +780,39 @@ static void doMark(Thread *self) {
 
     if(run_finaliser_end > run_finaliser_start)
         for(i = run_finaliser_start; i < run_finaliser_end; i++)
-            MARK(run_finaliser_list[i]);
+            markAndPush(run_finaliser_list[i], &mark_stacks[0]);
     else {
         for(i = run_finaliser_start; i < run_finaliser_size; i++)
-            MARK(run_finaliser_list[i]);
+            markAndPush(run_finaliser_list[i], &mark_stacks[0]);
         for(i = 0; i < run_finaliser_end; i++)
-            MARK(run_finaliser_list[i]);
+            markAndPush(run_finaliser_list[i], &mark_stacks[0]);
     }
 
-    /* All roots should now be marked.  Scan the heap and recursively
-       mark all marked objects - once the heap has been scanned all
-       reachable objects should be marked */
-
-    for(ptr = heapbase; ptr < heaplimit;) {
-        unsigned int hdr = HEADER(ptr);
-        int size = HDR_SIZE(hdr);
-
-#ifdef DEBUG
-        printf("Block @0x%x size %d alloced %d\n", ptr, size, HDR_ALLOCED(hdr));
-#endif
-
-        if(HDR_ALLOCED(hdr)) {
-            Object *ob = (Object*)(ptr+HEADER_SIZE);
+    unlockVMWaitLock(run_fnlzr_lock, self);
+}
 
-            if(IS_MARKED(ob))
-                markChildren(ob);
-        }
+/* Called once all reachable objects are marked.  All other objects are
+   garbage.  Any object with a finalizer which is unmarked, however, must
+   have it's finalizer ran before collecting.  Scan the has_finaliser list
+   and move all unmarked objects to the run_finaliser list.  This ensures
+   that finalizers are ran only once, even if finalization resurrects the
+   object, as objects are only added to the has_finaliser list on
+   creation */
 
-        /* Skip to next block */
-        ptr += size;
-    }
+static void scanFinalizers(Thread *self) {
+    int i, j;
 
-    /* Now all reachable objects are marked.  All other objects are garbage.
-       Any object with a finalizer which is unmarked, however, must have it's
-       finalizer ran before collecting.  Scan the has_finaliser list and move
-       all unmarked objects to the run_finaliser list.  This ensures that
-       finalizers are ran only once, even if finalization resurrects the
-       object, as objects are only added to the has_finaliser list on
-       creation */
+    lockVMLock(has_fnlzr_lock, self);
+    unlockVMLock(has_fnlzr_lock, self);
+    lockVMWaitLock(run_fnlzr_lock, self);
 
     for(i = 0, j = 0; i < has_finaliser_count; i++) {
         Object *ob = has_finaliser_list[i];
   
         if(!IS_MARKED(ob)) {
-            markChildren(ob);
+            markAndPush(ob, &mark_stacks[0]);
+            completeMark(self);
+
             if(run_finaliser_start == run_finaliser_end) {
                 run_finaliser_start = 0;
                 run_finaliser_end = run_finaliser_size;
@@ -262,261 +832,1382 @@ static void doMark(Thread *self) {
     if(j != has_finaliser_count) {
         has_finaliser_count = j;
 
-	/* Extra finalizers to be ran, so signal the finalizer thread
-	   in case it needs waking up.  It won't run until it's
-	   resumed */
+	/* Extra finalizers to be ran, so signal the finalizer thread
+	   in case it needs waking up.  It won't run until it's
+	   resumed */
+
+	notifyVMWaitLock(run_fnlzr_lock, self);
+    }
+    unlockVMWaitLock(run_fnlzr_lock, self);
+}
+
+static int markedObjects(int *high) {
+    int marked = 0, i;
+
+    for(*high = 0, i = 0; i <= gc_workers; i++) {
+        marked += mark_stacks[i].marked;
+        if(mark_stacks[i].high > *high)
+            *high = mark_stacks[i].high;
+    }
+
+    return marked;
+}
+
+static void doMark(Thread *self) {
+    long long start = getTime();
+    float root_time, trace_time;
+    int marked, high;
+
+    clearMarkBits();
+
+    if(compacting) {
+        if(pinBitSize < markBitSize) {
+            pinBits = (unsigned int*)realloc(pinBits, markBitSize*sizeof(*pinBits));
+            pinBitSize = markBitSize;
+        }
+
+        memset(pinBits, 0, markBitSize*sizeof(*pinBits));
+    }
+
+    markRoots(self);
+
+    root_time = endTime(start)/1000000.0;
+    start = getTime();
+
+    /* All roots should now be marked and on the mark stack.  Trace
+       from them - once the stack is empty all reachable objects
+       should be marked */
+
+    completeMark(self);
+    scanFinalizers(self);
+
+    trace_time = endTime(start)/1000000.0;
+
+    if(verbosegc) {
+        marked = markedObjects(&high);
+
+        printf("<GC: Marked %d objects using %d threads, roots took %f seconds, trace took %f "
+               "seconds (mark stack high water %d, %d overflows)>\n", marked, gc_workers+1,
+               root_time, trace_time, high, mark_stack_overflows);
+    }
+}
+
+/* Sweeping.  After marking, the mark bits record exactly the surviving
+   objects, so the free chunks are the gaps between consecutive marked
+   objects - these can be found from the bitmap.  The dead objects are
+   walked only to check their lock words.  The heap is divided into fixed-size regions, and each
+   region owns the gaps which start within it (a gap may extend beyond
+   the end of its region).  Regions can therefore be swept independently:
+   in parallel by the gc worker threads, or in lazy mode, on demand by
+   gcMalloc after the mutators have resumed.
+
+   Regions are swept against sweepBits.  When sweeping eagerly this is
+   simply the mark bits of the collection.  When sweeping lazily it is
+   a snapshot of them, as the alloc bits change as objects are allocated
+   from already swept regions.  Unswept regions left over when the next
+   collection starts are simply forgotten - the next sweep rebuilds the
+   free lists from scratch, and the dead objects within them remain
+   walkable until then */
+
+#define LOG_SWEEP_REGION	16
+#define SWEEP_REGION_SIZE	(1<<LOG_SWEEP_REGION)
+
+#define BLOCK_BIT(ptr)		((((char*)ptr)-nurserybase)>>LOG_BYTESPERBIT)
+#define BIT_BLOCK(bit)		(nurserybase+((bit)<<LOG_BYTESPERBIT))
+
+typedef struct sweep_region {
+    Chunk *chunks;
+    int free;
+    int largest;
+} SweepRegion;
+
+static int lazy_sweep = FALSE;
+
+static unsigned int *sweepBits;
+static unsigned int *lazySweepBits;
+static int lazySweepBitSize = 0;
+static char *sweep_limit;
+
+static SweepRegion *sweep_regions;
+static int sweep_regions_size = 0;
+static int sweep_region_count = 0;
+static volatile int next_sweep_region;
+
+/* Largest free chunk found so far by the current sweep */
+static int sweep_largest;
+
+/* Return the first set bit in the bitmap at or after bit,
+   but before limit, or -1 if there isn't one */
+
+static int nextSetBit(unsigned int *bitmap, int bit, int limit) {
+    int word = bit>>LOG_MARKSIZEBITS;
+    unsigned int bits;
+
+    if(bit >= limit)
+        return -1;
+
+    bits = bitmap[word] & (~0U<<(bit&(MARKSIZEBITS-1)));
+
+    for(;;) {
+        if(bits) {
+            bit = (word<<LOG_MARKSIZEBITS) + ffs(bits) - 1;
+            return bit < limit ? bit : -1;
+        }
+
+        if((++word<<LOG_MARKSIZEBITS) >= limit)
+            return -1;
+
+        bits = bitmap[word];
+    }
+}
+
+/* Return the last set bit in the bitmap before bit,
+   but not before low, or -1 if there isn't one */
+
+static int prevSetBit(unsigned int *bitmap, int bit, int low) {
+    int word;
+    unsigned int bits;
+
+    if(bit-- <= low)
+        return -1;
+
+    word = bit>>LOG_MARKSIZEBITS;
+    bits = bitmap[word] & (~0U>>(MARKSIZEBITS-1-(bit&(MARKSIZEBITS-1))));
+
+    for(;;) {
+        if(bits) {
+            bit = (word<<LOG_MARKSIZEBITS) + MARKSIZEBITS-1 - __builtin_clz(bits);
+            return bit >= low ? bit : -1;
+        }
+
+        if(--word < (low>>LOG_MARKSIZEBITS))
+            return -1;
+
+        bits = bitmap[word];
+    }
+}
+
+#define BLOCK_END(bit) (BIT_BLOCK(bit)+HDR_SIZE(HEADER(BIT_BLOCK(bit))))
+
+/* Sanity check the dead objects in a gap before it is freed - an object
+   with a fat lock (lock word shape bit set) must still be reachable, or
+   its monitor would be lost.  The gap is still walkable (see above) */
+
+static void checkFreedObjects(char *gap, char *next) {
+    char *ptr;
+
+    for(ptr = gap; ptr < next; ptr += HDR_SIZE(HEADER(ptr)))
+        if(HDR_ALLOCED(HEADER(ptr)) && (((Object*)(ptr+HEADER_SIZE))->lock & 1)) {
+            printf("freeing ob with fat lock...\n");
+            exit(0);
+        }
+}
+
+/* Find the free chunks which start within [start, end) of the space
+   [low, limit), given a bitmap of the surviving objects.  A gap is
+   owned by the range in which it starts, so ranges can be swept
+   independently */
+
+static void sweepRange(unsigned int *bitmap, char *start, char *end,
+                       char *low, char *limit, SweepRegion *r) {
+    int low_bit = BLOCK_BIT(low);
+    int limit_bit = BLOCK_BIT(limit);
+    char *gap;
+    int bit;
+
+    r->chunks = NULL;
+    r->free = r->largest = 0;
+
+    /* Find the first gap owned by this range.  If the gap
+       containing the start of the range began before it,
+       start from the end of the first survivor */
+
+    bit = prevSetBit(bitmap, BLOCK_BIT(start), low_bit);
+    gap = bit == -1 ? low : BLOCK_END(bit);
+
+    if(gap < start) {
+        if((bit = nextSetBit(bitmap, BLOCK_BIT(start), limit_bit)) == -1)
+            return;
+
+        gap = BLOCK_END(bit);
+    }
+
+    while(gap < end) {
+        char *next;
+
+        bit = nextSetBit(bitmap, BLOCK_BIT(gap), limit_bit);
+        next = bit == -1 ? limit : BIT_BLOCK(bit);
+
+        if(next > gap) {
+            Chunk *chunk = (Chunk*)gap;
+            int size = next - gap;
+
+            TRACE_GC(("FREE: Free chunk @ 0x%x size %d\n", chunk, size));
+
+            checkFreedObjects(gap, next);
+            chunk->header = size;
+            chunk->next = r->chunks;
+            r->chunks = chunk;
+
+            if(size > r->largest)
+                r->largest = size;
+
+            r->free += size;
+        }
+
+        if(bit == -1)
+            break;
+
+        gap = BLOCK_END(bit);
+    }
+}
+
+static void sweepRegion(int region, SweepRegion *r) {
+    char *start = heapbase + (region<<LOG_SWEEP_REGION);
+    char *end = start + SWEEP_REGION_SIZE;
+
+    if(end > sweep_limit)
+        end = sweep_limit;
+
+    sweepRange(sweepBits, start, end, heapbase, sweep_limit, r);
+}
+
+/* Claim the next unswept region, returning -1 if there are none */
+
+static int claimSweepRegion() {
+    int region;
+
+    do {
+        if((region = next_sweep_region) >= sweep_region_count)
+            return -1;
+    } while(!COMPARE_AND_SWAP(&next_sweep_region, region, region + 1));
+
+    return region;
+}
+
+static void sweepWorker(int id, int active) {
+    int region;
+
+    while((region = claimSweepRegion()) != -1)
+        sweepRegion(region, &sweep_regions[region]);
+}
+
+/* Add the chunks found by sweeping a region onto the free lists */
+
+static void addSweptChunks(SweepRegion *r) {
+    Chunk *chunk, *next;
+
+    for(chunk = r->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        addChunk(chunk);
+    }
+
+    heapfree += r->free;
+
+    if(r->largest > sweep_largest)
+        sweep_largest = r->largest;
+}
+
+/* Lazily sweep the next unswept region.  Called from gcMalloc with
+   the heap lock held.  Returns FALSE if all regions have been swept */
+
+static int sweepNextRegion() {
+    int region = next_sweep_region;
+    SweepRegion r;
+
+    if(region >= sweep_region_count)
+        return FALSE;
+
+    next_sweep_region = region + 1;
+    sweepRegion(region, &r);
+    addSweptChunks(&r);
+
+    TRACE_GC(("Lazily swept region %d - %d bytes free\n", region, r.free));
+
+    if(next_sweep_region == sweep_region_count)
+        checkFragmentation();
+    return TRUE;
+}
+
+/* Lazily sweep until a free chunk of at least n bytes has been
+   found, returning the size of the largest chunk found */
+
+static int lazySweep(int n) {
+    while(sweep_largest < n && sweepNextRegion());
+    return sweep_largest;
+}
+
+/* Rebuild the nursery's free list, given a bitmap
+   of the objects which are to remain within it */
+
+static void rebuildNursery(unsigned int *bitmap) {
+    Chunk *chunk, *next;
+    SweepRegion r;
+
+    sweepRange(bitmap, nurserybase, nurserylimit, nurserybase, nurserylimit, &r);
+
+    nursery_free = NULL;
+
+    for(chunk = r.chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        chunk->next = nursery_free;
+        nursery_free = chunk;
+    }
+
+    if(verbosegc)
+        printf("<GC: Nursery has %d bytes free out of %d>\n", r.free, nurserylimit-nurserybase);
+}
+
+static int doSweep(Thread *self) {
+    unsigned int *bits;
+    int unmarked = 0;
+    int i;
+
+    /* Count the objects freed by the collection for
+       verbose output - these are alloced but unmarked */
+    if(verbosegc)
+        for(i = 0; i < markBitSize; i++)
+            unmarked += __builtin_popcount(allocBits[i] & ~markBits[i]);
+
+    /* The free lists are rebuilt from scratch - the amount of free
+       heap and the largest free chunk are recalculated as regions
+       are swept */
+
+    memset(bins, 0, sizeof(bins));
+    memset(binmap, 0, sizeof(binmap));
+    memset(largebins, 0, sizeof(largebins));
+    heapfree = sweep_largest = 0;
+
+    sweep_limit = heaplimit;
+    sweep_region_count = ((heaplimit-heapbase)+SWEEP_REGION_SIZE-1)>>LOG_SWEEP_REGION;
+    next_sweep_region = 0;
+
+    if(lazy_sweep) {
+        if(lazySweepBitSize < markBitSize) {
+            lazySweepBits = (unsigned int*)realloc(lazySweepBits,
+                                                   markBitSize*sizeof(*lazySweepBits));
+            lazySweepBitSize = markBitSize;
+        }
+
+        memcpy(lazySweepBits, markBits, markBitSize*sizeof(*markBits));
+        sweepBits = lazySweepBits;
+    } else {
+        sweepBits = markBits;
+
+        if(sweep_regions_size < sweep_region_count) {
+            sweep_regions = (SweepRegion*)realloc(sweep_regions,
+                                                  sweep_region_count*sizeof(SweepRegion));
+            sweep_regions_size = sweep_region_count;
+        }
+
+        if(gc_workers && sweep_region_count > 1)
+            runGCWorkers(self, sweepWorker);
+        else
+            sweepWorker(0, 1);
+
+        for(i = 0; i < sweep_region_count; i++)
+            addSweptChunks(&sweep_regions[i]);
+
+        checkFragmentation();
+    }
+
+    /* Objects in the nursery are collected in place by a major
+       collection - the surviving young objects stay in the nursery,
+       and the free space around them is reused */
+
+    if(nurserylimit != nurserybase)
+        rebuildNursery(markBits);
+
+    /* The surviving objects are now exactly the marked objects -
+       the mark bits become the new alloc bits */
+    bits = allocBits;
+    allocBits = markBits;
+    markBits = bits;
+
+#ifdef DEBUG
+{
+    Chunk *c;
+
+    for(i = 1; i < NUM_BINS; i++)
+        for(c = bins[i]; c != NULL; c = c->next)
+            printf("Chunk @0x%x size: %d\n", c, c->header);
+    for(i = 0; i < NUM_LARGE_BINS; i++)
+        for(c = largebins[i]; c != NULL; c = c->next)
+            printf("Chunk @0x%x size: %d\n", c, c->header);
+}
+#endif
+
+    if(verbosegc) {
+        int size = heaplimit-heapbase;
+
+        printf("<GC: Freed %d objects>\n", unmarked);
+
+        if(lazy_sweep)
+            printf("<GC: %d regions left to sweep lazily>\n", sweep_region_count);
+        else {
+            long long pcnt_used = ((long long)heapfree)*100/size;
+            printf("<GC: Swept %d regions using %d threads>\n", sweep_region_count,
+                   sweep_region_count > 1 ? gc_workers+1 : 1);
+            printf("<GC: Largest block is %d total free is %d out of %d (%lld%)>\n",
+                   sweep_largest, heapfree, size, pcnt_used);
+            printFreeLists();
+        }
+    }
+
+    /* Return the size of the largest free chunk in heap - this
+       is the largest allocation request that can be satisfied.
+       When sweeping lazily nothing has been swept yet */
+
+    return sweep_largest;
+}
+
+/* Run all outstanding finalizers.  This is called synchronously
+ * if we run out of memory and asyncronously by the finalizer
+ * thread.  In both cases suspension is disabled, to reduce
+ * back-to-back enable/disable... */
+
+static Thread *runningFinalizers = NULL;
+static int runFinalizers() {
+    Thread *self = threadSelf();
+    int ret = FALSE;
+
+    lockVMWaitLock(run_fnlzr_lock, self);
+
+    if(runningFinalizers == self)
+        goto out;
+
+    while(runningFinalizers) {
+        ret = TRUE;
+        waitVMWaitLock(run_fnlzr_lock, self);
+    }
+
+    if((run_finaliser_start == run_finaliser_size) && (run_finaliser_end == 0))
+        goto out;
+
+    runningFinalizers = self;
+
+    TRACE_FNLZ(("run_finaliser_start %d\n",run_finaliser_start));
+    TRACE_FNLZ(("run_finaliser_end %d\n",run_finaliser_end));
+    TRACE_FNLZ(("run_finaliser_size %d\n",run_finaliser_size));
+
+    if(verbosegc) {
+        int diff = run_finaliser_end - run_finaliser_start;
+        printf("<Running %d finalizers>\n", diff > 0 ? diff : diff + run_finaliser_size);
+    }
+
+    do {
+        Object *ob;
+        run_finaliser_start %= run_finaliser_size;
+        ob = run_finaliser_list[run_finaliser_start];
+
+        unlockVMWaitLock(run_fnlzr_lock, self);
+	enableSuspend(self);
+
+	/* Run the finalizer method */
+        executeMethod(ob, CLASS_CB(ob->class)->finalizer);
+
+	/* We entered with suspension off - nothing
+	 * else interesting on stack, so use previous
+	 * stack top. */
+
+        disableSuspend0(self, getStackTop(self));
+        lockVMWaitLock(run_fnlzr_lock, self);
+
+        /* Clear any exceptions - exceptions thrown in finalizers are
+           silently ignored */
+
+	clearException();
+    } while(++run_finaliser_start != run_finaliser_end);
+
+    run_finaliser_start = run_finaliser_size;
+    run_finaliser_end = 0;
+    runningFinalizers = NULL;
+
+    ret = TRUE;
+out:
+    notifyVMWaitLock(run_fnlzr_lock, self);
+    unlockVMWaitLock(run_fnlzr_lock, self);
+    return ret;
+}
+
+/* The minor collector.  Objects in the nursery reachable from the roots
+   or from the old generation are evacuated by copying them into the
+   old generation - there is no aging, survivors are promoted en masse.
+   Objects which can't be moved are left in place (pinned).  These are
+   objects referenced from roots (as thread stacks are scanned
+   conservatively, and other roots can't be updated), objects with a
+   lock word (the monitor cache is keyed by address), objects whose
+   address has escaped (PINNED_BIT), and objects for which promotion
+   failed.  Pinned objects are recorded in the mark bits, which are
+   not otherwise used outside of a major collection.
+
+   References from the old generation are found by scanning the objects
+   starting within dirty cards, so the work done is proportional to the
+   survivors and the dirty cards, rather than the size of the heap.
+
+   Objects with PINNED_BIT set are never promoted - they stay in the
+   nursery for their lifetime, and are rescanned by every minor
+   collection.  Only hashed objects and class loaders are pinned this
+   way, so the space lost is small */
+
+static int minor_gc = FALSE;
+
+/* Variables used to store verbose gc info */
+static int promoted, promoted_bytes, pinned;
+
+/* A forwarded object's class word holds the address of its copy */
+#define IS_FORWARDED(ob)	(((unsigned int)(ob)->class)&1)
+#define FORWARDEE(ob)		((Object*)(((unsigned int)(ob)->class)&~1))
+#define FORWARD(ob, copy)	(ob)->class = (Class*)(((unsigned int)(copy))|1)
+
+/* Bit of the first object at or after ptr, and the object of a bit */
+#define OBJECT_BIT(ptr)		((((char*)ptr)-nurserybase+HEADER_SIZE-1)>>LOG_BYTESPERBIT)
+#define BIT_OBJECT(bit)		((Object*)(BIT_BLOCK(bit)+HEADER_SIZE))
+
+/* Objects to be scanned are held on the collecting thread's mark
+   stack.  Unlike marking, there's no fallback if it can't grow */
+
+static void pushScavenge(Object *ob) {
+    MarkStack *ms = &mark_stacks[0];
+
+    if(ms->tail == ms->size && !growMarkStack(ms)) {
+        printf("Couldn't grow scavenge stack.  Aborting.\n");
+        exit(0);
+    }
+
+    ms->stack[ms->tail++] = ob;
+}
+
+static void pinYoung(Object *ob) {
+    if(!IS_MARKED(ob)) {
+        TRACE_GC(("Pinned young object @0x%x\n", ob));
+        MARK(ob);
+        pushScavenge(ob);
+        pinned++;
+    }
+}
+
+/* Allocate a block in the old generation to promote an object into */
+
+static Chunk *allocPromoted(int size) {
+    Chunk *chunk;
+    int len;
+
+    while((chunk = findChunk(size)) == NULL)
+        if(!lazy_sweep || !sweepNextRegion())
+            return NULL;
+
+    if((len = chunk->header) > size) {
+        Chunk *rem = (Chunk*)((char*)chunk + size);
+        rem->header = len - size;
+        addChunk(rem);
+    }
+
+    heapfree -= size;
+    return chunk;
+}
+
+/* Return the new address of a nursery object, copying
+   it into the old generation if it can be moved */
+
+static Object *evacuate(Object *ob) {
+    char *block = ((char*)ob)-HEADER_SIZE;
+    unsigned int hdr = HEADER(block);
+    int size = HDR_SIZE(hdr);
+    Chunk *chunk;
+    Object *copy;
+
+    if(IS_FORWARDED(ob))
+        return FORWARDEE(ob);
+
+    if(IS_MARKED(ob))
+        return ob;
+
+    if(ob->lock != 0 || (hdr & (FLC_BIT|PINNED_BIT)) ||
+                 (chunk = allocPromoted(size)) == NULL) {
+        pinYoung(ob);
+        return ob;
+    }
+
+    memcpy(chunk, block, size);
+    copy = (Object*)(((char*)chunk)+HEADER_SIZE);
+    SET_ALLOCED(copy);
+    FORWARD(ob, copy);
+    pushScavenge(copy);
+
+    TRACE_GC(("Promoted object @0x%x to 0x%x\n", ob, copy));
+
+    promoted++;
+    promoted_bytes += size;
+    return copy;
+}
+
+#define SCAVENGE_SLOT(slot, young)              \
+{                                               \
+    Object *ref = (Object*)*(slot);             \
+    if(IS_YOUNG(ref)) {                         \
+        *(slot) = (u4)(ref = evacuate(ref));    \
+        young |= IS_YOUNG(ref);                 \
+    }                                           \
+}
+
+/* Evacuate all nursery objects referenced by the object, returning
+   TRUE if it still references the nursery afterwards */
+
+static int scavengeObject(Object *ob) {
+    int young = FALSE;
+    int i;
+
+    if(ob->class == NULL)
+        return FALSE;
+
+    if(IS_CLASS(ob)) {
+        ClassBlock *cb = CLASS_CB((Class*)ob);
+
+        for(i = 0; i < cb->static_ref_count; i++)
+            SCAVENGE_SLOT(cb->static_refs[i], young);
+    } else {
+        ClassBlock *cb = CLASS_CB(ob->class);
+        u4 *body = INST_DATA(ob);
+
+        if(cb->name[0] == '[') {
+            if((cb->name[1] == 'L') || (cb->name[1] == '['))
+                for(i = 1; i <= body[0]; i++)
+                    SCAVENGE_SLOT(&body[i], young);
+        } else
+            for(i = 0; i < cb->ref_count; i++)
+                SCAVENGE_SLOT(&body[cb->ref_offsets[i]], young);
+    }
+
+    return young;
+}
+
+/* Scavenge the objects starting within each dirty card of the old
+   generation.  A card which still references the nursery afterwards
+   (e.g. a pinned object) is left dirty for the next collection */
+
+static void scanCards() {
+    unsigned int card = ((unsigned int)heapbase)>>LOG_CARD_SIZE;
+    unsigned int last = ((unsigned int)heaplimit-1)>>LOG_CARD_SIZE;
+    int limit = OBJECT_BIT(heaplimit);
+
+    while(card <= last) {
+        char *start, *end;
+        int bit, end_bit;
+        int young = FALSE;
+
+        /* Skip clean cards a word at a time */
+        if(!(card&3) && card+3 <= last && *(unsigned int*)&card_table_base[card] == 0) {
+            card += 4;
+            continue;
+        }
+
+        if(card_table_base[card] == CARD_CLEAN) {
+            card++;
+            continue;
+        }
+
+        card_table_base[card] = CARD_CLEAN;
+
+        start = (char*)(card<<LOG_CARD_SIZE);
+        end = start + CARD_SIZE;
+
+        if(start < heapbase)
+            start = heapbase;
+
+        if((end_bit = OBJECT_BIT(end)) > limit)
+            end_bit = limit;
+
+        for(bit = OBJECT_BIT(start); (bit = nextSetBit(allocBits, bit, end_bit)) != -1; bit++)
+            young |= scavengeObject(BIT_OBJECT(bit));
+
+        if(young)
+            card_table_base[card] = CARD_DIRTY;
+
+        card++;
+    }
+}
+
+static void scavenge(Thread *self) {
+    int nursery_words = ((nurserylimit-nurserybase)>>LOG_BYTESPERBIT)>>LOG_MARKSIZEBITS;
+    MarkStack *ms = &mark_stacks[0];
+    long long start = getTime();
+    float root_time;
+    Object *ob;
+
+    promoted = promoted_bytes = pinned = 0;
+
+    /* The nursery is a whole number of cards, so its mark
+       bits are whole words, and can be cleared separately */
+    memset(markBits, 0, nursery_words*sizeof(*markBits));
+
+    /* Pin the nursery objects referenced by the roots.  Classes are
+       always in the old generation, and their statics are found from
+       the cards, like any other reference from the old generation */
+
+    minor_gc = TRUE;
+
+    if(oom) markObject(oom);
+    markInternedStrings();
+    markJNIGlobalRefs();
+    scanThreads();
+
+    minor_gc = FALSE;
+
+    /* Now everything which can't move is pinned, the nursery
+       objects referenced from precise stack slots are copied */
+    updateThreads();
+
+    root_time = endTime(start)/1000000.0;
+
+    scanCards();
+
+    while((ob = popMarkStack(ms)) != NULL)
+        if(scavengeObject(ob) && !IS_YOUNG(ob))
+            WRITE_BARRIER(ob);
+
+    /* The only live objects left in the nursery are now the pinned
+       objects - everything else is garbage, or has been copied */
+
+    rebuildNursery(markBits);
+    memcpy(allocBits, markBits, nursery_words*sizeof(*markBits));
+
+    if(verbosegc)
+        printf("<GC: Minor collection promoted %d objects using %d bytes, %d pinned, "
+               "roots took %f seconds, total %f seconds>\n", promoted, promoted_bytes,
+               pinned, root_time, endTime(start)/1000000.0);
+}
+
+/* Compaction.  A heap with plenty of free space, but only in small
+   pieces, is compacted rather than swept - surviving objects in the old
+   generation are slid down towards heapbase, keeping their order.  The
+   objects which can't be moved are left in place, and the objects below
+   each slide up to it, leaving a free chunk in front.  These are objects
+   referenced from roots (which can't be updated), classes, objects with
+   a lock word (the monitor cache is keyed by address), and objects whose
+   address has escaped (PINNED_BIT, e.g. hashed objects).  Objects in the
+   nursery are never moved.
+
+   The header has no room for a forwarding address.  Instead the new
+   address of the first surviving object in each block of the heap is
+   recorded, and the new address of any other object is found from it,
+   by adding up the sizes of the survivors before it in the block.  The
+   heap is compacted in three passes over the mark bits - compute the
+   new addresses, update all references, and then move the objects */
+
+#define LOG_COMPACT_BLOCK	8
+#define COMPACT_BLOCK(ptr)	((((char*)ptr)-heapbase)>>LOG_COMPACT_BLOCK)
+
+/* The heap is compacted on the next collection if, after sweeping,
+   the largest free chunk is less than COMPACT_THRESHOLD percent of
+   the free heap, and there's enough free heap to be worth it */
+#define COMPACT_THRESHOLD	25
+#define COMPACT_MIN_FREE	(64*1024)
+
+static int compact_heap = FALSE;
+static int compact_next = FALSE;
+
+static char **compact_fwd;
+static int compact_fwd_size = 0;
+
+/* Variables used to store verbose gc info */
+static int moved, moved_bytes, compact_pinned;
+
+static void checkFragmentation() {
+    compact_next = compact_heap && heapfree >= COMPACT_MIN_FREE &&
+                   sweep_largest < ((long long)heapfree)*COMPACT_THRESHOLD/100;
+
+    if(compact_next && verbosegc)
+        printf("<GC: Heap fragmented (largest block %d, %d free) - will compact>\n",
+               sweep_largest, heapfree);
+}
+
+/* Pass 1 - decide which objects can be moved, and
+   record the new address of the first in each block */
+
+static void computeForwarding() {
+    int bit = BLOCK_BIT(heapbase);
+    int limit = BLOCK_BIT(heaplimit);
+    char *free = heapbase;
+    int last = -1;
+
+    for(; (bit = nextSetBit(markBits, bit, limit)) != -1; bit++) {
+        char *block = BIT_BLOCK(bit);
+        unsigned int hdr = HEADER(block);
+        Object *ob = (Object*)(block+HEADER_SIZE);
+        int size = HDR_SIZE(hdr);
+        int pin = IS_PINNED(ob) || (hdr & (FLC_BIT|PINNED_BIT)) ||
+                            ob->lock != 0 || IS_CLASS(ob);
+
+        if(pin)
+            PIN(ob);
+
+        if(COMPACT_BLOCK(block) != last) {
+            last = COMPACT_BLOCK(block);
+            compact_fwd[last] = pin ? block : free;
+        }
+
+        if(pin) {
+            free = block + size;
+            compact_pinned++;
+        } else {
+            if(block != free) {
+                moved++;
+                moved_bytes += size;
+            }
+            free += size;
+        }
+    }
+}
+
+/* Return the new address of an object in the old generation */
+
+static Object *forwardObject(Object *ob) {
+    char *block = ((char*)ob)-HEADER_SIZE;
+    int cblock = COMPACT_BLOCK(block);
+    int bit = BLOCK_BIT(heapbase+(cblock<<LOG_COMPACT_BLOCK));
+    int ob_bit = BLOCK_BIT(block);
+    char *dest = compact_fwd[cblock];
+
+    if(IS_PINNED(ob))
+        return ob;
+
+    /* An object is placed after the one before it, or if
+       that's pinned, immediately after the pinned object */
+
+    for(; (bit = nextSetBit(markBits, bit, ob_bit)) != -1; bit++) {
+        char *prev = BIT_BLOCK(bit);
+        int size = HDR_SIZE(HEADER(prev));
+
+        dest = IS_PINNED(prev+HEADER_SIZE) ? prev + size : dest + size;
+    }
+
+    return (Object*)(dest+HEADER_SIZE);
+}
+
+#define FORWARD_SLOT(slot, young)               \
+{                                               \
+    Object *ref = (Object*)*(slot);             \
+    if(IS_OLD(ref))                             \
+        *(slot) = (u4)forwardObject(ref);       \
+    else                                        \
+        young |= IS_YOUNG(ref);                 \
+}
+
+/* Update the object's references to the old generation,
+   returning TRUE if it references the nursery */
+
+static int updateObject(Object *ob) {
+    int young = FALSE;
+    int i;
+
+    if(ob->class == NULL)
+        return FALSE;
+
+    if(IS_CLASS(ob)) {
+        ClassBlock *cb = CLASS_CB((Class*)ob);
+
+        for(i = 0; i < cb->static_ref_count; i++)
+            FORWARD_SLOT(cb->static_refs[i], young);
+    } else {
+        ClassBlock *cb = CLASS_CB(ob->class);
+        u4 *body = INST_DATA(ob);
+
+        if(cb->name[0] == '[') {
+            if((cb->name[1] == 'L') || (cb->name[1] == '['))
+                for(i = 1; i <= body[0]; i++)
+                    FORWARD_SLOT(&body[i], young);
+        } else
+            for(i = 0; i < cb->ref_count; i++)
+                FORWARD_SLOT(&body[cb->ref_offsets[i]], young);
+    }
+
+    return young;
+}
+
+/* Pass 2 - update the references held in all surviving objects, in
+   both generations, in precise stack slots, and in the finalizer lists.
+   Old objects which reference the nursery have the card of their new
+   address dirtied */
+
+static void updateReferences() {
+    int limit = BLOCK_BIT(heaplimit);
+    int bit, i;
+
+    for(bit = 0; (bit = nextSetBit(markBits, bit, limit)) != -1; bit++) {
+        Object *ob = BIT_OBJECT(bit);
+
+        if(updateObject(ob) && IS_OLD(ob))
+            WRITE_BARRIER(forwardObject(ob));
+    }
+
+    updateThreads();
+
+    for(i = 0; i < has_finaliser_count; i++)
+        if(IS_OLD(has_finaliser_list[i]))
+            has_finaliser_list[i] = forwardObject(has_finaliser_list[i]);
+
+    if(run_finaliser_end > run_finaliser_start) {
+        for(i = run_finaliser_start; i < run_finaliser_end; i++)
+            if(IS_OLD(run_finaliser_list[i]))
+                run_finaliser_list[i] = forwardObject(run_finaliser_list[i]);
+    } else {
+        for(i = run_finaliser_start; i < run_finaliser_size; i++)
+            if(IS_OLD(run_finaliser_list[i]))
+                run_finaliser_list[i] = forwardObject(run_finaliser_list[i]);
+        for(i = 0; i < run_finaliser_end; i++)
+            if(IS_OLD(run_finaliser_list[i]))
+                run_finaliser_list[i] = forwardObject(run_finaliser_list[i]);
+    }
+}
+
+static void addCompactedChunk(char *ptr, int size) {
+    Chunk *chunk = (Chunk*)ptr;
+
+    TRACE_GC(("FREE: Free chunk @ 0x%x size %d\n", chunk, size));
+
+    chunk->header = size;
+    addChunk(chunk);
+
+    heapfree += size;
+    if(size > sweep_largest)
+        sweep_largest = size;
+}
+
+/* Pass 3 - slide the objects down, rebuilding the alloc bits and
+   the free lists.  An object is only ever moved to a lower address,
+   and objects are moved in address order, so the headers and mark
+   bits of the objects not yet moved are still intact */
+
+static void moveObjects() {
+    int bit = BLOCK_BIT(heapbase);
+    int limit = BLOCK_BIT(heaplimit);
+    int entry = MARKENTRY(heapbase);
+    char *free = heapbase;
+
+    memset(bins, 0, sizeof(bins));
+    memset(binmap, 0, sizeof(binmap));
+    memset(largebins, 0, sizeof(largebins));
+    heapfree = sweep_largest = 0;
+
+    memset(allocBits + entry, 0, (markBitSize-entry)*sizeof(*allocBits));
+
+    for(; (bit = nextSetBit(markBits, bit, limit)) != -1; bit++) {
+        char *block = BIT_BLOCK(bit);
+        int size = HDR_SIZE(HEADER(block));
+
+        if(IS_PINNED(block+HEADER_SIZE)) {
+            if(block > free)
+                addCompactedChunk(free, block-free);
+            free = block;
+        } else if(block != free)
+            memmove(free, block, size);
+
+        SET_ALLOCED(free+HEADER_SIZE);
+        free += size;
+    }
+
+    if(free < heaplimit)
+        addCompactedChunk(free, heaplimit-free);
+}
+
+static int doCompact(Thread *self) {
+    int blocks = ((heaplimit-heapbase)>>LOG_COMPACT_BLOCK)+1;
+    int nursery_words = MARKENTRY(heapbase);
+    int unmarked = 0;
+    int i;
+
+    if(verbosegc)
+        for(i = 0; i < markBitSize; i++)
+            unmarked += __builtin_popcount(allocBits[i] & ~markBits[i]);
+
+    if(compact_fwd_size < blocks) {
+        compact_fwd = (char**)realloc(compact_fwd, blocks*sizeof(*compact_fwd));
+        compact_fwd_size = blocks;
+    }
+
+    moved = moved_bytes = compact_pinned = 0;
+
+    computeForwarding();
+
+    /* The cards of the old generation are rebuilt as references
+       are updated, as objects change cards when they're moved */
+
+    if(nurserylimit != nurserybase)
+        memset(&card_table_base[((unsigned int)heapbase)>>LOG_CARD_SIZE], CARD_CLEAN,
+               ((heaplimit-heapbase)>>LOG_CARD_SIZE)+2);
+
+    updateReferences();
+    moveObjects();
+
+    /* Nothing is left to sweep lazily */
+    sweep_region_count = next_sweep_region = 0;
+
+    /* The nursery is collected in place, as by a sweep */
+    if(nurserylimit != nurserybase)
+        rebuildNursery(markBits);
+
+    memcpy(allocBits, markBits, nursery_words*sizeof(*markBits));
+
+    compact_next = FALSE;
+
+    if(verbosegc) {
+        int size = heaplimit-heapbase;
+        long long pcnt_used = ((long long)heapfree)*100/size;
+
+        printf("<GC: Freed %d objects>\n", unmarked);
+        printf("<GC: Compacted heap - moved %d objects using %d bytes, %d pinned>\n",
+               moved, moved_bytes, compact_pinned);
+        printf("<GC: Largest block is %d total free is %d out of %d (%lld%)>\n",
+               sweep_largest, heapfree, size, pcnt_used);
+    }
+
+    return sweep_largest;
+}
+
+/* Concurrent marking.  To shorten the pauses on a large heap, most of
+   the marking can be done by a background thread while the mutators
+   run.  A cycle starts with a short pause to mark the roots, after
+   which the marker thread traces the heap concurrently.  A final
+   pause (the remark) completes the marking, and then sweeps.
+
+   Marking is snapshot-at-the-beginning (Yuasa) - every object reachable
+   when the roots were marked is found, as is every object allocated
+   since (these are marked as they're allocated).  Anything else is
+   garbage, as an unreachable object can't become reachable again.
+   The mutators must therefore record any reference they overwrite
+   while marking is in progress (SATB_BARRIER), in case it's the only
+   path to an object not yet marked.  The recorded references are held
+   in a buffer per thread, handed to a global queue when full, and are
+   marked by the marker thread or on the remark.  As references are only
+   recorded, never traced by the mutators, the roots don't need to be
+   rescanned on the remark.
+
+   Objects can't be moved while the mutators run, so concurrent marking
+   isn't used with a nursery, and the heap is swept rather than
+   compacted.  If an allocation fails during a cycle, the cycle is
+   completed immediately, before falling back to a full collection */
+
+/* A cycle is started when the free heap falls
+   below this percentage of the heap */
+#define CONCURRENT_TRIGGER	25
+
+#define SATB_BUFFER_SIZE	256
+
+static int concurrent_gc = FALSE;
+
+static int conc_requested = FALSE;
+static volatile int conc_tracing = FALSE;
+static volatile int conc_stop = FALSE;
+
+static Object **satb_queue;
+static int satb_queue_count = 0;
+static int satb_queue_size = 0;
+
+/* Variables used to store verbose gc info */
+static long long conc_start;
+static float conc_root_time;
+
+/* Move a thread's SATB buffer onto the global queue.
+   Called with satb_lock held */
+
+static void queueSATBBuffer(Thread *thread) {
+    if(satb_queue_count + thread->satb_top > satb_queue_size) {
+        satb_queue_size += SATB_BUFFER_SIZE * 16;
+        satb_queue = (Object**)realloc(satb_queue, satb_queue_size*sizeof(Object*));
+    }
+
+    memcpy(&satb_queue[satb_queue_count], thread->satb_buf,
+           thread->satb_top*sizeof(Object*));
+    satb_queue_count += thread->satb_top;
+    thread->satb_top = 0;
+}
+
+/* Record a reference overwritten while marking.  Called by
+   SATB_BARRIER before the store is done */
+
+void satbEnqueue(Object *ob) {
+    Thread *self = threadSelf();
+
+    if(self->satb_top == SATB_BUFFER_SIZE || self->satb_buf == NULL) {
+        disableSuspend(self);
+        lockVMLock(satb_lock, self);
+
+        if(self->satb_buf == NULL)
+            self->satb_buf = (Object**)malloc(SATB_BUFFER_SIZE*sizeof(Object*));
+        else
+            queueSATBBuffer(self);
+
+        unlockVMLock(satb_lock, self);
+        enableSuspend(self);
+    }
+
+    /* The remark reads the buffer with the thread suspended */
+    deferSuspend(self);
+    self->satb_buf[self->satb_top++] = ob;
+    undeferSuspend(self);
+}
+
+/* A recorded reference is treated conservatively - stores into non-reference
+   fields of the same size also go through the barrier.  An object which
+   is not yet in the alloc bits was allocated during marking, and is
+   marked already */
+
+static void markSATBRef(Object *ob, MarkStack *ms) {
+    if(IS_OBJECT(ob) && IS_ALLOCED(ob))
+        markAndPush(ob, ms);
+}
+
+/* Empty a thread's SATB buffer, marking the references if marking.
+   Called with all threads suspended, and satb_lock held */
+
+void flushSATBBuffer(Thread *thread) {
+    int i;
+
+    if(satb_marking)
+        for(i = 0; i < thread->satb_top; i++)
+            markSATBRef(thread->satb_buf[i], &mark_stacks[0]);
+
+    thread->satb_top = 0;
+}
+
+/* Mark the references in the global queue, returning
+   FALSE if it was empty */
+
+static int drainSATBQueue(Thread *self) {
+    int i, count;
+
+    lockVMLock(satb_lock, self);
+
+    for(i = 0; i < satb_queue_count; i++)
+        markSATBRef(satb_queue[i], &mark_stacks[0]);
+
+    count = satb_queue_count;
+    satb_queue_count = 0;
 
-	notifyVMWaitLock(run_fnlzr_lock, self);
-    }
-    unlockVMWaitLock(run_fnlzr_lock, self);
+    unlockVMLock(satb_lock, self);
+    return count != 0;
 }
 
-static int doSweep(Thread *self) {
-    char *ptr;
-    Chunk newlist;
-    Chunk *last = &newlist;
-
-    /* Will hold the size of the largest free chunk
-       after scanning */
-    int largest = 0;
+/* Called with the heap lock held */
 
-    /* Variables used to store verbose gc info */
-    int marked = 0, unmarked = 0, freed = 0;
+static void checkConcurrentMark(Thread *self) {
+    if(satb_marking || conc_requested)
+        return;
 
-    /* Amount of free heap is re-calculated during scan */
-    heapfree = 0;
+    /* When sweeping lazily, the free heap is not
+       known until all regions have been swept */
+    if(lazy_sweep && next_sweep_region < sweep_region_count)
+        return;
 
-    /* Scan the heap and free all unmarked objects by reconstructing
-       the freelist.  Add all free chunks and unmarked objects and
-       merge adjacent free chunks into contiguous areas */
+    if(heapfree >= ((long long)(heaplimit-heapbase))*CONCURRENT_TRIGGER/100)
+        return;
 
-    for(ptr = heapbase; ptr < heaplimit; ) {
-        unsigned int hdr = HEADER(ptr);
-        int size = HDR_SIZE(hdr);
+    lockVMWaitLock(conc_lock, self);
+    conc_requested = TRUE;
+    notifyVMWaitLock(conc_lock, self);
+    unlockVMWaitLock(conc_lock, self);
+}
 
-        if(HDR_ALLOCED(hdr)) {
-            Object *ob = (Object*)(ptr+HEADER_SIZE);
+/* The initial pause.  Called by the marker thread with the heap lock held */
 
-            if(IS_MARKED(ob))
-                goto marked;
+static void startConcurrentMark(Thread *self) {
+    suspendAllThreads(self);
+    retireTLABs();
 
-	    if(ob->lock & 1) {
-	        printf("freeing ob with fat lock...\n");
-	        exit(0);
-            }
+    conc_start = getTime();
 
-            freed += size;
-            unmarked++;
+    /* Discard anything recorded after the last cycle ended */
 
-            TRACE_GC(("FREE: Freeing ob @ 0x%x class %s - start of block\n", ob,
-				    ob->class ? CLASS_CB(ob->class)->name : "?"));
-        }
-        else
-            TRACE_GC(("FREE: Unalloced block @ 0x%x size %d - start of block\n", ptr, size));
-        
-        /* Add chunk onto the freelist */
-        last->next = (Chunk *) ptr;
-        last = last->next;
+    lockVMLock(satb_lock, self);
+    flushSATBBuffers();
+    satb_queue_count = 0;
+    unlockVMLock(satb_lock, self);
 
-        /* Clear the alloc and flc bits in the header */
-        last->header &= ~(ALLOC_BIT|FLC_BIT);
+    clearMarkBits();
+    markRoots(self);
 
-        /* Scan the next chunks - while they are
-           free, merge them onto the first free
-           chunk */
+    satb_marking = TRUE;
+    conc_tracing = TRUE;
 
-        for(;;) {
-            ptr += size;
+    resumeAllThreads(self);
 
-            if(ptr>=heaplimit)
-                goto out_last_free;
+    conc_root_time = endTime(conc_start)/1000000.0;
+}
 
-            hdr = HEADER(ptr);
-            size = HDR_SIZE(hdr);
-            if(HDR_ALLOCED(hdr)) {
-                Object *ob = (Object*)(ptr+HEADER_SIZE);
+/* Trace the heap concurrently with the mutators, until there is
+   nothing left to mark or the cycle is to be completed by a pause.
+   Mark stack overflow is left for the remark to recover from, as
+   the heap can't be walked while the mutators are allocating */
 
-                if(IS_MARKED(ob))
-                    break;
+static void concurrentTrace(Thread *self) {
+    MarkStack *ms = &mark_stacks[0];
+    Object *ob;
 
-	    if(ob->lock & 1) {
-	        printf("freeing ob with fat lock...\n");
-	        exit(0);
-            }
+    while(!conc_stop) {
+        if((ob = popMarkStack(ms)) != NULL)
+            markChildren(ob, ms);
+        else if(!drainSATBQueue(self))
+            break;
+    }
 
-                freed += size;
-                unmarked++;
+    MBARRIER();
+    conc_tracing = FALSE;
+}
 
-                TRACE_GC(("FREE: Freeing object @ 0x%x class %s - merging onto block @ 0x%x\n",
-                                       ob, ob->class ? CLASS_CB(ob->class)->name : "?", last));
+/* Stop the marker thread tracing.  Called with the heap lock held */
 
-            }
-            else 
-                TRACE_GC(("FREE: unalloced block @ 0x%x size %d - merging onto block @ 0x%x\n", ptr, size, last));
-            last->header += size;
-        }
+static void stopConcurrentTrace() {
+    conc_stop = TRUE;
+    MBARRIER();
 
-        /* Scanned to next marked object see if it's
-           the largest so far */
+    while(conc_tracing)
+        sched_yield();
 
-        if(last->header > largest)
-            largest = last->header;
+    conc_stop = FALSE;
+}
 
-        /* Add onto total count of free chunks */
-        heapfree += last->header;
+/* The remark.  Called with the heap lock held.  Returns the size
+   of the largest free chunk, as gc0 */
 
-marked:
-        marked++;
+static int finishConcurrentMark(Thread *self) {
+    long long start;
+    float trace_time, remark_time;
+    int largest;
 
-        /* Skip to next block */
-        ptr += size;
+    stopConcurrentTrace();
 
-        if(ptr >= heaplimit)
-            goto out_last_marked;
-    }
+    trace_time = endTime(conc_start)/1000000.0 - conc_root_time;
 
-out_last_free:
+    suspendAllThreads(self);
+    start = getTime();
 
-    /* Last chunk is free - need to check if
-       largest */
-    if(last->header > largest)
-        largest = last->header;
+    /* Allocations from TLABs are marked as they're retired */
+    retireTLABs();
 
-    heapfree += last->header;
+    /* A thread with suspension disabled may be
+       moving its buffer onto the queue */
 
-out_last_marked:
+    lockVMLock(satb_lock, self);
+    flushSATBBuffers();
+    unlockVMLock(satb_lock, self);
 
-    /* We've now reconstructed the freelist, set freelist
-       pointer to new list */
-    last->next = NULL;
-    freelist = newlist.next;
+    drainSATBQueue(self);
+    satb_marking = FALSE;
 
-    /* Reset next allocation block to beginning of list -
-       this leads to a search - use largest instead? */
-    chunkpp = &freelist;
+    completeMark(self);
+    scanFinalizers(self);
 
-#ifdef DEBUG
-{
-    Chunk *c;
-    for(c = freelist; c != NULL; c = c->next)
-        printf("Chunk @0x%x size: %d\n", c, c->header);
-}
-#endif
+    remark_time = endTime(start)/1000000.0;
 
     if(verbosegc) {
-        int size = heaplimit-heapbase;
-        long long pcnt_used = ((long long)heapfree)*100/size;
-        printf("<GC: Allocated objects: %d>\n", marked);
-        printf("<GC: Freed %d objects using %d bytes>\n", unmarked, freed);
-        printf("<GC: Largest block is %d total free is %d out of %d (%lld%)>\n",
-                         largest, heapfree, size, pcnt_used);
+        int high, marked = markedObjects(&high);
+
+        printf("<GC: Concurrently marked %d objects, initial pause took %f seconds, "
+               "trace took %f seconds, remark took %f seconds (mark stack high water "
+               "%d, %d overflows)>\n", marked, conc_root_time, trace_time, remark_time,
+               high, mark_stack_overflows);
     }
 
-    /* Return the size of the largest free chunk in heap - this
-       is the largest allocation request that can be satisfied */
+    largest = doSweep(self);
 
+    resumeAllThreads(self);
     return largest;
 }
 
-/* Run all outstanding finalizers.  This is called synchronously
- * if we run out of memory and asyncronously by the finalizer
- * thread.  In both cases suspension is disabled, to reduce
- * back-to-back enable/disable... */
-
-static Thread *runningFinalizers = NULL;
-static int runFinalizers() {
-    Thread *self = threadSelf();
-    int ret = FALSE;
+/* Abandon a cycle in progress, for a full collection.
+   Called with the heap lock held */
 
-    lockVMWaitLock(run_fnlzr_lock, self);
+static void abandonConcurrentMark() {
+    stopConcurrentTrace();
 
-    if(runningFinalizers == self)
-        goto out;
+    satb_marking = FALSE;
+    mark_stacks[0].head = mark_stacks[0].tail = 0;
+    mark_stack_overflow = FALSE;
+}
 
-    while(runningFinalizers) {
-        ret = TRUE;
-        waitVMWaitLock(run_fnlzr_lock, self);
-    }
+void concurrentGCThreadLoop(Thread *self) {
+    disableSuspend0(self, &self);
 
-    if((run_finaliser_start == run_finaliser_size) && (run_finaliser_end == 0))
-        goto out;
+    for(;;) {
+        lockVMWaitLock(conc_lock, self);
+        while(!conc_requested)
+            waitVMWaitLock(conc_lock, self);
+        unlockVMWaitLock(conc_lock, self);
 
-    runningFinalizers = self;
+        lockVMLock(heap_lock, self);
+        conc_requested = FALSE;
 
-    TRACE_FNLZ(("run_finaliser_start %d\n",run_finaliser_start));
-    TRACE_FNLZ(("run_finaliser_end %d\n",run_finaliser_end));
-    TRACE_FNLZ(("run_finaliser_size %d\n",run_finaliser_size));
+        if(!satb_marking)
+            startConcurrentMark(self);
 
-    if(verbosegc) {
-        int diff = run_finaliser_end - run_finaliser_start;
-        printf("<Running %d finalizers>\n", diff > 0 ? diff : diff + run_finaliser_size);
-    }
+        unlockVMLock(heap_lock, self);
 
-    do {
-        Object *ob;
-        run_finaliser_start %= run_finaliser_size;
-        ob = run_finaliser_list[run_finaliser_start];
+        concurrentTrace(self);
 
-        unlockVMWaitLock(run_fnlzr_lock, self);
-	enableSuspend(self);
+        /* The cycle may have been completed or abandoned
+           by an allocating thread in the meantime */
 
-	/* Run the finalizer method */
-        executeMethod(ob, CLASS_CB(ob->class)->finalizer);
+        lockVMLock(heap_lock, self);
 
-	/* We entered with suspension off - nothing
-	 * else interesting on stack, so use previous
-	 * stack top. */
+        if(satb_marking)
+            finishConcurrentMark(self);
 
-        disableSuspend0(self, getStackTop(self));
-        lockVMWaitLock(run_fnlzr_lock, self);
+        unlockVMLock(heap_lock, self);
+    }
+}
 
-        /* Clear any exceptions - exceptions thrown in finalizers are
-           silently ignored */
+/* Hand the gc a thread's TLAB and SATB buffer before it exits.  The
+   heap lock keeps out a remark, which reads the buffers of all threads */
 
-	clearException();
-    } while(++run_finaliser_start != run_finaliser_end);
+void retireThreadBuffers(Thread *thread) {
+    lockVMLock(heap_lock, thread);
 
-    run_finaliser_start = run_finaliser_size;
-    run_finaliser_end = 0;
-    runningFinalizers = NULL;
+    retireTLAB(thread);
 
-    ret = TRUE;
-out:
-    notifyVMWaitLock(run_fnlzr_lock, self);
-    unlockVMWaitLock(run_fnlzr_lock, self);
-    return ret;
-}
+    if(thread->satb_buf != NULL) {
+        lockVMLock(satb_lock, thread);
 
-static long getTime() {
-   struct timeval tv;
+        if(satb_marking)
+            queueSATBBuffer(thread);
 
-   gettimeofday(&tv, 0);
-   return tv.tv_usec;
-}
+        unlockVMLock(satb_lock, thread);
 
-static long endTime(long start) {
-    long time = getTime() - start;
+        free(thread->satb_buf);
+        thread->satb_buf = NULL;
+    }
 
-    return time < 0 ? 1000000-time : time;
+    unlockVMLock(heap_lock, thread);
 }
 
 int gc0() {
     Thread *self = threadSelf();
-    long start;
+    long long start;
     float scan_time;
     float mark_time;
     int largest;
 
+    /* A full collection supersedes any concurrent cycle */
+    if(satb_marking)
+        abandonConcurrentMark();
+
     suspendAllThreads(self);
+    retireTLABs();
+
+    /* Compact instead of sweeping if the heap was found
+       to be fragmented by the previous collection */
+    compacting = compact_next;
 
     start = getTime();
     doMark(self);
     scan_time = endTime(start)/1000000.0;
 
     start = getTime();
-    largest = doSweep(self);
+    largest = compacting ? doCompact(self) : doSweep(self);
     mark_time = endTime(start)/1000000.0;
 
+    compacting = FALSE;
+
     resumeAllThreads(self);
 
     if(verbosegc)
@@ -525,6 +2216,18 @@ int gc0() {
     return largest;
 }
 
+/* Do a minor collection.  Called from gcMalloc with the
+   heap lock held when the nursery is exhausted */
+
+static void minorGC(Thread *self) {
+    suspendAllThreads(self);
+    retireTLABs();
+
+    scavenge(self);
+
+    resumeAllThreads(self);
+}
+
 int gc1() {
     Thread *self;
     disableSuspend(self = threadSelf());
@@ -534,13 +2237,45 @@ int gc1() {
     enableSuspend(self);
 }
 
+/* Collect, and if sweeping lazily, sweep enough to know
+   whether an allocation of n bytes can now be satisfied */
+
+static int gcAndSweep(int n) {
+    int largest;
+
+    /* Complete a concurrent cycle in progress first - this
+       only needs a remark, rather than a full collection */
+
+    if(satb_marking) {
+        largest = finishConcurrentMark(threadSelf());
+
+        if(lazy_sweep)
+            largest = lazySweep(n);
+
+        if(n <= largest)
+            return largest;
+    }
+
+    largest = gc0();
+
+    if(lazy_sweep)
+        largest = lazySweep(n);
+
+    return largest;
+}
+
 void expandHeap(int min) {
-    Chunk *chunk, *new;
+    Chunk *new;
     int delta;
 
     if(verbosegc)
         printf("<GC: Expanding heap - minimum needed is %d>\n", min);
 
+    /* The mark bits are reallocated - they can't be
+       in use by the concurrent marker */
+    if(satb_marking)
+        abandonConcurrentMark();
+
     delta = (heaplimit-heapbase)/2;
     delta = delta < min ? min : delta;
 
@@ -554,84 +2289,187 @@ void expandHeap(int min) {
     if(verbosegc)
         printf("<GC: Expanding heap by %d bytes>\n", delta);
 
-    /* The freelist is in address order - find the last
-       free chunk and add the new area to the end.  */
-
-    for(chunk = freelist; chunk->next != NULL; chunk = chunk->next);
-
     new = (Chunk*)heaplimit;
     new->header = delta;
-    new->next = 0;
+    addChunk(new);
 
-    chunk->next = new;
     heaplimit += delta;
     heapfree += delta;
 
     /* The heap has increased in size - need to reallocate
        the mark bits to cover new area */
 
-    free(markBits);
     allocMarkBits();
 }
 
-void *gcMalloc(int len) {
+/* Thread-local allocation buffers.  Small objects are allocated by
+   bumping a pointer through a buffer owned by the thread, which is
+   carved out of the free lists (or the nursery, if there is one) in
+   large pieces.  The common case therefore needs neither the heap
+   lock nor suspension disabling.  The unused tail of a buffer is
+   always formatted as an unallocated block, so the heap remains
+   walkable by doMark and doSweep.  On a collection all buffers are
+   retired - their tails are simply merged into the surrounding free
+   chunks by the sweep */
+
+#define TLAB_SIZE	4096
+#define TLAB_MAX_OBJ	(TLAB_SIZE/8)
+
+/* Take a TLAB of at least n bytes from the nursery.  Free space
+   too small for any TLAB allocation is discarded as it's passed -
+   it'll be recovered by the next collection */
+
+static Chunk *nurseryChunk(int n) {
+    Chunk **cpp = &nursery_free;
+    Chunk *chunk;
+
+    while((chunk = *cpp) != NULL) {
+        if(chunk->header >= n) {
+            if(chunk->header > TLAB_SIZE) {
+                Chunk *rem = (Chunk*)((char*)chunk + TLAB_SIZE);
+                rem->header = chunk->header - TLAB_SIZE;
+                rem->next = chunk->next;
+                chunk->header = TLAB_SIZE;
+                *cpp = rem;
+            } else
+                *cpp = chunk->next;
+
+            return chunk;
+        }
+
+        if(chunk->header < TLAB_MAX_OBJ)
+            *cpp = chunk->next;
+        else
+            cpp = &chunk->next;
+    }
+
+    return NULL;
+}
+
+static char *allocFromTLAB(Thread *self, int n) {
+    char *ret_addr;
+
+    ALLOC_FROM_TLAB(self, n, ret_addr);
+    return ret_addr;
+}
+
+/* Record the objects allocated from the thread's TLAB in the
+   alloc bits.  Called with the heap lock held when the TLAB is
+   replaced, or by the gc with all threads suspended */
+
+static void flushTLAB(Thread *thread) {
+    char *ptr;
+
+    for(ptr = thread->tlab_start; ptr < thread->tlab_top; ptr += HDR_SIZE(HEADER(ptr))) {
+        SET_ALLOCED(ptr+HEADER_SIZE);
+
+        /* TLABs are retired when concurrent marking starts, so
+           everything in one now was allocated during marking */
+        if(satb_marking)
+            setMarkBit((Object*)(ptr+HEADER_SIZE));
+    }
+}
+
+void retireTLAB(Thread *thread) {
+    flushTLAB(thread);
+    thread->tlab_start = thread->tlab_top = thread->tlab_limit = NULL;
+}
+
+/* Replace the thread's TLAB.  The tail of the old TLAB is left
+   as an unallocated block - it'll be reclaimed on the next sweep */
+
+static void newTLAB(Thread *self, Chunk *chunk, int size) {
+    flushTLAB(self);
+
+    chunk->header = size;
+    self->tlab_start = self->tlab_top = (char*)chunk;
+    self->tlab_limit = (char*)chunk + size;
+}
+
+/* Allocate a block of at least len bytes.  If there is a nursery,
+   young is FALSE for objects which must be allocated directly in
+   the old generation - large objects always are */
+
+void *gcMalloc(int len, int young) {
     static int state = 0; /* allocation failure action */
 
     int n = (len+HEADER_SIZE+OBJECT_GRAIN-1)&~(OBJECT_GRAIN-1);
+    int chunk_len, size, tlab;
     Chunk *found;
     int largest;
     Thread *self;
-#ifdef TRACEALLOC
-    int tries;
-#endif
 
     /* See comment below */
     char *ret_addr;
 
-    disableSuspend(self = threadSelf());
+    self = threadSelf();
+
+    /* Threads which are not yet on the thread list (i.e. still
+       attaching, and so have no id) are not seen by the gc and
+       can't own a TLAB */
+    tlab = n <= TLAB_MAX_OBJ && self->id != 0 &&
+                      (young || nurserylimit == nurserybase);
+
+    if(tlab) {
+        deferSuspend(self);
+        ret_addr = allocFromTLAB(self, n);
+        undeferSuspend(self);
+
+        if(ret_addr != NULL)
+            return ret_addr;
+    }
+
+    disableSuspend(self);
     lockVMLock(heap_lock, self);
 
-    /* Scan freelist looking for a chunk big enough to
-       satisfy allocation request */
+    /* Look for a chunk big enough to satisfy the allocation
+       request.  A TLAB refill preferably takes a chunk of
+       TLAB_SIZE, but will settle for any chunk which fits */
 
     for(;;) {
-#ifdef TRACEALLOC
-       tries = 0;
-#endif
-        while(*chunkpp) {
-            int len = (*chunkpp)->header;
+        if(tlab && nurserylimit != nurserybase) {
 
-            if(len == n) {
-                found = *chunkpp;
-                *chunkpp = found->next;
-                goto gotIt;
+            /* TLABs are taken from the nursery.  If it's exhausted do a
+               minor collection - if it's still full (of pinned objects)
+               fall back to allocating in the old generation */
+
+            if((found = nurseryChunk(n)) == NULL) {
+                minorGC(self);
+                found = nurseryChunk(n);
             }
 
-            if(len > n) {
-                Chunk *rem;
-                found = *chunkpp;
-                rem = (Chunk*)((char*)found + n);
-                rem->header = len - n;
-                rem->next = found->next;
-                *chunkpp = rem;
-                goto gotIt;
+            if(found != NULL) {
+                newTLAB(self, found, found->header);
+                ret_addr = allocFromTLAB(self, n);
+                goto out;
             }
-            chunkpp = &(*chunkpp)->next;
-#ifdef TRACEALLOC
-            tries++;
-#endif
+
+            tlab = FALSE;
         }
 
+        if((tlab && (found = findChunk(TLAB_SIZE)) != NULL) ||
+                    (found = findChunk(n)) != NULL)
+            goto gotIt;
+
+        /* If sweeping lazily, sweep another region and try again */
+        if(lazy_sweep && sweepNextRegion())
+            continue;
+
 	if(verbosegc)
             printf("<GC: Alloc attempt for %d bytes failed (state %d).>\n", n, state);
 
 	switch(state) {
 
             case 0:
-                largest = gc0();
+                largest = gcAndSweep(n);
                 if(n <= largest)
 		    break;
 
+                /* There's enough free space, but it's too fragmented -
+                   compact the heap on the next collection */
+                if(compact_heap && heapfree >= n)
+                    compact_next = TRUE;
+
 	        state = 1;
 
             case 1: {
@@ -642,8 +2480,8 @@ void *gcMalloc(int len) {
                 lockVMLock(heap_lock, self);
 
 		if(state == 1) {
-                    if(res) {
-                        largest = gc0();
+                    if(res || compact_next) {
+                        largest = gcAndSweep(n);
                         if(n <= largest) {
                             state = 0;
 			    break;
@@ -663,9 +2501,6 @@ void *gcMalloc(int len) {
                         printf("<GC: Stack at maximum already - completely out of heap space>\n");
 
 		    state = 3;
-                    /* Reset next allocation block
-		     * to beginning of list */
-                    chunkpp = &freelist;
                     enableSuspend(self);
                     unlockVMLock(heap_lock, self);
                     signalException("java/lang/OutOfMemoryError", NULL);
@@ -691,22 +2526,48 @@ void *gcMalloc(int len) {
     }
 
 gotIt:
-#ifdef TRACEALLOC
-    printf("<ALLOC: took %d tries to find block.>\n", tries);
-#endif
+    chunk_len = found->header;
+    size = tlab ? (chunk_len < TLAB_SIZE ? chunk_len : TLAB_SIZE) : n;
+
+    TRACE_ALLOC(("<ALLOC: found chunk @ 0x%x size %d for request of %d>\n", found, chunk_len, size));
+
+    /* Return any remainder to the free lists */
+    if(chunk_len > size) {
+        Chunk *rem = (Chunk*)((char*)found + size);
+        rem->header = chunk_len - size;
+        addChunk(rem);
+    }
+
+    heapfree -= size;
+
+    if(tlab) {
+        /* Found chunk becomes the thread's new TLAB.  We hold the heap
+           lock, so no gc can occur while the object is allocated from it */
+
+        newTLAB(self, found, size);
+        ret_addr = allocFromTLAB(self, n);
+    } else {
+        /* Mark found chunk as allocated */
+        found->header = n | ALLOC_BIT;
+
+        /* Found is a block pointer - if we unlock now, small window
+         * where new object ref is not held and will therefore be gc'ed.
+         * Setup ret_addr before unlocking to prevent this.
+         */
+
+        ret_addr = ((char*)found)+HEADER_SIZE;
+        memset(ret_addr, 0, n-HEADER_SIZE);
+        SET_ALLOCED(ret_addr);
 
-    heapfree -= n;
+        if(satb_marking)
+            setMarkBit((Object*)ret_addr);
+    }
 
-    /* Mark found chunk as allocated */
-    found->header = n | ALLOC_BIT;
+    /* Start concurrent marking if the heap is filling up */
+    if(concurrent_gc)
+        checkConcurrentMark(self);
 
-    /* Found is a block pointer - if we unlock now, small window
-     * where new object ref is not held and will therefore be gc'ed.
-     * Setup ret_addr before unlocking to prevent this.
-     */
-   
-    ret_addr = ((char*)found)+HEADER_SIZE;
-    memset(ret_addr, 0, n-HEADER_SIZE);
+out:
     enableSuspend(self);
     unlockVMLock(heap_lock, self);
 
@@ -725,83 +2586,196 @@ gotIt:
 	    - globals
 */
 
-void markClassStatics(Class *class) {
+void markClassStatics(Class *class, MarkStack *ms) {
     ClassBlock *cb = CLASS_CB(class);
-    FieldBlock *fb = cb->fields;
+    u4 **refs = cb->static_refs;
     int i;
 
     TRACE_GC(("Marking static fields for class %s\n", cb->name));
 
-    for(i = 0; i < cb->fields_count; i++, fb++)
-        if((fb->access_flags & ACC_STATIC) &&
-                    ((*fb->type == 'L') || (*fb->type == '['))) {
-            Object *ob = (Object *)fb->static_value;
-            TRACE_GC(("Field %s %s\n", fb->name, fb->type));
-            TRACE_GC(("Object @0x%x is valid %d\n", ob, IS_OBJECT(ob)));
-            if(IS_OBJECT(ob) && !IS_MARKED(ob))
-                markChildren(ob);
+    /* Iterate over the class's static reference fields - the
+       map is built when the class is linked */
+
+    for(i = 0; i < cb->static_ref_count; i++) {
+        Object *ob = (Object *)*refs[i];
+        TRACE_GC(("Object @0x%x is valid %d\n", ob, IS_OBJECT(ob)));
+        if(IS_OBJECT(ob))
+            markAndPush(ob, ms);
+    }
+}
+
+/* Mark a root, or during a minor collection, pin it if it's in
+   the nursery.  Roots can't be updated if the object is moved, so
+   they're also pinned when the heap is to be compacted */
+
+static void markRoot(Object *ob) {
+    if(minor_gc) {
+        if(IS_YOUNG(ob))
+            pinYoung(ob);
+    } else {
+        if(compacting)
+            PIN(ob);
+
+        markAndPush(ob, &mark_stacks[0]);
+    }
+}
+
+/* Walk the Java frames of a thread.  A frame which has called another
+   Java method is stopped at an invoke, and if its method has a stack
+   map, only the slots holding references are passed to precise.  All
+   other frames (the top frame, frames which have called into the VM,
+   native frames and methods without a map) have every slot passed to
+   conservative.  Either function may be NULL */
+
+typedef void (*SlotFunc)(u4 *slot);
+
+static void walkJavaStack(ExecEnv *ee, SlotFunc precise, SlotFunc conservative) {
+    Frame *frame = ee->last_frame;
+    Frame *callee = NULL;
+    u4 *slot, *end;
+
+    for(; frame->prev != NULL; callee = frame, frame = frame->prev) {
+        MethodBlock *mb = frame->mb;
+        unsigned int *bits = NULL;
+        int height, i;
+
+        /* Dummy frames hold nothing - their ostack is the
+           lvars of the method called from the VM */
+        if(mb == NULL)
+            continue;
+
+        TRACE_GC(("Scanning %s.%s\n", CLASS_CB(mb->class)->name, mb->name));
+        TRACE_GC(("lvars @0x%x ostack @0x%x\n", frame->lvars, frame->ostack));
+
+        if(callee != NULL && callee->mb != NULL && mb->stack_map != NULL)
+            bits = findStackMap(mb->stack_map, frame->last_pc - mb->threaded_code, &height);
+
+        if(bits != NULL) {
+            int stack = callee->lvars - frame->ostack;
+
+            /* The arguments of the call are the callee's
+               lvars, and are scanned with the callee */
+            if(height > stack)
+                height = stack;
+
+            if(precise != NULL) {
+                for(i = 0; i < mb->max_locals; i++)
+                    if(bits[i>>5] & (1<<(i&31)))
+                        (*precise)(&frame->lvars[i]);
+
+                for(i = 0; i < height; i++) {
+                    int bit = mb->max_locals + i;
+                    if(bits[bit>>5] & (1<<(bit&31)))
+                        (*precise)(&frame->ostack[i]);
+                }
+            }
+            continue;
         }
+
+        if(conservative == NULL)
+            continue;
+
+        /* The lvars run up to the frame header (for JNI frames
+           the header moves up as the local refs are expanded) */
+        for(slot = frame->lvars; slot < (u4*)frame; slot++)
+            (*conservative)(slot);
+
+        if(callee == NULL)
+            end = frame->ostack + mb->max_stack + 1 + JIT_INLINE_SLOTS;
+        else if(callee->mb == NULL)
+            end = (u4*)callee;
+        else
+            end = callee->lvars;
+
+        for(slot = frame->ostack; slot < end; slot++)
+            (*conservative)(slot);
+    }
+}
+
+static void scanConservativeSlot(u4 *slot) {
+    if(IS_OBJECT(*slot) && IS_ALLOCED(*slot)) {
+        Object *ob = (Object*)*slot;
+        TRACE_GC(("Found Java stack ref @0x%x object ref is 0x%x\n", slot, ob));
+        markRoot(ob);
+    }
+}
+
+/* A precise slot can be updated if its object moves, so the object
+   isn't pinned.  On a minor collection the slot is left until
+   updateThread, after all the objects which can't move are pinned */
+
+static void scanPreciseSlot(u4 *slot) {
+    Object *ob = (Object*)*slot;
+
+    if(!minor_gc && IS_OBJECT(ob)) {
+        TRACE_GC(("Found precise Java stack ref @0x%x object ref is 0x%x\n", slot, ob));
+        markAndPush(ob, &mark_stacks[0]);
+    }
 }
 
 void scanThread(Thread *thread) {
     ExecEnv *ee = thread->ee;
-    Frame *frame = ee->last_frame;
     u4 *end, *slot;
 
     TRACE_GC(("Scanning stacks for thread 0x%x\n", thread));
 
-    MARK(ee->thread);
+    markRoot(ee->thread);
+
+    if(ee->exception != NULL)
+        markRoot(ee->exception);
+
+    /* C stack slots are scanned conservatively - only values
+       which are the address of an allocated object are refs */
 
     slot = (u4*)getStackTop(thread);
     end = (u4*)getStackBase(thread);
 
     for(; slot < end; slot++)
-        if(IS_OBJECT(*slot)) {
+        if(IS_OBJECT(*slot) && IS_ALLOCED(*slot)) {
             Object *ob = (Object*)*slot;
             TRACE_GC(("Found C stack ref @0x%x object ref is 0x%x\n", slot, ob));
-            MARK(ob);
+            markRoot(ob);
         }
 
-    slot = frame->ostack + frame->mb->max_stack;
+    walkJavaStack(ee, scanPreciseSlot, scanConservativeSlot);
+}
 
-    while(frame->prev != NULL) {
-        if(frame->mb != NULL) {
-            TRACE_GC(("Scanning %s.%s\n", CLASS_CB(frame->mb->class)->name, frame->mb->name));
-            TRACE_GC(("lvars @0x%x ostack @0x%x\n", frame->lvars, frame->ostack));
-        }
+/* Update the precise stack slots of a thread after objects have
+   moved - either evacuated from the nursery, or compacted */
 
-        end = frame->ostack;
+static void updateSlot(u4 *slot) {
+    Object *ob = (Object*)*slot;
 
-        for(; slot >= end; slot--)
-            if(IS_OBJECT(*slot)) {
-                Object *ob = (Object*)*slot;
-                TRACE_GC(("Found Java stack ref @0x%x object ref is 0x%x\n", slot, ob));
-                MARK(ob);
-            }
+    if(compacting) {
+        if(IS_OLD(ob))
+            *slot = (u4)forwardObject(ob);
+    } else if(IS_YOUNG(ob))
+        *slot = (u4)evacuate(ob);
+}
 
-        slot -= sizeof(Frame)/4;
-        frame = frame->prev;
-    }
+void updateThread(Thread *thread) {
+    walkJavaStack(thread->ee, updateSlot, NULL);
 }
 
 void markClass(Class *class) {
-    MARK(class);
+    markRoot((Object*)class);
 }
 
 void markObject(Object *object) {
-    MARK(object);
+    markRoot(object);
 }
 
-void markChildren(Object *ob) {
+/* Mark and push onto the mark stack all objects referenced by
+   the object.  The object itself must already be marked */
 
-    MARK(ob);
+void markChildren(Object *ob, MarkStack *ms) {
 
     if(ob->class == NULL)
         return;
  
     if(IS_CLASS(ob)) {
         TRACE_GC(("Found class object @0x%x name is %s\n", ob, CLASS_CB(ob)->name));
-        markClassStatics((Class*)ob);
+        markClassStatics((Class*)ob, ms);
     } else {
         Class *class = ob->class;
         ClassBlock *cb = CLASS_CB(class);
@@ -817,46 +2791,44 @@ void markChildren(Object *ob) {
                     Object *ob = (Object *)body[i];
                     TRACE_GC(("Object at index %d is @0x%x is valid %d\n", i-1, ob, IS_OBJECT(ob)));
 
-                    if(IS_OBJECT(ob) && !IS_MARKED(ob))
-                        markChildren(ob);
+                    if(IS_OBJECT(ob))
+                        markAndPush(ob, ms);
                 }
             } else {
                 TRACE_GC(("Array object @0x%x class is %s  - Not Scanning...\n", ob, cb->name));
             }
         } else {
-            FieldBlock *fb;
+            int *offsets = cb->ref_offsets;
             int i;
 
             TRACE_GC(("Scanning object @0x%x class is %s\n", ob, cb->name));
 
-            /* Scan fieldblocks in current class and all super-classes
-               and mark all object refs */
-
-            for(;;) {
-                fb = cb->fields;
+            /* Mark all object refs using the class's reference map -
+               this includes the fields of all super-classes */
 
-                TRACE_GC(("scanning fields of class %s\n", cb->name));
+            for(i = 0; i < cb->ref_count; i++) {
+                Object *ob = (Object *)body[offsets[i]];
+                TRACE_GC(("Field offset %d is @0x%x is valid %d\n", offsets[i], ob, IS_OBJECT(ob)));
 
-                for(i = 0; i < cb->fields_count; i++, fb++)
-                    if(!(fb->access_flags & ACC_STATIC) &&
-                        ((*fb->type == 'L') || (*fb->type == '['))) {
-                            Object *ob = (Object *)body[fb->offset];
-                            TRACE_GC(("Field %s %s is an Object ref\n", fb->name, fb->type));
-                            TRACE_GC(("Object @0x%x is valid %d\n", ob, IS_OBJECT(ob)));
-
-                            if(IS_OBJECT(ob) && !IS_MARKED(ob))
-                                markChildren(ob);
-                    }
-                class = cb->super;
-                if(class == NULL)
-                    break;
-                cb = CLASS_CB(class); 
+                if(IS_OBJECT(ob))
+                    markAndPush(ob, ms);
             }
         }
     }
 }
 
 
+/* Prevent an object from ever being moved by the collector */
+
+void pinObject(Object *ob) {
+    unsigned int *hdr = (unsigned int*)(((char*)ob)-HEADER_SIZE);
+    unsigned int old;
+
+    do {
+        old = *hdr;
+    } while(!(old & PINNED_BIT) && !COMPARE_AND_SWAP(hdr, old, old | PINNED_BIT));
+}
+
 /* Routines to retrieve snapshot of heap status */
 
 int freeHeapMem() {
@@ -898,7 +2870,7 @@ void finalizerThreadLoop(Thread *self) {
     }
 }
 
-void initialiseGC(int noasyncgc) {
+void initialiseGC(int noasyncgc, int gcthreads, int lazysweep, int compact, int concurrent) {
     /* Pre-allocate an OutOfMemoryError exception object - we throw it
      * when we're really low on heap space, and can create FA... */
 
@@ -918,6 +2890,27 @@ void initialiseGC(int noasyncgc) {
 
     if(!noasyncgc)
         createVMThread("Async GC", asyncGCThreadLoop);
+
+    /* Create the gc worker threads for parallel marking - the
+       collecting thread itself is the remaining gc thread */
+
+    if(gcthreads > MAX_GC_THREADS)
+        gcthreads = MAX_GC_THREADS;
+
+    for(gc_threads = 1; gc_threads < gcthreads; gc_threads++)
+        createVMThread("GC Worker", gcWorkerThreadLoop);
+
+    lazy_sweep = lazysweep;
+    compact_heap = compact;
+
+    if(concurrent) {
+        if(nurserylimit != nurserybase)
+            printf("Concurrent marking can't be used with a nursery - ignored\n");
+        else {
+            concurrent_gc = TRUE;
+            createVMThread("Concurrent GC", concurrentGCThreadLoop);
+        }
+    }
 }
 
 /* Object allocation routines */
@@ -940,10 +2933,23 @@ void initialiseGC(int noasyncgc) {
     enableSuspend(self);                                                           \
 }
 
+/* The size of the block holding an instance of the class, if it can
+   be allocated inline from a TLAB by the interpreter (see NEW_QUICK),
+   or 0.  This must agree with allocObject and gcMalloc */
+
+int tlabObjectSize(Class *class) {
+    ClassBlock *cb = CLASS_CB(class);
+    int n = (cb->object_size*4+sizeof(Object)+HEADER_SIZE+OBJECT_GRAIN-1)&~(OBJECT_GRAIN-1);
+
+    return cb->finalizer == NULL && n <= TLAB_MAX_OBJ ? n : 0;
+}
+
 Object *allocObject(Class *class) {
     ClassBlock *cb = CLASS_CB(class);
     int size = cb->object_size * 4;
-    Object *ob = (Object *)gcMalloc(size+sizeof(Object));
+    /* Objects with finalizers are allocated in the old generation,
+       as the finalizer lists refer to them by address */
+    Object *ob = (Object *)gcMalloc(size+sizeof(Object), cb->finalizer == NULL);
 
     if(ob != NULL) {
         ob->class = class;
@@ -965,7 +2971,7 @@ Object *allocArray(Class *class, int size, int el_size) {
         return NULL;
     }
 
-    ob = (Object *)gcMalloc(size * el_size + 4 + sizeof(Object));
+    ob = (Object *)gcMalloc(size * el_size + 4 + sizeof(Object), TRUE);
 
     if(ob != NULL) {
         *INST_DATA(ob) = size;
@@ -976,44 +2982,50 @@ Object *allocArray(Class *class, int size, int el_size) {
     return ob;
 }
 
+/* The primitive array classes, indexed by type.  Classes are never
+   unloaded or moved, so they're looked up once */
+
+static Class *type_array_classes[T_LONG+1];
+
 Object *allocTypeArray(int type, int size) {
     Class *class;
+    char *name;
     int el_size;
 
     switch(type) {
         case T_BYTE:
         case T_BOOLEAN:
-            class = findArrayClass("[B");
+            name = "[B";
             el_size = 1;
             break;
 
         case T_CHAR:
-            class = findArrayClass("[C");
+            name = "[C";
             el_size = 2;
             break;
 
         case T_SHORT:
-            class = findArrayClass("[S");
+            name = "[S";
             el_size = 2;
             break;
 
         case T_INT:
-            class = findArrayClass("[I");
+            name = "[I";
             el_size = 4;
             break;
 
         case T_FLOAT:
-            class = findArrayClass("[F");
+            name = "[F";
             el_size = 4;
             break;
 
         case T_DOUBLE:
-            class = findArrayClass("[D");
+            name = "[D";
             el_size = 8;
             break;
 
         case T_LONG:
-            class = findArrayClass("[J");
+            name = "[J";
             el_size = 8;
             break;
 
@@ -1022,6 +3034,10 @@ Object *allocTypeArray(int type, int size) {
             exit(0);
     }
 
+    if((class = type_array_classes[type]) == NULL &&
+               (class = type_array_classes[type] = findArrayClass(name)) == NULL)
+        return NULL;
+
     return allocArray(class, size, el_size);
 }
 
@@ -1038,8 +3054,10 @@ Object *allocMultiArray(Class *array_class, int dim, int *count) {
 	if(array == NULL)
             return NULL;
 
-        for(i = 1; i <= *count; i++)
+        for(i = 1; i <= *count; i++) {
             INST_DATA(array)[i] = (u4)allocMultiArray(aclass, dim-1, count+1);
+            WRITE_BARRIER(array);
+        }
     } else {
         int el_size;
 
@@ -1071,7 +3089,9 @@ Object *allocMultiArray(Class *array_class, int dim, int *count) {
 }
 
 Class *allocClass() {
-    Class *class = (Class*)gcMalloc(sizeof(ClassBlock)+sizeof(Class));
+    /* Classes are referenced by address from many places,
+       so they're always allocated in the old generation */
+    Class *class = (Class*)gcMalloc(sizeof(ClassBlock)+sizeof(Class), FALSE);
     TRACE_ALLOC(("<ALLOC: allocated class object @ 0x%x>\n", class));
     return class; 
 }
@@ -1079,10 +3099,15 @@ Class *allocClass() {
 Object *cloneObject(Object *ob) {
     unsigned int hdr = HEADER((((char*)ob)-HEADER_SIZE));
     int size = HDR_SIZE(hdr)-HEADER_SIZE;
-    Object *clone = (Object*)gcMalloc(size);
+    Object *clone = (Object*)gcMalloc(size, CLASS_CB(ob->class)->finalizer == NULL);
 
     if(clone != NULL) {
+        /* The references copied into the clone may be to the nursery.
+           Dirty the clone's card before and after copying, in case of
+           a collection part way through the copy */
+        WRITE_BARRIER(clone);
         memcpy(clone, ob, size);
+        WRITE_BARRIER(clone);
 
 	clone->lock = 0;
 
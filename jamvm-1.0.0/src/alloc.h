@@ -20,16 +20,52 @@
 
 #define LOG_OBJECT_GRAIN	3
 #define HEADER_SIZE		4
+#define ALLOC_BIT		1
 #define FLC_BIT			2
 
+/* The flc bit shares the header word with the pinned bit (which is
+   set by pinObject without holding the monitor), so the bits must be
+   updated atomically, or a concurrent update may be lost */
+
 #define clear_flc_bit(o) { \
 	unsigned int *hdr = (unsigned int*)(((char*)o)-HEADER_SIZE); \
-        *hdr  &= ~FLC_BIT; \
+        unsigned int old; \
+        do { \
+            old = *hdr; \
+        } while(!COMPARE_AND_SWAP(hdr, old, old & ~FLC_BIT)); \
 }
 
 #define set_flc_bit(o) { \
 	unsigned int *hdr = (unsigned int*)(((char*)o)-HEADER_SIZE); \
-        *hdr  |= FLC_BIT; \
+        unsigned int old; \
+        do { \
+            old = *hdr; \
+        } while(!COMPARE_AND_SWAP(hdr, old, old | FLC_BIT)); \
 }
 
 #define test_flc_bit(o) *(unsigned int*)(((char*)o)-HEADER_SIZE) & FLC_BIT
+
+/* Allocate a block of n bytes (including the header, and a multiple
+   of the object grain) from the thread's TLAB.  ptr is the object, or
+   NULL if the TLAB is exhausted.  The block is zeroed, and the unused
+   tail is formatted before the block is claimed, so the heap remains
+   walkable.  Suspension must be deferred (see thread.h) */
+
+#define ALLOC_FROM_TLAB(self, n, ptr)                                 \
+{                                                                     \
+    char *block = (self)->tlab_top;                                   \
+    char *next = block + (n);                                         \
+                                                                      \
+    if(next > (self)->tlab_limit)                                     \
+        ptr = NULL;                                                   \
+    else {                                                            \
+        if(next < (self)->tlab_limit)                                 \
+            *(unsigned int*)next = (self)->tlab_limit - next;         \
+                                                                      \
+        *(unsigned int*)block = (n) | ALLOC_BIT;                      \
+        (self)->tlab_top = next;                                      \
+                                                                      \
+        memset(block+HEADER_SIZE, 0, (n)-HEADER_SIZE);                \
+        ptr = (void*)(block+HEADER_SIZE);                             \
+    }                                                                 \
+}
@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2003 Robert Lougher <rob@lougher.demon.co.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "jam.h"
+
+#ifndef NO_JNI
+#include <dlfcn.h>
+#endif
+
+/* Trace AOT compilation and binding */
+#ifdef TRACEAOT
+#define TRACE(x) printf x
+#else
+#define TRACE(x)
+#endif
+
+/* Ahead-of-time compilation.  In AOT mode (jamvm -aot out.so classes...)
+   the VM loads the named classes, translates the methods it can into C
+   and runs the C compiler to build a shared object.  The object holds
+   a table of the compiled methods, each with the checksum of the class
+   file it was compiled from.
+
+   At run time the library is loaded with -aotlib, and linkClass binds a
+   method to its compiled code when the class's checksum matches.  The
+   code has the same signature as a native invoker, and becomes the
+   method's native_invoker - methods are invoked through it if they have
+   one, rather than if they are native.  The access flags are unchanged,
+   so the method isn't seen as native.  Otherwise it is interpreted.
+
+   Only static leaf methods on ints are compiled - they can't throw,
+   allocate, call, or hold references, so the compiled code never needs
+   a frame of its own, a stack map or an exception table */
+
+#define AOT_TABLE "jamvm_aot_methods"
+
+#define U2(p)	(((p)[0]<<8)|(p)[1])
+#define S2(p)	((((signed char)(p)[0])<<8)|(p)[1])
+#define S4(p)	((((signed char)(p)[0])<<24)|((p)[1]<<16)|((p)[2]<<8)|(p)[3])
+
+static AOTMethod *aot_methods = NULL;
+
+/* Adler-32 checksum of a class file's bytes */
+
+u4 classChecksum(unsigned char *data, int len) {
+    u4 a = 1, b = 0;
+
+    while(len--) {
+        a = (a + *data++) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+int bindAOTMethod(MethodBlock *mb, u4 checksum) {
+    AOTMethod *aot;
+
+    if(aot_methods == NULL)
+        return FALSE;
+
+    for(aot = aot_methods; aot->code != NULL; aot++)
+        if(aot->checksum == checksum && strcmp(aot->name, mb->name) == 0 &&
+                   strcmp(aot->type, mb->type) == 0 &&
+                   strcmp(aot->class_name, CLASS_CB(mb->class)->name) == 0) {
+
+            TRACE(("Binding %s.%s%s to compiled code\n", aot->class_name, mb->name, mb->type));
+
+            mb->native_invoker = aot->code;
+            mb->max_locals = mb->args_count;
+            mb->max_stack = 0;
+            return TRUE;
+        }
+
+    return FALSE;
+}
+
+/* The library is opened directly rather than through resolveDll, as
+   it must be bound before the main thread (and the dll hash table lock)
+   exists - the first classes are linked while it's being created */
+
+void initialiseAOT(char *library) {
+#ifndef NO_JNI
+    void *handle;
+
+    if(library == NULL)
+        return;
+
+    if((handle = dlopen(library, RTLD_NOW)) != NULL)
+        aot_methods = (AOTMethod*)dlsym(handle, AOT_TABLE);
+
+    if(aot_methods == NULL)
+        printf("Couldn't load compiled methods from %s - ignored\n", library);
+#else
+    if(library != NULL)
+        printf("AOT libraries need JNI support - %s ignored\n", library);
+#endif
+}
+
+/* The compiler */
+
+static int intType(char c) {
+    return c == 'I' || c == 'Z' || c == 'B' || c == 'C' || c == 'S';
+}
+
+static int compilableSignature(char *sig) {
+    for(sig++; *sig != ')'; sig++)
+        if(!intType(*sig))
+            return FALSE;
+
+    return intType(sig[1]) || sig[1] == 'V';
+}
+
+static int compilableOpcode(MethodBlock *mb, int pc) {
+    ConstantPool *cp = &(CLASS_CB(mb->class)->constant_pool);
+    int op = mb->code[pc];
+
+    switch(op) {
+        case OPC_NOP: case OPC_BIPUSH: case OPC_SIPUSH: case OPC_ILOAD:
+        case OPC_ISTORE: case OPC_IINC: case OPC_INEG: case OPC_I2B:
+        case OPC_I2C: case OPC_I2S: case OPC_POP: case OPC_DUP: case OPC_SWAP:
+        case OPC_GOTO: case OPC_GOTO_W: case OPC_TABLESWITCH:
+        case OPC_LOOKUPSWITCH: case OPC_IRETURN: case OPC_RETURN:
+            return TRUE;
+
+        case OPC_LDC:
+            return CP_TYPE(cp, mb->code[pc+1]) == CONSTANT_Integer;
+
+        case OPC_LDC_W:
+            return CP_TYPE(cp, U2(&mb->code[pc+1])) == CONSTANT_Integer;
+    }
+
+    return (op >= OPC_ICONST_M1 && op <= OPC_ICONST_5) ||
+           (op >= OPC_ILOAD_0 && op <= OPC_ILOAD_3) ||
+           (op >= OPC_ISTORE_0 && op <= OPC_ISTORE_3) ||
+           (op >= OPC_IFEQ && op <= OPC_IF_ICMPLE) ||
+           op == OPC_IADD || op == OPC_ISUB || op == OPC_IMUL ||
+           op == OPC_ISHL || op == OPC_ISHR || op == OPC_IUSHR ||
+           op == OPC_IAND || op == OPC_IOR || op == OPC_IXOR;
+}
+
+static int compilable(MethodBlock *mb) {
+    int pc;
+
+    if(!(mb->access_flags & ACC_STATIC) || mb->code == NULL ||
+            (mb->access_flags & (ACC_NATIVE | ACC_ABSTRACT | ACC_SYNCHRONIZED)) ||
+            mb->exception_table_size != 0 || !compilableSignature(mb->type))
+        return FALSE;
+
+    for(pc = 0; pc < mb->code_size; pc += instructionLength(mb->code, pc))
+        if(!compilableOpcode(mb, pc))
+            return FALSE;
+
+    return TRUE;
+}
+
+/* Calls fn for each successor of the instruction at pc which can be
+   reached by a branch */
+
+#define BRANCH_TARGETS(code, pc, fn)                                  \
+{                                                                     \
+    int op = code[pc];                                                \
+    if((op >= OPC_IFEQ && op <= OPC_IF_ICMPLE) || op == OPC_GOTO) {   \
+        fn(pc + S2(&code[pc+1]));                                     \
+    } else if(op == OPC_GOTO_W) {                                     \
+        fn(pc + S4(&code[pc+1]));                                     \
+    } else if(op == OPC_TABLESWITCH) {                                  \
+        int base = (pc+4)&~3, k;                                      \
+        int n = S4(&code[base+8]) - S4(&code[base+4]) + 1;            \
+        fn(pc + S4(&code[base]));                                     \
+        for(k = 0; k < n; k++)                                        \
+            fn(pc + S4(&code[base+12+k*4]));                          \
+    } else if(op == OPC_LOOKUPSWITCH) {                               \
+        int base = (pc+4)&~3, k;                                      \
+        int n = S4(&code[base+4]);                                    \
+        fn(pc + S4(&code[base]));                                     \
+        for(k = 0; k < n; k++)                                        \
+            fn(pc + S4(&code[base+12+k*8]));                          \
+    }                                                                 \
+}
+
+/* The effect of an instruction on the stack depth */
+
+static int stackEffect(int op) {
+    if((op >= OPC_ICONST_M1 && op <= OPC_ICONST_5) || op == OPC_BIPUSH ||
+           op == OPC_SIPUSH || op == OPC_LDC || op == OPC_LDC_W ||
+           op == OPC_ILOAD || (op >= OPC_ILOAD_0 && op <= OPC_ILOAD_3) ||
+           op == OPC_DUP)
+        return 1;
+
+    if(op == OPC_ISTORE || (op >= OPC_ISTORE_0 && op <= OPC_ISTORE_3) ||
+           op == OPC_POP || op == OPC_TABLESWITCH || op == OPC_LOOKUPSWITCH ||
+           (op >= OPC_IFEQ && op <= OPC_IFLE) || op == OPC_IADD ||
+           op == OPC_ISUB || op == OPC_IMUL || op == OPC_ISHL || op == OPC_ISHR ||
+           op == OPC_IUSHR || op == OPC_IAND || op == OPC_IOR || op == OPC_IXOR)
+        return -1;
+
+    if(op >= OPC_IF_ICMPEQ && op <= OPC_IF_ICMPLE)
+        return -2;
+
+    return 0;
+}
+
+/* Find the stack depth before each instruction.  The bytecode is
+   verified, so the depth is the same along every path */
+
+static int *stackDepths(MethodBlock *mb) {
+    unsigned char *code = mb->code;
+    int *depth = (int*)malloc(mb->code_size * sizeof(int));
+    int *work = (int*)malloc(mb->code_size * sizeof(int));
+    int sp = 0, i;
+
+    for(i = 0; i < mb->code_size; i++)
+        depth[i] = -1;
+
+#define PUSH_WORK(target)                                             \
+    if(depth[target] == -1) {                                         \
+        depth[target] = d;                                            \
+        work[sp++] = target;                                          \
+    }
+
+    depth[0] = 0;
+    work[sp++] = 0;
+
+    while(sp) {
+        int pc = work[--sp];
+        int op = code[pc];
+        int d = depth[pc] + stackEffect(op);
+        int next = pc + instructionLength(code, pc);
+
+        BRANCH_TARGETS(code, pc, PUSH_WORK);
+
+        if(op != OPC_GOTO && op != OPC_GOTO_W && op != OPC_TABLESWITCH &&
+                 op != OPC_LOOKUPSWITCH && op != OPC_IRETURN && op != OPC_RETURN &&
+                 next < mb->code_size)
+            PUSH_WORK(next);
+    }
+
+    free(work);
+    return depth;
+}
+
+static char *conditions[] = {"==", "!=", "<", ">=", ">", "<="};
+
+static void translateMethod(FILE *out, MethodBlock *mb, int id) {
+    ConstantPool *cp = &(CLASS_CB(mb->class)->constant_pool);
+    unsigned char *code = mb->code;
+    int *depth = stackDepths(mb);
+    int pc, i;
+
+    fprintf(out, "\n/* %s.%s%s */\n\n", CLASS_CB(mb->class)->name, mb->name, mb->type);
+    fprintf(out, "static u4 *m%d(void *class, void *mb, u4 *args) {\n", id);
+
+    for(i = 0; i < mb->max_locals; i++)
+        if(i < mb->args_count)
+            fprintf(out, "    int l%d = args[%d];\n", i, i);
+        else
+            fprintf(out, "    int l%d = 0;\n", i);
+    for(i = 0; i < mb->max_stack; i++)
+        fprintf(out, "    int s%d;\n", i);
+
+    for(pc = 0; pc < mb->code_size; pc += instructionLength(code, pc)) {
+        int op = code[pc];
+        int d = depth[pc];
+
+        fprintf(out, "L%d: ", pc);
+
+        /* unreachable */
+        if(d == -1) {
+            fprintf(out, ";\n");
+            continue;
+        }
+
+        if(op >= OPC_ICONST_M1 && op <= OPC_ICONST_5)
+            fprintf(out, "s%d = %d;\n", d, op - OPC_ICONST_0);
+        else if(op >= OPC_ILOAD_0 && op <= OPC_ILOAD_3)
+            fprintf(out, "s%d = l%d;\n", d, op - OPC_ILOAD_0);
+        else if(op >= OPC_ISTORE_0 && op <= OPC_ISTORE_3)
+            fprintf(out, "l%d = s%d;\n", op - OPC_ISTORE_0, d-1);
+        else if(op >= OPC_IFEQ && op <= OPC_IFLE)
+            fprintf(out, "if(s%d %s 0) goto L%d;\n", d-1, conditions[op - OPC_IFEQ],
+                    pc + S2(&code[pc+1]));
+        else if(op >= OPC_IF_ICMPEQ && op <= OPC_IF_ICMPLE)
+            fprintf(out, "if(s%d %s s%d) goto L%d;\n", d-2, conditions[op - OPC_IF_ICMPEQ],
+                    d-1, pc + S2(&code[pc+1]));
+        else switch(op) {
+            case OPC_BIPUSH:
+                fprintf(out, "s%d = %d;\n", d, (signed char)code[pc+1]);
+                break;
+            case OPC_SIPUSH:
+                fprintf(out, "s%d = %d;\n", d, S2(&code[pc+1]));
+                break;
+            case OPC_LDC:
+                fprintf(out, "s%d = %d;\n", d, CP_INTEGER(cp, code[pc+1]));
+                break;
+            case OPC_LDC_W:
+                fprintf(out, "s%d = %d;\n", d, CP_INTEGER(cp, U2(&code[pc+1])));
+                break;
+            case OPC_ILOAD:
+                fprintf(out, "s%d = l%d;\n", d, code[pc+1]);
+                break;
+            case OPC_ISTORE:
+                fprintf(out, "l%d = s%d;\n", code[pc+1], d-1);
+                break;
+            case OPC_IINC:
+                fprintf(out, "l%d = (int)((u4)l%d + %d);\n", code[pc+1], code[pc+1],
+                        (signed char)code[pc+2]);
+                break;
+
+            /* Java arithmetic wraps, so add, subtract and multiply are
+               done unsigned */
+
+            case OPC_IADD:
+                fprintf(out, "s%d = (int)((u4)s%d + (u4)s%d);\n", d-2, d-2, d-1);
+                break;
+            case OPC_ISUB:
+                fprintf(out, "s%d = (int)((u4)s%d - (u4)s%d);\n", d-2, d-2, d-1);
+                break;
+            case OPC_IMUL:
+                fprintf(out, "s%d = (int)((u4)s%d * (u4)s%d);\n", d-2, d-2, d-1);
+                break;
+            case OPC_INEG:
+                fprintf(out, "s%d = (int)(0 - (u4)s%d);\n", d-1, d-1);
+                break;
+            case OPC_ISHL:
+                fprintf(out, "s%d = (int)((u4)s%d << (s%d & 31));\n", d-2, d-2, d-1);
+                break;
+            case OPC_ISHR:
+                fprintf(out, "s%d = s%d >> (s%d & 31);\n", d-2, d-2, d-1);
+                break;
+            case OPC_IUSHR:
+                fprintf(out, "s%d = (int)((u4)s%d >> (s%d & 31));\n", d-2, d-2, d-1);
+                break;
+            case OPC_IAND:
+                fprintf(out, "s%d &= s%d;\n", d-2, d-1);
+                break;
+            case OPC_IOR:
+                fprintf(out, "s%d |= s%d;\n", d-2, d-1);
+                break;
+            case OPC_IXOR:
+                fprintf(out, "s%d ^= s%d;\n", d-2, d-1);
+                break;
+            case OPC_I2B:
+                fprintf(out, "s%d = (signed char)s%d;\n", d-1, d-1);
+                break;
+            case OPC_I2C:
+                fprintf(out, "s%d = (unsigned short)s%d;\n", d-1, d-1);
+                break;
+            case OPC_I2S:
+                fprintf(out, "s%d = (short)s%d;\n", d-1, d-1);
+                break;
+            case OPC_DUP:
+                fprintf(out, "s%d = s%d;\n", d, d-1);
+                break;
+            case OPC_SWAP:
+                fprintf(out, "{ int t = s%d; s%d = s%d; s%d = t; }\n", d-1, d-1, d-2, d-2);
+                break;
+            case OPC_GOTO:
+                fprintf(out, "goto L%d;\n", pc + S2(&code[pc+1]));
+                break;
+            case OPC_GOTO_W:
+                fprintf(out, "goto L%d;\n", pc + S4(&code[pc+1]));
+                break;
+            case OPC_TABLESWITCH: {
+                int base = (pc+4)&~3;
+                int low = S4(&code[base+4]);
+                int high = S4(&code[base+8]);
+
+                fprintf(out, "switch(s%d) {\n", d-1);
+                for(i = 0; i <= high - low; i++)
+                    fprintf(out, "        case %d: goto L%d;\n", low + i,
+                            pc + S4(&code[base+12+i*4]));
+                fprintf(out, "        default: goto L%d;\n    }\n", pc + S4(&code[base]));
+                break;
+            }
+            case OPC_LOOKUPSWITCH: {
+                int base = (pc+4)&~3;
+                int npairs = S4(&code[base+4]);
+
+                fprintf(out, "switch(s%d) {\n", d-1);
+                for(i = 0; i < npairs; i++)
+                    fprintf(out, "        case %d: goto L%d;\n", S4(&code[base+8+i*8]),
+                            pc + S4(&code[base+12+i*8]));
+                fprintf(out, "        default: goto L%d;\n    }\n", pc + S4(&code[base]));
+                break;
+            }
+            case OPC_IRETURN:
+                fprintf(out, "args[0] = s%d; return args + 1;\n", d-1);
+                break;
+            case OPC_RETURN:
+                fprintf(out, "return args;\n");
+                break;
+            default:
+                fprintf(out, ";\n");
+                break;
+        }
+    }
+
+    fprintf(out, "}\n");
+    free(depth);
+}
+
+/* Write a UTF8 name as a C string literal */
+
+static void writeString(FILE *out, char *string) {
+    fputc('"', out);
+
+    for(; *string; string++)
+        if(*string == '"' || *string == '\\' || *string < ' ')
+            fprintf(out, "\\%03o", (unsigned char)*string);
+        else
+            fputc(*string, out);
+
+    fputc('"', out);
+}
+
+/* Run the C compiler on the generated source.  It is run directly
+   rather than through the shell, so the file names are passed as they
+   are.  CC may hold options as well as the compiler (e.g. "gcc -m32"),
+   so it is split at spaces */
+
+static int runCompiler(char *output, char *source) {
+    char *cc = getenv("CC");
+    char *argv[64], *pntr;
+    int argc = 0, status;
+    pid_t pid;
+
+    if(cc == NULL)
+        cc = "cc";
+
+    cc = strcpy((char*)malloc(strlen(cc) + 1), cc);
+
+    for(pntr = strtok(cc, " \t"); pntr != NULL && argc < 55; pntr = strtok(NULL, " \t"))
+        argv[argc++] = pntr;
+
+    if(argc == 0)
+        argv[argc++] = "cc";
+
+    argv[argc++] = "-shared";
+    argv[argc++] = "-fPIC";
+    argv[argc++] = "-O2";
+    argv[argc++] = "-fwrapv";
+    argv[argc++] = "-w";
+    argv[argc++] = "-o";
+    argv[argc++] = output;
+    argv[argc++] = source;
+    argv[argc] = NULL;
+
+    fflush(stdout);
+
+    if((pid = fork()) == 0) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    if(pid == -1 || waitpid(pid, &status, 0) == -1) {
+        perror("Couldn't run the C compiler");
+        status = -1;
+    } else if(WIFSIGNALED(status))
+        printf("C compiler %s killed by signal %d\n", argv[0], WTERMSIG(status));
+    else if(WEXITSTATUS(status) == 127)
+        printf("Couldn't run the C compiler %s\n", argv[0]);
+    else if(WEXITSTATUS(status) != 0)
+        printf("C compiler %s failed with exit status %d\n", argv[0], WEXITSTATUS(status));
+
+    free(cc);
+    return status == 0;
+}
+
+int compileAOT(char *output, char **classes, int count) {
+    char *source = (char*)malloc(strlen(output) + 3);
+    MethodBlock **compiled = NULL;
+    int ncompiled = 0, i, j, status;
+    FILE *out;
+
+    sprintf(source, "%s.c", output);
+
+    if((out = fopen(source, "w")) == NULL) {
+        printf("Couldn't open %s\n", source);
+        return FALSE;
+    }
+
+    fprintf(out, "/* Generated by jamvm -aot - do not edit */\n\n");
+    fprintf(out, "typedef unsigned int u4;\n");
+
+    for(i = 0; i < count; i++) {
+        Class *class;
+        ClassBlock *cb;
+        char *pntr;
+
+        for(pntr = classes[i]; *pntr; pntr++)
+            if(*pntr == '.')
+                *pntr = '/';
+
+        if((class = findSystemClass(classes[i])) == NULL) {
+            printException();
+            continue;
+        }
+
+        cb = CLASS_CB(class);
+        for(j = 0; j < cb->methods_count; j++) {
+            MethodBlock *mb = &cb->methods[j];
+
+            if(!compilable(mb))
+                continue;
+
+            compiled = (MethodBlock**)realloc(compiled, (ncompiled+1) * sizeof(MethodBlock*));
+            compiled[ncompiled] = mb;
+            translateMethod(out, mb, ncompiled++);
+        }
+    }
+
+    fprintf(out, "\nstruct {\n    char *class_name, *name, *type;\n");
+    fprintf(out, "    u4 checksum;\n    void *code;\n} %s[] = {\n", AOT_TABLE);
+
+    for(i = 0; i < ncompiled; i++) {
+        MethodBlock *mb = compiled[i];
+
+        fprintf(out, "    {");
+        writeString(out, CLASS_CB(mb->class)->name);
+        fprintf(out, ", ");
+        writeString(out, mb->name);
+        fprintf(out, ", ");
+        writeString(out, mb->type);
+        fprintf(out, ", 0x%x, m%d},\n", CLASS_CB(mb->class)->checksum, i);
+    }
+
+    fprintf(out, "    {0}\n};\n");
+    fclose(out);
+
+    printf("Compiled %d methods into %s\n", ncompiled, source);
+
+    status = runCompiler(output, source);
+
+    free(compiled);
+    free(source);
+    return status;
+}
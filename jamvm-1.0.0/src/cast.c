@@ -19,12 +19,123 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "jam.h"
+#include "lock_md.h"
+
+/* Subtype tests.  Each class holds a display of its superclasses,
+   indexed by depth in the hierarchy (java/lang/Object is at depth 0),
+   so testing for a subclass is a single indexed compare.  Each
+   interface is given an id when a class implementing it is linked,
+   and each class holds a bitset of the ids of all the interfaces it
+   implements, so testing for an interface is a single bit test.
+
+   The tables are built when the class is linked.  Tests on a class
+   which has none (e.g. a primitive class), or deeper than the display,
+   fall back to walking the hierarchy */
+
+static int next_interface_id = 0;
+
+/* Interface ids are handed out without a lock, as classes may be
+   linked concurrently (and before the main thread exists) */
+
+static int interfaceId(Class *interface) {
+    ClassBlock *cb = CLASS_CB(interface);
+    int id;
+
+    while((id = cb->interface_id) == 0) {
+        do
+            id = next_interface_id + 1;
+        while(!COMPARE_AND_SWAP(&next_interface_id, id - 1, id));
+
+        COMPARE_AND_SWAP(&cb->interface_id, 0, id);
+    }
+
+    return id;
+}
+
+#define SET_BIT(bits, id) bits[1 + ((id)>>5)] |= 1 << ((id)&31)
+
+#define TEST_BIT(bits, id) \
+    (((id)>>5) < bits[0] && (bits[1 + ((id)>>5)] & (1 << ((id)&31))))
+
+/* Add the ids of an interface and its superinterfaces to the bitset,
+   which is grown as needed.  The first word holds its length */
+
+static u4 *addInterface(u4 *bits, Class *interface) {
+    ClassBlock *cb = CLASS_CB(interface);
+    int id = interfaceId(interface);
+    int i;
+
+    if((id>>5) >= bits[0]) {
+        int words = (id>>5) + 1;
+
+        bits = (u4*)realloc(bits, (words + 1) * sizeof(u4));
+        memset(&bits[bits[0] + 1], 0, (words - bits[0]) * sizeof(u4));
+        bits[0] = words;
+    }
+
+    SET_BIT(bits, id);
+
+    for(i = 0; i < cb->interfaces_count; i++)
+        bits = addInterface(bits, cb->interfaces[i]);
+
+    return bits;
+}
+
+void linkSupertypes(Class *class) {
+    ClassBlock *cb = CLASS_CB(class);
+    Class *super = cb->super;
+    int depth = 0, i;
+    u4 *bits;
+
+    if(cb->depth != 0)
+        return;
+
+    if(super != NULL) {
+        ClassBlock *super_cb = CLASS_CB(super);
+        int words;
+
+        linkSupertypes(super);
+
+        words = super_cb->interface_bits[0];
+        bits = (u4*)malloc((words + 1) * sizeof(u4));
+        memcpy(bits, super_cb->interface_bits, (words + 1) * sizeof(u4));
+
+        memcpy(cb->display, super_cb->display, sizeof(cb->display));
+        depth = super_cb->depth;
+    } else {
+        bits = (u4*)malloc(sizeof(u4));
+        bits[0] = 0;
+    }
+
+    for(i = 0; i < cb->interfaces_count; i++)
+        bits = addInterface(bits, cb->interfaces[i]);
+
+    if(depth < DISPLAY_SIZE)
+        cb->display[depth] = class;
+
+    cb->interface_bits = bits;
+
+    /* depth is held biased by one, so zero marks the tables as not
+       yet built.  It must be set last, as other threads may be
+       testing against the class */
+
+    WMBARRIER();
+    cb->depth = depth + 1;
+}
 
 char implements(Class *class, Class *test) {
     ClassBlock *test_cb = CLASS_CB(test);
     int i;
 
+    if(test_cb->depth != 0) {
+        int id = CLASS_CB(class)->interface_id;
+        return id != 0 && TEST_BIT(test_cb->interface_bits, id);
+    }
+
     for(i = 0; i < test_cb->interfaces_count; i++)
         if((class == test_cb->interfaces[i]) ||
                       implements(class, test_cb->interfaces[i]))
@@ -37,6 +148,13 @@ char implements(Class *class, Class *test) {
 }
 
 char isSubClassOf(Class *class, Class *test) {
+    ClassBlock *class_cb = CLASS_CB(class);
+    ClassBlock *test_cb = CLASS_CB(test);
+    int depth = class_cb->depth - 1;
+
+    if(class_cb->depth != 0 && test_cb->depth != 0 && depth < DISPLAY_SIZE)
+        return depth < test_cb->depth && test_cb->display[depth] == class;
+
     for(; test != NULL && test != class; test = CLASS_CB(test)->super);
     return test != NULL;
 }
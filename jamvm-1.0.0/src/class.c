@@ -83,9 +83,9 @@ static Class *addClassToHash(Class *class) {
     Class *entry;
 
 #define HASH(ptr) utf8Hash(CLASS_CB((Class *)ptr)->name)
-#define COMPARE(ptr1, ptr2, hash1, hash2) (hash1 == hash2) && \
+#define COMPARE(ptr1, ptr2, hash1, hash2) ((hash1 == hash2) && \
                      utf8Comp(CLASS_CB((Class *)ptr1)->name, CLASS_CB((Class *)ptr2)->name) && \
-                     (CLASS_CB((Class*)ptr1)->class_loader == CLASS_CB((Class *)ptr2)->class_loader)
+                     (CLASS_CB((Class*)ptr1)->class_loader == CLASS_CB((Class *)ptr2)->class_loader))
 
     findHashEntry(loaded_classes, class, entry, TRUE, FALSE);
 
@@ -97,13 +97,14 @@ Class *defineClass(char *data, int offset, int len, Object *class_loader) {
     int cp_count, intf_count, i;
     u2 major_version, minor_version, this_idx, super_idx;
     u2 attr_count;
-    u4 magic;
+    u4 magic, checksum;
 
     ConstantPool *constant_pool;
     ClassBlock *classblock;
     Class *class, *found;
     Class **interfaces;
 
+    checksum = classChecksum(ptr, len);
     READ_U4(magic, ptr, len);
 
     if(magic != 0xcafebabe) {
@@ -119,6 +120,7 @@ Class *defineClass(char *data, int offset, int len, Object *class_loader) {
         return NULL;
 
     classblock = CLASS_CB(class);
+    classblock->checksum = checksum;
     READ_U2(cp_count = classblock->constant_pool_count, ptr, len);
 
     constant_pool = &classblock->constant_pool;
@@ -209,6 +211,11 @@ Class *defineClass(char *data, int offset, int len, Object *class_loader) {
 
     classblock->class_loader = class_loader;
 
+    /* Loaded classes are looked up by the address of their
+       class loader, so the loader must never be moved */
+    if(class_loader != NULL)
+        pinObject(class_loader);
+
     READ_U2(intf_count = classblock->interfaces_count, ptr, len);
     interfaces = classblock->interfaces =
                       (Class **)malloc(intf_count * sizeof(Class *));
@@ -233,6 +240,7 @@ Class *defineClass(char *data, int offset, int len, Object *class_loader) {
         READ_TYPE_INDEX(type_idx, constant_pool, CONSTANT_Utf8, ptr, len);
         classblock->fields[i].name = CP_UTF8(constant_pool, name_idx);
         classblock->fields[i].type = CP_UTF8(constant_pool, type_idx);
+        classblock->fields[i].class = class;
 
         READ_U2(attr_count, ptr, len);
         for(; attr_count != 0; attr_count--) {
@@ -290,6 +298,7 @@ Class *defineClass(char *data, int offset, int len, Object *class_loader) {
 
               READ_U4(code_length, ptr, len);
               method->code = (char *)malloc(code_length);
+              method->code_size = code_length;
               memcpy(method->code, ptr, code_length);
               ptr += code_length;
 
@@ -409,6 +418,7 @@ createArrayClass(char *classname, Object *class_loader) {
     classblock->interfaces[1] = findSystemClass("java/io/Serializable");
     
     classblock->flags = CLASS_INTERNAL;
+    linkSupertypes(class);
 
     if(classname[len-1] == ';') {
 
@@ -472,6 +482,171 @@ createPrimClass(char *classname) {
     return class;
 }
 
+#define IS_REF_TYPE(type) ((*type == 'L') || (*type == '['))
+
+static void buildRefMaps(ClassBlock *cb) {
+   ClassBlock *super_cb = NULL;
+   int super_refs = 0, refs = 0, statics = 0;
+   FieldBlock *fb;
+   int i;
+
+   if(!(cb->access_flags & ACC_INTERFACE) && cb->super) {
+      super_cb = CLASS_CB(cb->super);
+      super_refs = super_cb->ref_count;
+   }
+
+   for(i = 0, fb = cb->fields; i < cb->fields_count; i++, fb++)
+      if(IS_REF_TYPE(fb->type)) {
+         if(fb->access_flags & ACC_STATIC)
+            statics++;
+         else
+            refs++;
+      }
+
+   /* If no reference fields are added, share the superclass's map */
+
+   if(refs == 0)
+      cb->ref_offsets = super_refs ? super_cb->ref_offsets : NULL;
+   else {
+      cb->ref_offsets = (int*)malloc((super_refs + refs) * sizeof(int));
+      if(super_refs)
+         memcpy(cb->ref_offsets, super_cb->ref_offsets, super_refs * sizeof(int));
+   }
+
+   if(statics)
+      cb->static_refs = (u4**)malloc(statics * sizeof(u4*));
+
+   cb->ref_count = super_refs;
+   cb->static_ref_count = 0;
+
+   for(i = 0, fb = cb->fields; i < cb->fields_count; i++, fb++)
+      if(IS_REF_TYPE(fb->type)) {
+         if(fb->access_flags & ACC_STATIC)
+            cb->static_refs[cb->static_ref_count++] = &fb->static_value;
+         else
+            cb->ref_offsets[cb->ref_count++] = fb->offset;
+      }
+}
+
+/* Add an interface, and the interfaces it extends, to the list of
+   interfaces implemented by a class, if it isn't already there */
+
+static int addInterface(Class *interface, Class ***list, int count) {
+   ClassBlock *icb = CLASS_CB(interface);
+   int i;
+
+   for(i = 0; i < count; i++)
+      if((*list)[i] == interface)
+         return count;
+
+   *list = (Class**)realloc(*list, (count + 1) * sizeof(Class*));
+   (*list)[count++] = interface;
+
+   for(i = 0; i < icb->interfaces_count; i++)
+      count = addInterface(icb->interfaces[i], list, count);
+
+   return count;
+}
+
+/* build the interface method table - for every interface the class
+   implements (directly, or through its superclasses or superinterfaces)
+   map the interface's methods onto the methods implementing them */
+
+static void buildIMethodTable(Class *class) {
+   ClassBlock *cb = CLASS_CB(class);
+   Class **interfaces = NULL;
+   int count = 0;
+   int i, j;
+
+   if(cb->super) {
+      ClassBlock *super_cb = CLASS_CB(cb->super);
+
+      for(i = 0; i < super_cb->imethod_table_size; i++)
+         count = addInterface(super_cb->imethod_table[i].interface, &interfaces, count);
+   }
+
+   for(i = 0; i < cb->interfaces_count; i++)
+      count = addInterface(cb->interfaces[i], &interfaces, count);
+
+   cb->imethod_table_size = count;
+   if(count == 0) {
+      cb->imethod_table = NULL;
+      return;
+   }
+
+   cb->imethod_table = (ITableEntry*)malloc(count * sizeof(ITableEntry));
+
+   for(i = 0; i < count; i++) {
+      ClassBlock *icb = CLASS_CB(interfaces[i]);
+      ITableEntry *entry = &cb->imethod_table[i];
+      MethodBlock *imb = icb->methods;
+
+      entry->interface = interfaces[i];
+      entry->methods = (MethodBlock**)malloc(icb->methods_count * sizeof(MethodBlock*));
+
+      for(j = 0; j < icb->methods_count; j++, imb++)
+         entry->methods[j] = (imb->access_flags & ACC_STATIC) || (imb->name[0] == '<') ?
+                                   NULL : lookupMethod(class, imb->name, imb->type);
+   }
+
+   free(interfaces);
+}
+
+/* Find whether a method is trivial - an empty method (or a constructor
+   which only calls its superclass's empty no-arg constructor), or an
+   accessor which only gets or sets a field of this.  The superclass is
+   linked first, so its constructor has already been looked at.  Calls
+   are rewritten by the interpreter (see trivialInvoke in resolve.c) */
+
+static void findTrivial(Class *class, MethodBlock *mb) {
+   ConstantPool *cp = &(CLASS_CB(class)->constant_pool);
+   unsigned char *code = mb->code;
+
+   if(mb->access_flags & (ACC_STATIC | ACC_SYNCHRONIZED | ACC_NATIVE | ACC_ABSTRACT))
+       return;
+
+   if(mb->code_size == 1 && code[0] == OPC_RETURN) {
+       mb->trivial = TRIVIAL_EMPTY;
+       return;
+   }
+
+   if(code[0] != OPC_ALOAD_0)
+       return;
+
+   if(mb->code_size == 5 && code[1] == OPC_INVOKESPECIAL && code[4] == OPC_RETURN &&
+             strcmp(mb->name, "<init>") == 0) {
+       int idx = (code[2]<<8)|code[3];
+       Class *super = CLASS_CB(class)->super;
+       int name_type_idx = CP_METHOD_NAME_TYPE(cp, idx);
+       MethodBlock *super_mb;
+
+       if(super != NULL && CP_TYPE(cp, idx) == CONSTANT_Methodref &&
+             strcmp(CP_UTF8(cp, CP_CLASS(cp, CP_METHOD_CLASS(cp, idx))), CLASS_CB(super)->name) == 0 &&
+             strcmp(CP_UTF8(cp, CP_NAME_TYPE_NAME(cp, name_type_idx)), "<init>") == 0 &&
+             strcmp(CP_UTF8(cp, CP_NAME_TYPE_TYPE(cp, name_type_idx)), "()V") == 0 &&
+             (super_mb = findMethod(super, "<init>", "()V")) != NULL &&
+             super_mb->trivial == TRIVIAL_EMPTY)
+           mb->trivial = TRIVIAL_EMPTY;
+
+       return;
+   }
+
+   if(mb->code_size == 5 && code[1] == OPC_GETFIELD && mb->args_count == 1 &&
+             code[4] >= OPC_IRETURN && code[4] <= OPC_ARETURN) {
+       mb->trivial = TRIVIAL_GETTER;
+       mb->trivial_index = (code[2]<<8)|code[3];
+       return;
+   }
+
+   if(mb->code_size == 6 && code[2] == OPC_PUTFIELD && code[5] == OPC_RETURN &&
+             (((code[1] == OPC_ILOAD_1 || code[1] == OPC_FLOAD_1 ||
+                code[1] == OPC_ALOAD_1) && mb->args_count == 2) ||
+              ((code[1] == OPC_LLOAD_1 || code[1] == OPC_DLOAD_1) && mb->args_count == 3))) {
+       mb->trivial = TRIVIAL_SETTER;
+       mb->trivial_index = (code[3]<<8)|code[4];
+   }
+}
+
 void linkClass(Class *class) {
    ClassBlock *cb = CLASS_CB(class);
    MethodBlock *mb = cb->methods;
@@ -522,6 +697,12 @@ void linkClass(Class *class) {
 
    cb->object_size = offset;
 
+   /* build the reference maps used by the gc - the offsets of the
+      instance reference fields (extending the superclass's map) and
+      the addresses of the static reference fields */
+
+   buildRefMaps(cb);
+
    /* prepare methods */
 
    for(i = 0; i < cb->methods_count; i++,mb++) {
@@ -552,6 +733,14 @@ void linkClass(Class *class) {
 
            mb->max_locals = mb->args_count;
            mb->max_stack = 0;
+       } else if(!bindAOTMethod(mb, cb->checksum)) {
+
+           /* find where the method's frame holds references at
+              each call, so the gc can scan it precisely.  Methods
+              bound to compiled code are invoked as native methods */
+
+           mb->stack_map = buildStackMap(mb);
+           findTrivial(class, mb);
        }
 
        /* Static, private or init methods aren't dynamically invoked, so
@@ -564,9 +753,14 @@ void linkClass(Class *class) {
        /* if it's overriding an inherited method, replace in method table */
 
        if(cb->super &&
-             (overridden = lookupMethod(cb->super, mb->name, mb->type)))
+             (overridden = lookupMethod(cb->super, mb->name, mb->type))) {
            mb->method_table_index = overridden->method_table_index;
-       else
+
+           /* invalidate any call sites devirtualised to the
+              overridden method */
+
+           methodOverridden(overridden);
+       } else
            mb->method_table_index = spr_mthd_tbl_sze + new_methods_count++;
 
        /* check for finalizer */
@@ -595,6 +789,13 @@ void linkClass(Class *class) {
        method_table[mb->method_table_index] = mb;
    }
 
+   /* construct interface method table */
+
+   if(!(cb->access_flags & ACC_INTERFACE))
+       buildIMethodTable(class);
+
+   linkSupertypes(class);
+
    cb->flags = CLASS_LINKED;
 }
 
@@ -641,7 +842,7 @@ Class *initClass(Class *class) {
    if((mb = findMethod(class, "<clinit>", "()V")) != NULL)
       executeStaticMethod(class, mb);
 
-   if(excep = exceptionOccured()) {
+   if((excep = exceptionOccured())) {
        Class *error, *eiie;
        Object *ob;
 
@@ -719,9 +920,9 @@ Class *findHashedClass(char *classname, Object *class_loader) {
 #undef HASH
 #undef COMPARE
 #define HASH(ptr) utf8Hash(ptr)
-#define COMPARE(ptr1, ptr2, hash1, hash2) (hash1 == hash2) && \
+#define COMPARE(ptr1, ptr2, hash1, hash2) ((hash1 == hash2) && \
                      utf8Comp(ptr1, CLASS_CB((Class *)ptr2)->name) && \
-                     (CLASS_CB((Class *)ptr2)->class_loader == class_loader)
+                     (CLASS_CB((Class *)ptr2)->class_loader == class_loader))
 
    findHashEntry(loaded_classes, classname, class, FALSE, FALSE);
 
@@ -758,6 +959,25 @@ Class *findArrayClassFromClassLoader(char *classname, Object *class_loader) {
    return class;
 }
 
+/* The array class with the given element class.  It's cached in the
+   element class, so array allocation needs no name building or hash
+   lookup */
+
+Class *arrayClassOf(Class *class) {
+   ClassBlock *cb = CLASS_CB(class);
+   char ac_name[256];
+
+   if(cb->array_class != NULL)
+       return cb->array_class;
+
+   if(cb->name[0] == '[')
+       strcat(strcpy(ac_name, "["), cb->name);
+   else
+       strcat(strcat(strcpy(ac_name, "[L"), cb->name), ";");
+
+   return cb->array_class = findArrayClass(ac_name);
+}
+
 Class *findPrimClass(char *classname) {
    int i;
    Class *prim = NULL;
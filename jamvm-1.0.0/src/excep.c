@@ -76,10 +76,10 @@ void printException() {
     }
 }
 
-unsigned char *findCatchBlockInMethod(MethodBlock *mb, Class *exception, unsigned char *pc_pntr) {
+Instruction *findCatchBlockInMethod(MethodBlock *mb, Class *exception, Instruction *pc_pntr) {
     ExceptionTableEntry *table = mb->exception_table;
     int size = mb->exception_table_size;
-    int pc = pc_pntr - mb->code;
+    int pc = pc_pntr - mb->threaded_code;
     int i;
  
     for(i = 0; i < size; i++)
@@ -98,15 +98,15 @@ unsigned char *findCatchBlockInMethod(MethodBlock *mb, Class *exception, unsigne
                 if(!isInstanceOf(caught_class, exception))
                     continue;
             }
-            return mb->code + table[i].handler_pc;
+            return mb->threaded_code + table[i].handler_pc;
         }
 
     return NULL;
 }
     
-unsigned char *findCatchBlock(Class *exception) {
+Instruction *findCatchBlock(Class *exception) {
     Frame *frame = getExecEnv()->last_frame;
-    unsigned char *handler_pc = NULL;
+    Instruction *handler_pc = NULL;
 
     while(((handler_pc = findCatchBlockInMethod(frame->mb, exception, frame->last_pc)) == NULL)
 		    && (frame->prev->mb != NULL)) {
@@ -124,8 +124,8 @@ unsigned char *findCatchBlock(Class *exception) {
     return handler_pc;
 }
 
-int mapPC2LineNo(MethodBlock *mb, unsigned char *pc_pntr) {
-    int pc = pc_pntr - mb->code;
+int mapPC2LineNo(MethodBlock *mb, Instruction *pc_pntr) {
+    int pc = pc_pntr - mb->threaded_code;
     int i;
 
     if(mb->line_no_table_size > 0) {
@@ -167,7 +167,9 @@ void setStackTrace(Object *excep) {
         } while((bottom = bottom->prev)->prev != NULL);
     }
 
+    SATB_BARRIER(&INST_DATA(excep)[field->offset]);
     INST_DATA(excep)[field->offset] = (int)array;
+    WRITE_BARRIER(excep);
 }
 
 void printStackTrace(Object *excep, Object *writer) {
@@ -186,7 +188,7 @@ void printStackTrace(Object *excep, Object *writer) {
     depth = *INST_DATA(array);
     for(; i < depth; ) {
         MethodBlock *mb = (MethodBlock*)data[i++];
-	unsigned char *pc = (unsigned char *)data[i++];
+	Instruction *pc = (Instruction *)data[i++];
 	ClassBlock *cb = CLASS_CB(mb->class);
 	unsigned char *dot_name = slash2dots(cb->name);
         char *spntr = buff;
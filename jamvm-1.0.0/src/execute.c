@@ -69,7 +69,7 @@ void *executeMethodVaList(Object *ob, Class *class, MethodBlock *mb, va_list jar
     if(mb->access_flags & ACC_SYNCHRONIZED)
         objectLock(ob ? ob : (Object*)mb->class);
 
-    if(mb->access_flags & ACC_NATIVE)
+    if(mb->native_invoker != NULL)
         (*(u4 *(*)(Class*, MethodBlock*, u4*))mb->native_invoker)(class, mb, ret);
     else
         executeJava();
@@ -126,7 +126,7 @@ void *executeMethodList(Object *ob, Class *class, MethodBlock *mb, u8 *jargs) {
     if(mb->access_flags & ACC_SYNCHRONIZED)
         objectLock(ob ? ob : (Object*)mb->class);
 
-    if(mb->access_flags & ACC_NATIVE)
+    if(mb->native_invoker != NULL)
         (*(u4 *(*)(Class*, MethodBlock*, u4*))mb->native_invoker)(class, mb, ret);
     else
         executeJava();
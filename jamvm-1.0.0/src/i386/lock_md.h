@@ -32,3 +32,21 @@
     result;                                        \
 })
 
+
+/* Full memory barrier, and barrier ordering stores.  x86 doesn't
+   reorder stores with other stores, so the latter need only stop
+   the compiler reordering */
+
+#define MBARRIER() __asm__ __volatile__ ("lock; addl $0,0(%%esp)" ::: "memory")
+#define WMBARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+/* The address of the faulting instruction, given the context passed
+   to an SA_SIGINFO signal handler */
+
+#ifdef __x86_64__
+#define FAULT_PC(context) \
+    ((void*)((ucontext_t*)(context))->uc_mcontext.gregs[REG_RIP])
+#else
+#define FAULT_PC(context) \
+    ((void*)((ucontext_t*)(context))->uc_mcontext.gregs[REG_EIP])
+#endif
@@ -19,22 +19,25 @@
  */
 
 #include <stdio.h>
-#include <arpa/inet.h>
+#include <string.h>
 #include <math.h>
 
 #include "jam.h"
 #include "thread.h"
 #include "lock.h"
+#include "lock_md.h"
+#include "alloc.h"
 
-#define CP_SINDEX(p)  p[1]
-#define CP_DINDEX(p)  (p[1]<<8)|p[2]
-#define BRANCH(p)     (((signed char)p[1])<<8)|p[2]
-#define BRANCH_W(p)   (((signed char)p[1])<<24)|(p[2]<<16)|(p[3]<<8)|p[4]
-#define DSIGNED(p)    (((signed char)p[1])<<8)|p[2]
+/* Operands are decoded when the method is prepared (see prepare.c) */
+
+#define CP_SINDEX(p)  (p)[1].operand
+#define CP_DINDEX(p)  (p)[1].operand
+#define BRANCH(p)     (p)[1].target
+#define DSIGNED(p)    (p)[1].operand
 
 #define THROW_EXCEPTION(excep_name, message)                          \
 {                                                                     \
-    frame->last_pc = (unsigned char*)pc;                              \
+    frame->last_pc = (Instruction*)pc;                                \
     signalException(excep_name, message);                             \
     goto throwException;                                              \
 }
@@ -48,6 +51,29 @@
     if(!ref)                                                          \
         THROW_EXCEPTION("java/lang/NullPointerException", NULL);
 
+/* Null checks on references which are dereferenced at a small offset
+   straight away.  With implicit null checks the access faults instead,
+   and the SIGSEGV handler (see thread.c) jumps back into executeJava,
+   which throws the exception.  pc may be out of date after the jump,
+   so it is saved in the frame before the access.  A field access is
+   only certain to fault if its offset is within the null page */
+
+#ifdef IMPLICIT_NULL_CHECKS
+#define IMPLICIT_FIELD_LIMIT ((NULL_PAGE_SIZE - sizeof(Object) - 4) / 4)
+
+#define IMPLICIT_NULL_CHECK(ref)                                      \
+    frame->last_pc = (Instruction*)pc;
+
+#define FIELD_NULL_CHECK(ref, offset)                                 \
+    if((offset) >= IMPLICIT_FIELD_LIMIT) {                            \
+        NULL_POINTER_CHECK(ref)                                       \
+    } else                                                            \
+        frame->last_pc = (Instruction*)pc;
+#else
+#define IMPLICIT_NULL_CHECK(ref) NULL_POINTER_CHECK(ref)
+#define FIELD_NULL_CHECK(ref, offset) NULL_POINTER_CHECK(ref)
+#endif
+
 #define ARRAY_BOUNDS_CHECK(array, i)                                  \
     if(i >= *INST_DATA(array))                                        \
         THROW_OUT_OF_BOUNDS_EXCEPTION(i);
@@ -100,7 +126,7 @@
     TYPE *element;                                                    \
     int i = ostack[-1];						      \
     Object *array = (Object *)ostack[-2];			      \
-    NULL_POINTER_CHECK(array);                                        \
+    IMPLICIT_NULL_CHECK(array);                                       \
     ARRAY_BOUNDS_CHECK(array, i);                                     \
     element = (TYPE *)(((char *)INST_DATA(array)) +                   \
                               (i * sizeof(TYPE)) + 4);                \
@@ -115,7 +141,7 @@
     u8 *element;                                                      \
     int i = ostack[-1];						      \
     Object *array = (Object *)ostack[-2];			      \
-    NULL_POINTER_CHECK(array);                                        \
+    IMPLICIT_NULL_CHECK(array);                                       \
     ARRAY_BOUNDS_CHECK(array, i);                                     \
     element = (u8 *)(((char *)INST_DATA(array)) + (i << 3) + 4);      \
     ((u8*)ostack)[-1] = *element;                                     \
@@ -128,7 +154,7 @@
     int v = ostack[-1];						      \
     int i = ostack[-2];						      \
     Object *array = (Object *)ostack[-3];			      \
-    NULL_POINTER_CHECK(array);                                        \
+    IMPLICIT_NULL_CHECK(array);                                       \
     ARRAY_BOUNDS_CHECK(array, i);                                     \
     *(TYPE *)(((char *)INST_DATA(array))+(i * sizeof(TYPE)) + 4) = v; \
     ostack -= 3;		 			              \
@@ -141,7 +167,7 @@
     u8 v = ((u8*)ostack)[-1];					      \
     int i = ostack[-3];						      \
     Object *array = (Object *)ostack[-4];			      \
-    NULL_POINTER_CHECK(array);                                        \
+    IMPLICIT_NULL_CHECK(array);                                       \
     ARRAY_BOUNDS_CHECK(array, i);                                     \
     *(u8 *)(((char *)INST_DATA(array)) + (i << 3) + 4) = v;           \
     ostack -= 4;					              \
@@ -154,18 +180,80 @@
     int v1 = ostack[-2];		                              \
     int v2 = ostack[-1];		                              \
     if(v1 COND v2) {			                              \
-        pc += BRANCH(pc);		                              \
+        BACKEDGE(BRANCH(pc));                                         \
+        pc = BRANCH(pc);		                              \
     } else 				                              \
         pc += 3;			                              \
     ostack -= 2;			                              \
     DISPATCH(pc)				                      \
 }
 
+/* Superinstruction for iload; iload; if_icmp<cond>.  The local
+   variable indexes are packed into the spare operand word of the
+   branch, which is at offset words into the sequence */
+
+#define ILOAD_ILOAD_IF_ICMP(COND, offset)                             \
+{                                                                     \
+    int locals = pc[offset+2].operand;                                \
+    if((int)lvars[locals>>16] COND (int)lvars[locals&0xffff]) {       \
+        BACKEDGE(pc[offset+1].target);                                \
+        pc = pc[offset+1].target;                                     \
+    } else                                                            \
+        pc += offset+3;                                               \
+    DISPATCH(pc)                                                      \
+}
+
+/* Top-of-stack caching variants (see prepare.c).  The cached top
+   slot is held in tos, and ostack points past the slots in memory */
+
+#define BINARY_OP_TOS(TYPE, OP, opcode)                               \
+    tos = (TYPE)ostack[-1] OP (TYPE)tos;                              \
+    ostack -= 1;                                                      \
+    pc += 1;                                                          \
+    DEF_END(opcode)                                                   \
+    DISPATCH(pc)
+
+#define BINARY_OP_TOS_FLUSH(TYPE, OP, opcode)                         \
+    ostack[-1] = (TYPE)ostack[-1] OP (TYPE)tos;                       \
+    pc += 1;                                                          \
+    DEF_END(opcode)                                                   \
+    DISPATCH(pc)
+
+#define ARRAY_LOAD_TOS(dest, pop)                                     \
+{                                                                     \
+    int i = tos;                                                      \
+    Object *array = (Object *)ostack[-1];                             \
+    IMPLICIT_NULL_CHECK(array);                                       \
+    ARRAY_BOUNDS_CHECK(array, i);                                     \
+    dest = ((int *)INST_DATA(array))[i + 1];                          \
+    ostack -= pop;                                                    \
+    pc += 1;                                                          \
+    DISPATCH(pc)                                                      \
+}
+
+#define IF_TOS(COND)                                                  \
+    if((int)tos COND 0) {                                             \
+        BACKEDGE(BRANCH(pc));                                         \
+        pc = BRANCH(pc);                                              \
+    } else                                                            \
+        pc += 3;                                                      \
+    DISPATCH(pc)
+
+#define IF_ICMP_TOS(COND)                                             \
+    ostack -= 1;                                                      \
+    if((int)ostack[0] COND (int)tos) {                                \
+        BACKEDGE(BRANCH(pc));                                         \
+        pc = BRANCH(pc);                                              \
+    } else                                                            \
+        pc += 3;                                                      \
+    DISPATCH(pc)
+
 #define IF(COND, ostack, pc)		                              \
 {					                              \
     int v = *--ostack;			                              \
     if(v COND 0) {			                              \
-        pc += BRANCH(pc);		                              \
+        BACKEDGE(BRANCH(pc));		                              \
+        pc = BRANCH(pc);		                              \
     } else 				                              \
         pc += 3;			                              \
     DISPATCH(pc) 		                                      \
@@ -217,27 +305,44 @@
 
 #define WITH_OPCODE_CHANGE_CP_DINDEX(pc, opcode, index)               \
     index = CP_DINDEX(pc);                                            \
-    if(pc[0] != opcode)                                               \
+    if(!HAS_OPCODE(pc, opcode))                                       \
         DISPATCH(pc)
 
 #define OPCODE_REWRITE(pc, opcode)                                    \
-    pc[0] = opcode 
+    SET_OPCODE(pc, opcode)
 
 #define OPCODE_REWRITE_OPERAND1(pc, opcode, operand1)                 \
 {                                                                     \
-    pc[0] = OPC_LOCK;                                                 \
-    pc[1] = operand1;                                                 \
-    pc[0] = opcode;                                                   \
+    SET_OPCODE(pc, OPC_LOCK);                                         \
+    pc[1].operand = operand1;                                         \
+    WMBARRIER();                                                      \
+    SET_OPCODE(pc, opcode);                                           \
 }
 
 #define OPCODE_REWRITE_OPERAND2(pc, opcode, operand1, operand2)       \
 {                                                                     \
-    pc[0] = OPC_LOCK;                                                 \
-    pc[1] = operand1;                                                 \
-    pc[2] = operand2;                                                 \
-    pc[0] = opcode;                                                   \
+    SET_OPCODE(pc, OPC_LOCK);                                         \
+    pc[1].operand = operand1;                                         \
+    pc[2].operand = operand2;                                         \
+    WMBARRIER();                                                      \
+    SET_OPCODE(pc, opcode);                                           \
 }
 
+#define OPCODE_REWRITE_PTR(pc, opcode, pntr)                          \
+{                                                                     \
+    SET_OPCODE(pc, OPC_LOCK);                                         \
+    pc[1].ptr = pntr;                                                 \
+    WMBARRIER();                                                      \
+    SET_OPCODE(pc, opcode);                                           \
+}
+
+/* Length of the invoke instruction at pc in mb, on return from the
+   call.  The prepared code may have been quickened, so look at the
+   original bytecode */
+
+#define INVOKE_LENGTH(mb, pc)                                         \
+    (mb->code[pc - mb->threaded_code] == OPC_INVOKEINTERFACE ? 5 : 3)
+
 #ifdef THREADED
 /* Two levels of macros are needed to correctly produce the label
  * from the OPC_xxx macro passed into DEF_OPC as cpp doesn't 
@@ -255,34 +360,135 @@ opc##x##:
 opc##x:
 #endif
 
+/* In the shadow copy of the interpreter (see jit.c) every handler is
+   padded at its start, and every handler the JIT can copy is padded
+   at its end.  The padding differs between handlers, so any reference
+   from a template to code or data outside it changes.  In the real
+   interpreter an empty volatile asm takes the place of the padding,
+   so gcc places the labels the same way in both copies (see also
+   INTERP_CFLAGS in Makefile.am) */
+
+#ifdef JIT_SHADOW
+#define PAD(n) __asm__ __volatile__ (".skip %c0, 0x90" :: "i" (n));
+
+#define DEF_OPC(opcode)  \
+label(opcode)            \
+    PAD(opcode % 7 + 1)
+#else
 #define DEF_OPC(opcode)  \
-label(opcode)
+label(opcode)            \
+    __asm__ __volatile__ ("");
+#endif
 
 #define DISPATCH(pc)     \
-    goto *handlers[*pc];
+    goto *(pc)->handler;
+
+#define HANDLERS ((const void**)handlers)
+
+/* End of a handler which can be copied by the JIT (see jit.c) */
+
+#if (__GNUC__ == 2) && (__GNUC_MINOR__ <= 95)
+#define end_label(x)     \
+end##x##:
+#else
+#define end_label(x)     \
+end##x:
+#endif
+
+#ifdef JIT_SHADOW
+#define DEF_END(opcode)  \
+end_label(opcode)        \
+    PAD(opcode % 5 + 1)
+#else
+#define DEF_END(opcode)  \
+end_label(opcode)        \
+    __asm__ __volatile__ ("");
+#endif
+
+#define template(x)      \
+{&&opc##x, &&end##x}
+
+#define TEMPLATE(opcode) \
+template(opcode)
+
+/* Methods become hot through invocations and backward branches.  The
+   counters are updated by racing threads without locking, so updates
+   may be lost, and a threshold may be passed rather than reached.
+   The method is optimised once only, by the thread which sets
+   optimised (compileMethod checks compiled under the JIT lock) */
+
+#define INVOKED(mb)                                                   \
+    if(jit_enabled && !mb->optimised) {                               \
+        int count = ++mb->invoke_count;                               \
+        if(count >= JIT_INVOKE_THRESHOLD && jit_copying &&            \
+                  !mb->compiled)                                      \
+            compileMethod(mb, templates);                             \
+        if(count >= JIT_OPTIMISE_THRESHOLD &&                         \
+                  COMPARE_AND_SWAP(&mb->optimised, FALSE, TRUE))      \
+            optimiseMethod(mb, HANDLERS);                             \
+    }
+
+#define BACKEDGE(target)                                              \
+    if(jit_copying && (target) <= pc && !mb->compiled &&              \
+              ++mb->backedge_count >= JIT_BACKEDGE_THRESHOLD)         \
+        compileMethod(mb, templates);
+#define SET_OPCODE(pc, op) (pc)[0].handler = handlers[op]
+#define HAS_OPCODE(pc, op) ((pc)[0].handler == handlers[op])
 #else
 #define DEF_OPC(opcode)  \
     case opcode:
 
 #define DISPATCH(pc)     \
     break;
+
+#define HANDLERS NULL
+#define DEF_END(opcode)
+#define INVOKED(mb)                                                   \
+    if(jit_enabled && !mb->optimised &&                               \
+              ++mb->invoke_count >= JIT_OPTIMISE_THRESHOLD &&         \
+              COMPARE_AND_SWAP(&mb->optimised, FALSE, TRUE))          \
+        optimiseMethod(mb, NULL);
+#define BACKEDGE(target)
+#define SET_OPCODE(pc, op) (pc)[0].opcode = op
+#define HAS_OPCODE(pc, op) ((pc)[0].opcode == op)
+#endif
+
+#if defined(IMPLICIT_NULL_CHECKS) && !defined(JIT_SHADOW)
+/* The interpreter is placed in its own section, so the SIGSEGV handler
+   can tell a fault in the interpreter from one anywhere else */
+
+extern char __start_jamvm_interp[], __stop_jamvm_interp[];
+
+u4 *executeJava() __attribute__ ((section("jamvm_interp")));
+
+int isInterpreterCode(void *addr) {
+    return (char*)addr >= __start_jamvm_interp && (char*)addr < __stop_jamvm_interp;
+}
 #endif
 
 u4 *executeJava() {
-    ExecEnv *ee = getExecEnv();
+    Thread *self = threadSelf();
+    ExecEnv *ee = self->ee;
+#ifdef IMPLICIT_NULL_CHECKS
+    sigjmp_buf null_check_env;
+    sigjmp_buf *prev_null_check = ee->null_check_env;
+#endif
     Frame *frame = ee->last_frame;
-    MethodBlock *mb = frame->mb;
-    u4 *lvars = frame->lvars;
-    u4 *ostack = frame->ostack;
-    volatile unsigned char *pc = mb->code;
-    ConstantPool *cp = &(CLASS_CB(mb->class)->constant_pool);
-
-    Object *this = (Object*)lvars[0];
+    MethodBlock *mb;
+    u4 *lvars;
+    u4 *ostack;
+    volatile Instruction *pc;
+    u4 tos = 0;
+    volatile Instruction *inline_pc = NULL;
+    MethodBlock *inline_mb = NULL;
+    u4 *inline_lvars = NULL;
+    ConstantPool *cp;
+
+    Object *this;
     Class *new_class;
     MethodBlock *new_mb;
     u4 *arg1;
     u8 *neoU8;
-    u8 *neoU82;
     float *neoFloat;
     double *neoDouble;
 
@@ -311,23 +517,91 @@ u4 *executeJava() {
         &&opc182, &&opc183, &&opc184, &&opc185, &&unused, &&opc187, &&opc188, &&opc189, &&opc190,
         &&opc191, &&opc192, &&opc193, &&opc194, &&opc195, &&opc196, &&opc197, &&opc198, &&opc199,
         &&opc200, &&opc201, &&unused, &&opc203, &&opc204, &&unused, &&opc206, &&opc207, &&opc208,
-        &&opc209, &&opc210, &&opc211, &&opc212, &&opc213, &&opc214, &&opc215, &&opc216, &&unused,
-        &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&opc226,
-        &&opc227, &&opc228, &&opc229, &&opc230, &&opc231, &&opc232, &&unused, &&unused, &&unused,
+        &&opc209, &&opc210, &&opc211, &&opc212, &&opc213, &&opc214, &&opc215, &&opc216, &&opc217,
+        &&opc218, &&opc219, &&opc220, &&opc221, &&opc222, &&opc223, &&opc224, &&unused, &&unused,
+        &&unused, &&unused, &&opc229, &&opc230, &&opc231, &&opc232, &&unused, &&unused, &&unused,
 	&&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, 
 	&&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, &&unused, 
-	&&unused, &&unused};
+	&&unused, &&unused, &&opc256, &&opc257, &&opc258, &&opc259, &&opc260, &&opc261, &&opc262,
+        &&opc263, &&opc264, &&opc265, &&opc266, &&opc267, &&opc268, &&opc269, &&opc270, &&opc271,
+        &&opc272, &&opc273, &&opc274, &&opc275, &&opc276, &&opc277, &&opc278, &&opc279, &&opc280,
+        &&opc281, &&opc282, &&opc283, &&opc284, &&opc285, &&opc286, &&opc287, &&opc288, &&opc289,
+        &&opc290, &&opc291, &&opc292, &&opc293, &&opc294, &&opc295, &&opc296, &&opc297, &&opc298,
+        &&opc299, &&opc300, &&opc301, &&opc302, &&opc303, &&opc304, &&opc305, &&opc306, &&opc307,
+        &&opc308, &&opc309, &&opc310, &&opc311, &&opc312, &&opc313, &&opc314, &&opc315, &&opc316,
+        &&opc317, &&opc318, &&opc319, &&opc320, &&opc321};
+
+    /* Handlers which the JIT can copy.  These must be straight-line
+       code - they can't branch, call, throw or allocate */
+
+    static const void *templates[][2] = {
+        TEMPLATE(OPC_ACONST_NULL), TEMPLATE(OPC_ICONST_M1), TEMPLATE(OPC_ICONST_0),
+        TEMPLATE(OPC_ICONST_1), TEMPLATE(OPC_ICONST_2), TEMPLATE(OPC_ICONST_3),
+        TEMPLATE(OPC_ICONST_4), TEMPLATE(OPC_ICONST_5), TEMPLATE(OPC_BIPUSH),
+        TEMPLATE(OPC_SIPUSH), TEMPLATE(OPC_ILOAD), TEMPLATE(OPC_ILOAD_0),
+        TEMPLATE(OPC_ILOAD_1), TEMPLATE(OPC_ILOAD_2), TEMPLATE(OPC_ILOAD_3),
+        TEMPLATE(OPC_ISTORE), TEMPLATE(OPC_ISTORE_0), TEMPLATE(OPC_ISTORE_1),
+        TEMPLATE(OPC_ISTORE_2), TEMPLATE(OPC_ISTORE_3), TEMPLATE(OPC_POP),
+        TEMPLATE(OPC_POP2), TEMPLATE(OPC_DUP), TEMPLATE(OPC_IINC), TEMPLATE(OPC_ILOAD_TOS),
+        TEMPLATE(OPC_ILOAD_0_TOS), TEMPLATE(OPC_ILOAD_1_TOS), TEMPLATE(OPC_ILOAD_2_TOS),
+        TEMPLATE(OPC_ILOAD_3_TOS), TEMPLATE(OPC_ICONST_0_TOS), TEMPLATE(OPC_ICONST_1_TOS),
+        TEMPLATE(OPC_BIPUSH_TOS), TEMPLATE(OPC_IADD_TOS), TEMPLATE(OPC_IADD_TOS_FLUSH),
+        TEMPLATE(OPC_ISUB_TOS), TEMPLATE(OPC_ISUB_TOS_FLUSH), TEMPLATE(OPC_IMUL_TOS),
+        TEMPLATE(OPC_IMUL_TOS_FLUSH), TEMPLATE(OPC_IAND_TOS), TEMPLATE(OPC_IAND_TOS_FLUSH),
+        TEMPLATE(OPC_IOR_TOS), TEMPLATE(OPC_IOR_TOS_FLUSH), TEMPLATE(OPC_IXOR_TOS),
+        TEMPLATE(OPC_IXOR_TOS_FLUSH), TEMPLATE(OPC_ISHL_TOS), TEMPLATE(OPC_ISHL_TOS_FLUSH),
+        TEMPLATE(OPC_ISHR_TOS), TEMPLATE(OPC_ISHR_TOS_FLUSH), TEMPLATE(OPC_IUSHR_TOS),
+        TEMPLATE(OPC_IUSHR_TOS_FLUSH), TEMPLATE(OPC_ISTORE_TOS), TEMPLATE(OPC_ISTORE_0_TOS),
+        TEMPLATE(OPC_ISTORE_1_TOS), TEMPLATE(OPC_ISTORE_2_TOS), TEMPLATE(OPC_ISTORE_3_TOS), {NULL, NULL}};
+
+    /* Called with no frame, return the templates.  This is how the JIT
+       gets the templates of the shadow copy of the interpreter */
+
+    if(frame == NULL)
+        return (u4*)templates;
+#endif
 
-    DISPATCH(pc)
+    mb = frame->mb;
+    lvars = frame->lvars;
+    ostack = frame->ostack;
+    this = (Object*)lvars[0];
+    cp = &(CLASS_CB(mb->class)->constant_pool);
+
+#ifdef IMPLICIT_NULL_CHECKS
+    /* A null reference has been dereferenced.  Locals changed since
+       sigsetjmp are indeterminate here, but the faulting handler saved
+       its pc in the current frame (see IMPLICIT_NULL_CHECK), and
+       throwException reloads everything else from it.  tos and the
+       handlers' temporaries are dead - the top-of-stack cache is
+       always empty at an exception handler.  An inlined method can't
+       fault (see jit.c), so the caller can't be inlining one */
 
+    if(sigsetjmp(null_check_env, 0)) {
+        frame = ee->last_frame;
+        inline_pc = NULL;
+        signalException("java/lang/NullPointerException", NULL);
+        goto throwException;
+    }
+
+    ee->null_check_env = &null_check_env;
+#endif
+
+    if(mb->threaded_code == NULL)
+        prepareMethod(mb, HANDLERS);
+    INVOKED(mb);
+    pc = mb->threaded_code;
+
+#ifdef THREADED
+    DISPATCH(pc)
 #else
     while(TRUE) {
-        switch(*pc) {
+        switch(pc->opcode) {
             default:
 #endif
 
 unused:
-    printf("Unrecognised opcode %d in: %s.%s\n", *pc, CLASS_CB(mb->class)->name, mb->name);
+    printf("Unrecognised opcode %d in: %s.%s\n", mb->code[pc - mb->threaded_code],
+           CLASS_CB(mb->class)->name, mb->name);
     exit(0);
 
     DEF_OPC(OPC_NOP)
@@ -337,42 +611,50 @@ unused:
     DEF_OPC(OPC_ACONST_NULL)
         *ostack++ = 0;
         pc += 1;
+        DEF_END(OPC_ACONST_NULL)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_M1)
         *ostack++ = -1;
         pc += 1;
+        DEF_END(OPC_ICONST_M1)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_0)
     DEF_OPC(OPC_FCONST_0)
         *ostack++ = 0;
         pc += 1;
+        DEF_END(OPC_ICONST_0)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_1)
         *ostack++ = 1;
         pc += 1;
+        DEF_END(OPC_ICONST_1)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_2)
         *ostack++ = 2;
         pc += 1;
+        DEF_END(OPC_ICONST_2)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_3)
         *ostack++ = 3;
         pc += 1;
+        DEF_END(OPC_ICONST_3)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_4)
         *ostack++ = 4;
         pc += 1;
+        DEF_END(OPC_ICONST_4)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ICONST_5)
         *ostack++ = 5;
         pc += 1;
+        DEF_END(OPC_ICONST_5)
         DISPATCH(pc)
 
     DEF_OPC(OPC_LCONST_0)
@@ -422,13 +704,15 @@ unused:
         DISPATCH(pc)
 
     DEF_OPC(OPC_SIPUSH)
-        *ostack++ = (signed short)((pc[1]<<8)+pc[2]);
+        *ostack++ = pc[1].operand;
         pc += 3;
+        DEF_END(OPC_SIPUSH)
         DISPATCH(pc)
 
     DEF_OPC(OPC_BIPUSH)
-        *ostack++ = (signed char)pc[1];
+        *ostack++ = pc[1].operand;
         pc += 2;
+        DEF_END(OPC_BIPUSH)
         DISPATCH(pc)
 
     DEF_OPC(OPC_LDC)
@@ -467,6 +751,7 @@ unused:
     DEF_OPC(OPC_ALOAD)
         *ostack++ = lvars[CP_SINDEX(pc)];
         pc += 2;
+        DEF_END(OPC_ILOAD)
         DISPATCH(pc)
 
     DEF_OPC(OPC_LLOAD)
@@ -486,8 +771,12 @@ unused:
             OPCODE_REWRITE(pc, OPC_ALOAD_THIS);
         DISPATCH(pc)
 
+    /* A getfield_quick which the JIT devirtualised an invokevirtual
+       into can be deoptimised, so the aload_0 before it isn't fused */
+
     DEF_OPC(OPC_ALOAD_THIS)
-        if(pc[1] == OPC_GETFIELD_QUICK) {
+        if(HAS_OPCODE(pc+1, OPC_GETFIELD_QUICK) &&
+                   mb->code[pc - mb->threaded_code + 1] != OPC_INVOKEVIRTUAL) {
             OPCODE_REWRITE(pc, OPC_GETFIELD_THIS);
 	    DISPATCH(pc)
 	}
@@ -496,6 +785,7 @@ unused:
     DEF_OPC(OPC_FLOAD_0)
         *ostack++ = lvars[0];
         pc += 1;
+        DEF_END(OPC_ILOAD_0)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ILOAD_1)
@@ -503,6 +793,7 @@ unused:
     DEF_OPC(OPC_ALOAD_1)
         *ostack++ = lvars[1];
         pc += 1;
+        DEF_END(OPC_ILOAD_1)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ILOAD_2)
@@ -510,6 +801,7 @@ unused:
     DEF_OPC(OPC_ALOAD_2)
         *ostack++ = lvars[2];
         pc += 1;
+        DEF_END(OPC_ILOAD_2)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ILOAD_3)
@@ -517,6 +809,7 @@ unused:
     DEF_OPC(OPC_ALOAD_3)
         *ostack++ = lvars[3];
         pc += 1;
+        DEF_END(OPC_ILOAD_3)
         DISPATCH(pc)
 
     DEF_OPC(OPC_LLOAD_0)
@@ -595,6 +888,7 @@ unused:
     DEF_OPC(OPC_ASTORE)
         lvars[CP_SINDEX(pc)] = *--ostack;
         pc += 2;
+        DEF_END(OPC_ISTORE)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ISTORE_0)
@@ -602,6 +896,7 @@ unused:
     DEF_OPC(OPC_FSTORE_0)
         lvars[0] = *--ostack;
         pc += 1;
+        DEF_END(OPC_ISTORE_0)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ISTORE_1)
@@ -609,6 +904,7 @@ unused:
     DEF_OPC(OPC_FSTORE_1)
         lvars[1] = *--ostack;
         pc += 1;
+        DEF_END(OPC_ISTORE_1)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ISTORE_2)
@@ -616,6 +912,7 @@ unused:
     DEF_OPC(OPC_FSTORE_2)
         lvars[2] = *--ostack;
         pc += 1;
+        DEF_END(OPC_ISTORE_2)
         DISPATCH(pc)
 
     DEF_OPC(OPC_ISTORE_3)
@@ -623,6 +920,7 @@ unused:
     DEF_OPC(OPC_FSTORE_3)
         lvars[3] = *--ostack;
         pc += 1;
+        DEF_END(OPC_ISTORE_3)
         DISPATCH(pc)
 
     DEF_OPC(OPC_LSTORE_0)
@@ -669,10 +967,24 @@ unused:
         DISPATCH(pc)
 
     DEF_OPC(OPC_IASTORE)
-    DEF_OPC(OPC_AASTORE)
     DEF_OPC(OPC_FASTORE)
         ARRAY_STORE(int, ostack, pc);
 
+    DEF_OPC(OPC_AASTORE)
+    {
+        u4 v = ostack[-1];
+        int i = ostack[-2];
+        Object *array = (Object *)ostack[-3];
+        IMPLICIT_NULL_CHECK(array);
+        ARRAY_BOUNDS_CHECK(array, i);
+        SATB_BARRIER(&INST_DATA(array)[i+1]);
+        INST_DATA(array)[i+1] = v;
+        WRITE_BARRIER(array);
+        ostack -= 3;
+        pc += 1;
+        DISPATCH(pc)
+    }
+
     DEF_OPC(OPC_LASTORE)
     DEF_OPC(OPC_DASTORE)
         ARRAY_STORE_LONG(double, ostack, pc);
@@ -687,11 +999,13 @@ unused:
     DEF_OPC(OPC_POP)
         ostack--;
         pc += 1;
+        DEF_END(OPC_POP)
         DISPATCH(pc)
 
     DEF_OPC(OPC_POP2)
         ostack -= 2;
         pc += 1;
+        DEF_END(OPC_POP2)
         DISPATCH(pc)
 
     DEF_OPC(OPC_DUP) {
@@ -700,6 +1014,7 @@ unused:
        // *ostack++ = ostack[-1];
 
         pc += 1;
+        DEF_END(OPC_DUP)
         DISPATCH(pc)
     }
 
@@ -920,8 +1235,9 @@ unused:
         BINARY_OP(long long, ^, ostack, pc);
 
     DEF_OPC(OPC_IINC)
-        lvars[CP_SINDEX(pc)] += (signed char)pc[2];
+        lvars[CP_SINDEX(pc)] += pc[2].operand;
         pc += 3;
+        DEF_END(OPC_IINC)
         DISPATCH(pc)
 
     DEF_OPC(OPC_I2L)
@@ -988,12 +1304,16 @@ unused:
         CMP(long long, ostack, pc);
 
     DEF_OPC(OPC_DCMPG)
+        FCMP(double, ostack, pc, 1);
+
     DEF_OPC(OPC_DCMPL)
-        FCMP(double, ostack, pc, (*pc == OPC_DCMPG ? 1 : -1));
+        FCMP(double, ostack, pc, -1);
 
     DEF_OPC(OPC_FCMPG)
+        FCMP(float, ostack, pc, 1);
+
     DEF_OPC(OPC_FCMPL)
-        FCMP(float, ostack, pc, (*pc == OPC_FCMPG ? 1 : -1));
+        FCMP(float, ostack, pc, -1);
 
     DEF_OPC(OPC_IFEQ)
         IF(==, ostack, pc);
@@ -1034,49 +1354,303 @@ unused:
 	IF_ICMP(<=, ostack, pc);
 
     DEF_OPC(OPC_GOTO)
-        pc += BRANCH(pc);
+        BACKEDGE(BRANCH(pc));
+        pc = BRANCH(pc);
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_IINC_GOTO)
+        lvars[CP_SINDEX(pc)] += pc[2].operand;
+        BACKEDGE(pc[4].target);
+        pc = pc[4].target;
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPEQ_2)
+        ILOAD_ILOAD_IF_ICMP(==, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPEQ_3)
+        ILOAD_ILOAD_IF_ICMP(==, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPEQ_4)
+        ILOAD_ILOAD_IF_ICMP(==, 4);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPNE_2)
+        ILOAD_ILOAD_IF_ICMP(!=, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPNE_3)
+        ILOAD_ILOAD_IF_ICMP(!=, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPNE_4)
+        ILOAD_ILOAD_IF_ICMP(!=, 4);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLT_2)
+        ILOAD_ILOAD_IF_ICMP(<, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLT_3)
+        ILOAD_ILOAD_IF_ICMP(<, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLT_4)
+        ILOAD_ILOAD_IF_ICMP(<, 4);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGE_2)
+        ILOAD_ILOAD_IF_ICMP(>=, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGE_3)
+        ILOAD_ILOAD_IF_ICMP(>=, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGE_4)
+        ILOAD_ILOAD_IF_ICMP(>=, 4);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGT_2)
+        ILOAD_ILOAD_IF_ICMP(>, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGT_3)
+        ILOAD_ILOAD_IF_ICMP(>, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPGT_4)
+        ILOAD_ILOAD_IF_ICMP(>, 4);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLE_2)
+        ILOAD_ILOAD_IF_ICMP(<=, 2);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLE_3)
+        ILOAD_ILOAD_IF_ICMP(<=, 3);
+
+    DEF_OPC(OPC_ILOAD_ILOAD_IF_ICMPLE_4)
+        ILOAD_ILOAD_IF_ICMP(<=, 4);
+
+    DEF_OPC(OPC_ILOAD_TOS)
+        tos = lvars[CP_SINDEX(pc)];
+        pc += 2;
+        DEF_END(OPC_ILOAD_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ILOAD_0_TOS)
+        tos = lvars[0];
+        pc += 1;
+        DEF_END(OPC_ILOAD_0_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ILOAD_1_TOS)
+        tos = lvars[1];
+        pc += 1;
+        DEF_END(OPC_ILOAD_1_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ILOAD_2_TOS)
+        tos = lvars[2];
+        pc += 1;
+        DEF_END(OPC_ILOAD_2_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ILOAD_3_TOS)
+        tos = lvars[3];
+        pc += 1;
+        DEF_END(OPC_ILOAD_3_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ICONST_0_TOS)
+        tos = 0;
+        pc += 1;
+        DEF_END(OPC_ICONST_0_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ICONST_1_TOS)
+        tos = 1;
+        pc += 1;
+        DEF_END(OPC_ICONST_1_TOS)
         DISPATCH(pc)
 
+    DEF_OPC(OPC_BIPUSH_TOS)
+        tos = pc[1].operand;
+        pc += 2;
+        DEF_END(OPC_BIPUSH_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_IADD_TOS)
+        BINARY_OP_TOS(int, +, OPC_IADD_TOS);
+
+    DEF_OPC(OPC_IADD_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, +, OPC_IADD_TOS_FLUSH);
+
+    DEF_OPC(OPC_ISUB_TOS)
+        BINARY_OP_TOS(int, -, OPC_ISUB_TOS);
+
+    DEF_OPC(OPC_ISUB_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, -, OPC_ISUB_TOS_FLUSH);
+
+    DEF_OPC(OPC_IMUL_TOS)
+        BINARY_OP_TOS(int, *, OPC_IMUL_TOS);
+
+    DEF_OPC(OPC_IMUL_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, *, OPC_IMUL_TOS_FLUSH);
+
+    DEF_OPC(OPC_IAND_TOS)
+        BINARY_OP_TOS(int, &, OPC_IAND_TOS);
+
+    DEF_OPC(OPC_IAND_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, &, OPC_IAND_TOS_FLUSH);
+
+    DEF_OPC(OPC_IOR_TOS)
+        BINARY_OP_TOS(int, |, OPC_IOR_TOS);
+
+    DEF_OPC(OPC_IOR_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, |, OPC_IOR_TOS_FLUSH);
+
+    DEF_OPC(OPC_IXOR_TOS)
+        BINARY_OP_TOS(int, ^, OPC_IXOR_TOS);
+
+    DEF_OPC(OPC_IXOR_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, ^, OPC_IXOR_TOS_FLUSH);
+
+    DEF_OPC(OPC_ISHL_TOS)
+        BINARY_OP_TOS(int, <<, OPC_ISHL_TOS);
+
+    DEF_OPC(OPC_ISHL_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, <<, OPC_ISHL_TOS_FLUSH);
+
+    DEF_OPC(OPC_ISHR_TOS)
+        BINARY_OP_TOS(int, >>, OPC_ISHR_TOS);
+
+    DEF_OPC(OPC_ISHR_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(int, >>, OPC_ISHR_TOS_FLUSH);
+
+    DEF_OPC(OPC_IUSHR_TOS)
+        BINARY_OP_TOS(unsigned int, >>, OPC_IUSHR_TOS);
+
+    DEF_OPC(OPC_IUSHR_TOS_FLUSH)
+        BINARY_OP_TOS_FLUSH(unsigned int, >>, OPC_IUSHR_TOS_FLUSH);
+
+    DEF_OPC(OPC_IALOAD_TOS)
+        ARRAY_LOAD_TOS(tos, 1);
+
+    DEF_OPC(OPC_IALOAD_TOS_FLUSH)
+        ARRAY_LOAD_TOS(ostack[-1], 0);
+
+    DEF_OPC(OPC_ISTORE_TOS)
+        lvars[CP_SINDEX(pc)] = tos;
+        pc += 2;
+        DEF_END(OPC_ISTORE_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ISTORE_0_TOS)
+        lvars[0] = tos;
+        pc += 1;
+        DEF_END(OPC_ISTORE_0_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ISTORE_1_TOS)
+        lvars[1] = tos;
+        pc += 1;
+        DEF_END(OPC_ISTORE_1_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ISTORE_2_TOS)
+        lvars[2] = tos;
+        pc += 1;
+        DEF_END(OPC_ISTORE_2_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_ISTORE_3_TOS)
+        lvars[3] = tos;
+        pc += 1;
+        DEF_END(OPC_ISTORE_3_TOS)
+        DISPATCH(pc)
+
+    DEF_OPC(OPC_IFEQ_TOS)
+        IF_TOS(==);
+
+    DEF_OPC(OPC_IFNE_TOS)
+        IF_TOS(!=);
+
+    DEF_OPC(OPC_IFLT_TOS)
+        IF_TOS(<);
+
+    DEF_OPC(OPC_IFGE_TOS)
+        IF_TOS(>=);
+
+    DEF_OPC(OPC_IFGT_TOS)
+        IF_TOS(>);
+
+    DEF_OPC(OPC_IFLE_TOS)
+        IF_TOS(<=);
+
+    DEF_OPC(OPC_IF_ICMPEQ_TOS)
+        IF_ICMP_TOS(==);
+
+    DEF_OPC(OPC_IF_ICMPNE_TOS)
+        IF_ICMP_TOS(!=);
+
+    DEF_OPC(OPC_IF_ICMPLT_TOS)
+        IF_ICMP_TOS(<);
+
+    DEF_OPC(OPC_IF_ICMPGE_TOS)
+        IF_ICMP_TOS(>=);
+
+    DEF_OPC(OPC_IF_ICMPGT_TOS)
+        IF_ICMP_TOS(>);
+
+    DEF_OPC(OPC_IF_ICMPLE_TOS)
+        IF_ICMP_TOS(<=);
+
+    DEF_OPC(OPC_IASTORE_TOS)
+    {
+        int i = ostack[-1];
+        Object *array = (Object *)ostack[-2];
+        IMPLICIT_NULL_CHECK(array);
+        ARRAY_BOUNDS_CHECK(array, i);
+        ((int *)INST_DATA(array))[i + 1] = tos;
+        ostack -= 2;
+        pc += 1;
+        DISPATCH(pc)
+    }
+
     DEF_OPC(OPC_JSR)
-        *ostack++ = (u4)pc+3;
-        pc += BRANCH(pc);
+        *ostack++ = (u4)(pc+3);
+        pc = BRANCH(pc);
         DISPATCH(pc)
 
     DEF_OPC(OPC_RET)
-        pc = (unsigned char*)lvars[CP_SINDEX(pc)];
+        pc = (Instruction*)lvars[CP_SINDEX(pc)];
         DISPATCH(pc)
 
     DEF_OPC(OPC_TABLESWITCH)
     {
-        int *aligned_pc = (int*)((int)(pc + 4) & ~0x3);
-        int deflt = ntohl(aligned_pc[0]);
-        int low   = ntohl(aligned_pc[1]);
-        int high  = ntohl(aligned_pc[2]);
+        int low   = pc[2].operand;
+        int high  = pc[3].operand;
         int index = *--ostack;
 
         if(index < low || index > high)
-            pc += deflt;
+            pc = pc[1].target;
         else
-            pc += ntohl(aligned_pc[index - low + 3]);
+            pc = pc[index - low + 4].target;
 
         DISPATCH(pc)
     }
 
+    /* The pairs are sorted by key (dense tables have already been
+       turned into a tableswitch by prepare) */
+
     DEF_OPC(OPC_LOOKUPSWITCH)
     {
-        int *aligned_pc = (int*)((int)(pc + 4) & ~0x3);
-        int deflt  = ntohl(aligned_pc[0]);
-        int npairs = ntohl(aligned_pc[1]);
+        int low    = 0;
+        int high   = pc[2].operand - 1;
         int key    = *--ostack;
-        int i;
-
-        for(i = 2; (i < npairs*2+2) && (key != ntohl(aligned_pc[i])); i += 2);
 
-        if(i == npairs*2+2)
-            pc += deflt;
-        else
-            pc += ntohl(aligned_pc[i+1]);
+        while(low <= high) {
+            int mid = (low + high) >> 1;
+            int mid_key = pc[mid*2+3].operand;
+
+            if(key < mid_key)
+                high = mid - 1;
+            else if(key > mid_key)
+                low = mid + 1;
+            else {
+                pc = pc[mid*2+4].target;
+                DISPATCH(pc)
+            }
+        }
 
+        pc = pc[1].target;
         DISPATCH(pc)
     }
 
@@ -1088,14 +1662,8 @@ unused:
 
     DEF_OPC(OPC_LRETURN)
     DEF_OPC(OPC_DRETURN)
-      neoU8 = ostack;
-    neoU8--;
-    neoU82 = lvars;
-    *neoU8 = neoU8;
-    ostack = neoU8;
-    neoU82++;
-    lvars = neoU82;
-	//*((u8*)lvars)++ = *(--(u8*)ostack);
+        *(u8*)lvars = ((u8*)ostack)[-1];
+        lvars += 2;
         goto methodReturn;
 
     DEF_OPC(OPC_RETURN)
@@ -1104,40 +1672,46 @@ unused:
     DEF_OPC(OPC_GETSTATIC) 
     {
         FieldBlock *fb;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_GETSTATIC, idx);
 	       
-        frame->last_pc = (unsigned char*)pc;
-	fb = resolveField(mb->class, CP_DINDEX(pc));
+        frame->last_pc = (Instruction*)pc;
+	fb = resolveField(mb->class, idx);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if((*fb->type == 'J') || (*fb->type == 'D'))
-            OPCODE_REWRITE(pc, OPC_GETSTATIC2_QUICK);
-        else
-            OPCODE_REWRITE(pc, OPC_GETSTATIC_QUICK);
+        if((*fb->type == 'J') || (*fb->type == 'D')) {
+            OPCODE_REWRITE_PTR(pc, OPC_GETSTATIC2_QUICK, fb);
+        } else
+            OPCODE_REWRITE_PTR(pc, OPC_GETSTATIC_QUICK, fb);
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_PUTSTATIC) 
     {
         FieldBlock *fb;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_PUTSTATIC, idx);
 	       
-        frame->last_pc = (unsigned char*)pc;
-	fb = resolveField(mb->class, CP_DINDEX(pc));
+        frame->last_pc = (Instruction*)pc;
+	fb = resolveField(mb->class, idx);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if((*fb->type == 'J') || (*fb->type == 'D'))
-            OPCODE_REWRITE(pc, OPC_PUTSTATIC2_QUICK);
-        else
-            OPCODE_REWRITE(pc, OPC_PUTSTATIC_QUICK);
+        if((*fb->type == 'J') || (*fb->type == 'D')) {
+            OPCODE_REWRITE_PTR(pc, OPC_PUTSTATIC2_QUICK, fb);
+        } else
+            OPCODE_REWRITE_PTR(pc, OPC_PUTSTATIC_QUICK, fb);
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_GETSTATIC_QUICK) 
     {
-        FieldBlock *fb = (FieldBlock *)CP_INFO(cp, CP_DINDEX(pc));
+        FieldBlock *fb = (FieldBlock *)pc[1].ptr;
         *ostack++ = fb->static_value;
         pc += 3;
         DISPATCH(pc)
@@ -1145,7 +1719,7 @@ unused:
 
     DEF_OPC(OPC_GETSTATIC2_QUICK) 
     {
-        FieldBlock *fb = (FieldBlock *)CP_INFO(cp, CP_DINDEX(pc));
+        FieldBlock *fb = (FieldBlock *)pc[1].ptr;
         *(u8*)ostack = *(u8*)&fb->static_value;
         ostack += 2;
         pc += 3;
@@ -1154,15 +1728,17 @@ unused:
 
     DEF_OPC(OPC_PUTSTATIC_QUICK) 
     {
-        FieldBlock *fb = (FieldBlock *)CP_INFO(cp, CP_DINDEX(pc));
+        FieldBlock *fb = (FieldBlock *)pc[1].ptr;
+        SATB_BARRIER(&fb->static_value);
         fb->static_value = *--ostack;
+        WRITE_BARRIER(fb->class);
         pc += 3;
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_PUTSTATIC2_QUICK) 
     {
-        FieldBlock *fb = (FieldBlock *)CP_INFO(cp, CP_DINDEX(pc));
+        FieldBlock *fb = (FieldBlock *)pc[1].ptr;
         ostack -= 2;
         *(u8*)&fb->static_value = *(u8*)ostack;
         pc += 3;
@@ -1176,16 +1752,13 @@ unused:
 
         WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_GETFIELD, idx);
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         fb = resolveField(mb->class, idx);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if(fb->offset > 255)
-            OPCODE_REWRITE(pc, OPC_GETFIELD_QUICK_W);
-        else
-            OPCODE_REWRITE_OPERAND1(pc, ((*fb->type == 'J') || (*fb->type == 'D') ? 
+        OPCODE_REWRITE_OPERAND1(pc, ((*fb->type == 'J') || (*fb->type == 'D') ? 
                  OPC_GETFIELD2_QUICK : OPC_GETFIELD_QUICK), fb->offset);
 
         DISPATCH(pc)
@@ -1198,16 +1771,13 @@ unused:
 
 	WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_PUTFIELD, idx);
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         fb = resolveField(mb->class, idx);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if(fb->offset > 255)
-            OPCODE_REWRITE(pc, OPC_PUTFIELD_QUICK_W);
-        else
-            OPCODE_REWRITE_OPERAND1(pc, ((*fb->type == 'J') || (*fb->type == 'D') ? 
+        OPCODE_REWRITE_OPERAND1(pc, ((*fb->type == 'J') || (*fb->type == 'D') ? 
                  OPC_PUTFIELD2_QUICK : OPC_PUTFIELD_QUICK), fb->offset);
 
         DISPATCH(pc)
@@ -1216,26 +1786,26 @@ unused:
     DEF_OPC(OPC_GETFIELD_QUICK)
     {
         Object *o = (Object *)ostack[-1];
-	NULL_POINTER_CHECK(o);
+	FIELD_NULL_CHECK(o, pc[1].operand);
 		
-        ostack[-1] = INST_DATA(o)[pc[1]];
+        ostack[-1] = INST_DATA(o)[pc[1].operand];
         pc += 3;
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_GETFIELD_THIS)
-        *ostack++ = INST_DATA(this)[pc[2]];
+        *ostack++ = INST_DATA(this)[pc[2].operand];
         pc += 4;
         DISPATCH(pc)
 
     DEF_OPC(OPC_GETFIELD2_QUICK)
     {
         Object *o = (Object *)*--ostack;
-	NULL_POINTER_CHECK(o);
+	FIELD_NULL_CHECK(o, pc[1].operand);
 		
         //        *((u8*)ostack)++ = *(u8*)(&(INST_DATA(o)[pc[1]]));
         neoU8 = ostack;
-        *neoU8 = *(u8*)(&(INST_DATA(o)[pc[1]]));
+        *neoU8 = *(u8*)(&(INST_DATA(o)[pc[1].operand]));
         neoU8++;
         ostack = neoU8;
         
@@ -1243,62 +1813,14 @@ unused:
         DISPATCH(pc)
     }
 
-    DEF_OPC(OPC_GETFIELD_QUICK_W)
-    {
-        FieldBlock *fb = (FieldBlock*)CP_INFO(cp, CP_DINDEX(pc));
-        Object *o = (Object *)*--ostack;
-        u4 *addr;
-
-	NULL_POINTER_CHECK(o);
-		
-        addr = &(INST_DATA(o)[fb->offset]);
-
-        if((*fb->type == 'J') || (*fb->type == 'D')) {
-            u8 v = *(u8*)addr;
-            *(u8*)ostack = v;
-            ostack += 2;
-        } else {
-            u4 v = *addr;
-            *ostack++ = v; 
-        }
-
-        pc += 3;
-        DISPATCH(pc)
-    }
-
-    DEF_OPC(OPC_PUTFIELD_QUICK_W)
-    {
-        FieldBlock *fb = (FieldBlock *)CP_INFO(cp, CP_DINDEX(pc));
-        Object *o;
- 
-        if((*fb->type == 'J') || (*fb->type == 'D')) {
-            u8 v, *addr;
-            ostack -= 2;
-            v = *(u8*)ostack;
-            o = (Object *)*--ostack;
-	    NULL_POINTER_CHECK(o);
-
-            addr = (u8*)&(INST_DATA(o)[fb->offset]);
-            *addr = v;
-        } else {
-            u4 *addr, v = *--ostack;
-            o = (Object *)*--ostack;
-	    NULL_POINTER_CHECK(o);
-
-            addr = &(INST_DATA(o)[fb->offset]);
-            *addr = v;
-        }
-
-        pc += 3;
-        DISPATCH(pc)
-    }
-
     DEF_OPC(OPC_PUTFIELD_QUICK)
     {
         Object *o = (Object *)ostack[-2];
-	NULL_POINTER_CHECK(o);
+	FIELD_NULL_CHECK(o, pc[1].operand);
 		
-        INST_DATA(o)[pc[1]] = ostack[-1];
+        SATB_BARRIER(&INST_DATA(o)[pc[1].operand]);
+        INST_DATA(o)[pc[1].operand] = ostack[-1];
+        WRITE_BARRIER(o);
         ostack -= 2;
         pc += 3;
         DISPATCH(pc)
@@ -1307,9 +1829,9 @@ unused:
     DEF_OPC(OPC_PUTFIELD2_QUICK)
     {
         Object *o = (Object *)ostack[-3];
-	NULL_POINTER_CHECK(o);
+	FIELD_NULL_CHECK(o, pc[1].operand);
 		
-        *(u8*)(&(INST_DATA(o)[pc[1]])) = *(u8*)(&ostack[-2]);
+        *(u8*)(&(INST_DATA(o)[pc[1].operand])) = *(u8*)(&ostack[-2]);
         ostack -= 3;
         pc += 3;
         DISPATCH(pc)
@@ -1317,38 +1839,63 @@ unused:
 
     DEF_OPC(OPC_INVOKEVIRTUAL)
     {
+        InvokeCache *cache;
         int idx;
         WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_INVOKEVIRTUAL, idx);
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         new_mb = resolveMethod(mb->class, idx);
  
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if((new_mb->args_count < 256) && (new_mb->method_table_index < 256)) {
-            OPCODE_REWRITE_OPERAND2(pc, OPC_INVOKEVIRTUAL_QUICK, new_mb->method_table_index, new_mb->args_count);
-	} else
-            OPCODE_REWRITE(pc, OPC_INVOKEVIRTUAL_QUICK_W);
+        if((cache = newInvokeCache(new_mb, mb, pc - mb->threaded_code)) != NULL) {
+            OPCODE_REWRITE_PTR(pc, OPC_INVOKEVIRTUAL_CACHED, cache);
+        } else
+            OPCODE_REWRITE_OPERAND2(pc, OPC_INVOKEVIRTUAL_QUICK, new_mb->method_table_index,
+                                    new_mb->args_count);
         DISPATCH(pc)
     }
 
-    DEF_OPC(OPC_INVOKEVIRTUAL_QUICK_W)
-        new_mb = (MethodBlock *)CP_INFO(cp, CP_DINDEX(pc));
-        arg1 = ostack - (new_mb->args_count);
-	NULL_POINTER_CHECK(*arg1);
+    /* Call through the site's inline cache */
+
+    DEF_OPC(OPC_INVOKEVIRTUAL_CACHED)
+    DEF_OPC(OPC_INVOKEINTERFACE_QUICK)
+    {
+        InvokeCache *cache;
+        InvokeCacheEntry *entry;
+        int i;
+
+        cache = (InvokeCache*)pc[1].ptr;
+        arg1 = ostack - cache->mb->args_count;
+        IMPLICIT_NULL_CHECK(*arg1);
 
         new_class = (*(Object **)arg1)->class;
-        new_mb = CLASS_CB(new_class)->method_table[new_mb->method_table_index];
+
+        if((entry = cache->entry) != NULL)
+            for(i = 0; i < entry->size; i++)
+                if(entry->classes[i] == new_class) {
+                    new_mb = entry->mbs[i];
+                    if(invoke_cache_stats)
+                        cache->hits++;
+                    goto invokeMethod;
+                }
+
+        frame->last_pc = (Instruction*)pc;
+        new_mb = invokeCacheMiss(cache, new_class);
+
+        if(exceptionOccured0(ee))
+            goto throwException;
 
         goto invokeMethod;
+    }
 
     DEF_OPC(OPC_INVOKESPECIAL)
     {
-        int idx;
+        int idx, opcode, trivial, operand;
         WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_INVOKESPECIAL, idx);
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         new_mb = resolveMethod(mb->class, idx);
  
         if(exceptionOccured0(ee))
@@ -1357,60 +1904,121 @@ unused:
         /* Check if invoking a super method... */
 	if((CLASS_CB(mb->class)->access_flags & ACC_SUPER) &&
               ((new_mb->access_flags & ACC_PRIVATE) == 0) && (new_mb->name[0] != '<')) {
-            OPCODE_REWRITE_OPERAND2(pc, OPC_INVOKESUPER_QUICK,
-                    new_mb->method_table_index >> 8,
-                    new_mb->method_table_index & 0xff);
+            new_mb = CLASS_CB(CLASS_CB(mb->class)->super)->method_table[new_mb->method_table_index];
+            opcode = OPC_INVOKESUPER_QUICK;
 	} else
-            OPCODE_REWRITE(pc, OPC_INVOKENONVIRTUAL_QUICK);
+            opcode = OPC_INVOKENONVIRTUAL_QUICK;
+
+        /* The target is known, so calls to empty constructors and
+           accessors can be replaced by their body */
+
+        if((trivial = trivialInvoke(new_mb, TRUE, &operand)) != -1) {
+            OPCODE_REWRITE_OPERAND1(pc, trivial, operand);
+        } else
+            OPCODE_REWRITE_PTR(pc, opcode, new_mb);
         DISPATCH(pc)
     }
 
-    DEF_OPC(OPC_INVOKESUPER_QUICK)
-        new_mb = CLASS_CB(CLASS_CB(mb->class)->super)->method_table[CP_DINDEX(pc)];
+    /* A call to an empty method - just check and pop the arguments */
+
+    DEF_OPC(OPC_INVOKE_EMPTY)
+        arg1 = ostack - pc[1].operand;
+        NULL_POINTER_CHECK(*arg1);
+        ostack = arg1;
+        pc += 3;
+        DISPATCH(pc)
+
+    /* A call to a small method inlined by the JIT (see jit.c).  No frame
+       is created - the method's code is run on the caller's frame, and
+       the caller's state is kept until it returns (see methodReturn) */
+
+    DEF_OPC(OPC_INVOKE_INLINE)
+        new_mb = (MethodBlock *)pc[1].ptr;
         arg1 = ostack - (new_mb->args_count);
-	NULL_POINTER_CHECK(*arg1);
-	goto invokeMethod;
+        NULL_POINTER_CHECK(*arg1);
+
+        /* Near the end of the stack make a normal call, which will
+           throw StackOverflowError if need be */
+        if((char*)(arg1 + new_mb->max_locals + new_mb->max_stack) > ee->stack_end)
+            goto invokeMethod;
+
+        inline_pc = pc;
+        inline_mb = mb;
+        inline_lvars = lvars;
+
+        mb = new_mb;
+        lvars = arg1;
+        this = (Object*)lvars[0];
+        ostack = lvars + mb->max_locals;
+        pc = mb->threaded_code;
+        cp = &(CLASS_CB(mb->class)->constant_pool);
+        DISPATCH(pc)
 
+    DEF_OPC(OPC_INVOKESUPER_QUICK)
     DEF_OPC(OPC_INVOKENONVIRTUAL_QUICK)
-        new_mb = (MethodBlock *)CP_INFO(cp, CP_DINDEX(pc));
+    DEF_OPC(OPC_INVOKEVIRTUAL_DIRECT)
+        new_mb = (MethodBlock *)pc[1].ptr;
         arg1 = ostack - (new_mb->args_count);
 	NULL_POINTER_CHECK(*arg1);
 	goto invokeMethod;
 
     DEF_OPC(OPC_INVOKESTATIC)
-        frame->last_pc = (unsigned char*)pc;
-        new_mb = resolveMethod(mb->class, CP_DINDEX(pc));
+    {
+        int idx;
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_INVOKESTATIC, idx);
+
+        frame->last_pc = (Instruction*)pc;
+        new_mb = resolveMethod(mb->class, idx);
  
         if(exceptionOccured0(ee))
             goto throwException;
 
-        OPCODE_REWRITE(pc, OPC_INVOKESTATIC_QUICK);
+        OPCODE_REWRITE_PTR(pc, OPC_INVOKESTATIC_QUICK, new_mb);
         DISPATCH(pc)
+    }
 
         DEF_OPC(OPC_INVOKESTATIC_QUICK)
-        new_mb = (MethodBlock *)CP_INFO(cp, CP_DINDEX(pc));
+        new_mb = (MethodBlock *)pc[1].ptr;
         arg1 = ostack - new_mb->args_count;
         goto invokeMethod;
 
         DEF_OPC(OPC_INVOKEINTERFACE)
-        frame->last_pc = (unsigned char*)pc;
-        new_mb = resolveInterfaceMethod(mb->class, CP_DINDEX(pc));
+        {
+            InvokeCache *cache;
+            int idx;
+
+            WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_INVOKEINTERFACE, idx);
+
+            frame->last_pc = (Instruction*)pc;
+            new_mb = resolveInterfaceMethod(mb->class, idx);
  
-        if(exceptionOccured0(ee))
-            goto throwException;
+            if(exceptionOccured0(ee))
+                goto throwException;
 
-        arg1 = ostack - (new_mb->args_count);
-	NULL_POINTER_CHECK(*arg1);
+            /* If there's no room for another inline cache,
+               search the receiver's itable every time */
 
-        new_class = (*(Object **)arg1)->class;
-	new_mb = lookupMethod(new_class, new_mb->name, new_mb->type);
+            if((cache = newInvokeCache(new_mb, mb, pc - mb->threaded_code)) == NULL) {
+                arg1 = ostack - (new_mb->args_count);
+                IMPLICIT_NULL_CHECK(*arg1);
 
-        goto invokeMethod;
+                new_class = (*(Object **)arg1)->class;
+                new_mb = lookupInterfaceMethod(new_class, new_mb);
+
+                if(exceptionOccured0(ee))
+                    goto throwException;
+
+                goto invokeMethod;
+            }
+
+            OPCODE_REWRITE_PTR(pc, OPC_INVOKEINTERFACE_QUICK, cache);
+            DISPATCH(pc)
+        }
 
     DEF_OPC(OPC_ARRAYLENGTH)
     {
         Object *array = (Object *)ostack[-1];
-	NULL_POINTER_CHECK(array);
+	IMPLICIT_NULL_CHECK(array);
 
         ostack[-1] = *INST_DATA(array);
         pc += 1;
@@ -1420,7 +2028,7 @@ unused:
     DEF_OPC(OPC_ATHROW)
     {
         Object *ob = (Object *)ostack[-1];
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
 	NULL_POINTER_CHECK(ob);
 		
         ee->exception = ob;
@@ -1431,12 +2039,24 @@ unused:
     {
         Class *class;
         Object *ob;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_NEW, idx);
  
-        frame->last_pc = (unsigned char*)pc;
-        class = resolveClass(mb->class, CP_DINDEX(pc), TRUE);
+        frame->last_pc = (Instruction*)pc;
+        class = resolveClass(mb->class, idx, TRUE);
 
         if(exceptionOccured0(ee))
             goto throwException;
+
+        /* The class may still be being initialised by this thread -
+           only quicken once it's done, so other threads still wait */
+
+        if(CLASS_CB(class)->flags == CLASS_INITED) {
+            pc[2].operand = tlabObjectSize(class);
+            OPCODE_REWRITE_PTR(pc, OPC_NEW_QUICK, class);
+            DISPATCH(pc)
+        }
         
         if((ob = allocObject(class)) == NULL)
             goto throwException;
@@ -1445,14 +2065,42 @@ unused:
         pc += 3;
         DISPATCH(pc)
     }
+
+    /* Allocate inline from the thread's TLAB if the class has no
+       finalizer and is small enough (the size is precomputed), else
+       go the long way round */
+
+    DEF_OPC(OPC_NEW_QUICK)
+    {
+        Class *class = (Class*)pc[1].ptr;
+        int n = pc[2].operand;
+        Object *ob = NULL;
+ 
+        frame->last_pc = (Instruction*)pc;
+
+        if(n != 0) {
+            deferSuspend(self);
+            ALLOC_FROM_TLAB(self, n, ob);
+            if(ob != NULL)
+                ob->class = class;
+            undeferSuspend(self);
+        }
+
+        if(ob == NULL && (ob = allocObject(class)) == NULL)
+            goto throwException;
+
+        *ostack++ = (u4)ob;
+        pc += 3;
+        DISPATCH(pc)
+    }
  
     DEF_OPC(OPC_NEWARRAY)
     {
-        int type = pc[1];
+        int type = pc[1].operand;
         int count = *--ostack;
         Object *ob;
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         if((ob = allocTypeArray(type, count)) == NULL)
             goto throwException;
 
@@ -1464,28 +2112,34 @@ unused:
     DEF_OPC(OPC_ANEWARRAY)
     {
         Class *array_class;
-        char ac_name[256];
-        int count = ostack[-1];
         Class *class;
-        Object *ob;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_ANEWARRAY, idx);
  
-        frame->last_pc = (unsigned char*)pc;
-        class = resolveClass(mb->class, CP_DINDEX(pc), FALSE);
+        frame->last_pc = (Instruction*)pc;
+        class = resolveClass(mb->class, idx, FALSE);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if(CLASS_CB(class)->name[0] == '[')
-            strcat(strcpy(ac_name, "["), CLASS_CB(class)->name);
-        else
-            strcat(strcat(strcpy(ac_name, "[L"), CLASS_CB(class)->name), ";");
-
-        array_class = findArrayClass(ac_name);
+        array_class = arrayClassOf(class);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if((ob = allocArray(array_class, count, 4)) == NULL)
+        OPCODE_REWRITE_PTR(pc, OPC_ANEWARRAY_QUICK, array_class);
+        DISPATCH(pc)
+    }
+
+    DEF_OPC(OPC_ANEWARRAY_QUICK)
+    {
+        int count = ostack[-1];
+        Object *ob;
+ 
+        frame->last_pc = (Instruction*)pc;
+
+        if((ob = allocArray((Class*)pc[1].ptr, count, 4)) == NULL)
             goto throwException;
 
         ostack[-1] = (u4)ob;
@@ -1495,35 +2149,68 @@ unused:
 
     DEF_OPC(OPC_CHECKCAST)
     {
-        Object *obj = (Object*)ostack[-1]; 
         Class *class;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_CHECKCAST, idx);
 	       
-        frame->last_pc = (unsigned char*)pc;
-	class = resolveClass(mb->class, CP_DINDEX(pc), TRUE);
+        frame->last_pc = (Instruction*)pc;
+	class = resolveClass(mb->class, idx, TRUE);
  
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if((obj != NULL) && !isInstanceOf(class, obj->class))
-            THROW_EXCEPTION("java/lang/ClassCastException", CLASS_CB(obj->class)->name);
-    
-        pc += 3;
+        pc[2].ptr = NULL;
+        OPCODE_REWRITE_PTR(pc, OPC_CHECKCAST_QUICK, class);
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_INSTANCEOF)
     {
-        Object *obj = (Object*)ostack[-1]; 
         Class *class;
+        int idx;
+
+        WITH_OPCODE_CHANGE_CP_DINDEX(pc, OPC_INSTANCEOF, idx);
 	       
-        frame->last_pc = (unsigned char*)pc;
-	class = resolveClass(mb->class, CP_DINDEX(pc), FALSE);
+        frame->last_pc = (Instruction*)pc;
+	class = resolveClass(mb->class, idx, FALSE);
 
         if(exceptionOccured0(ee))
             goto throwException;
 
-        if(obj != NULL)
-            ostack[-1] = isInstanceOf(class, obj->class); 
+        pc[2].ptr = NULL;
+        OPCODE_REWRITE_PTR(pc, OPC_INSTANCEOF_QUICK, class);
+        DISPATCH(pc)
+    }
+
+    /* The quick forms hold the resolved class, and cache the class of
+       the last object which passed the test in the spare slot.  The
+       cache is only a hint - a racing update just costs a slow test */
+
+    DEF_OPC(OPC_CHECKCAST_QUICK)
+    {
+        Object *obj = (Object*)ostack[-1]; 
+
+        if((obj != NULL) && obj->class != pc[2].ptr) {
+            if(!isInstanceOf((Class*)pc[1].ptr, obj->class))
+                THROW_EXCEPTION("java/lang/ClassCastException", CLASS_CB(obj->class)->name);
+            pc[2].ptr = obj->class;
+        }
+    
+        pc += 3;
+        DISPATCH(pc)
+    }
+
+    DEF_OPC(OPC_INSTANCEOF_QUICK)
+    {
+        Object *obj = (Object*)ostack[-1]; 
+
+        if(obj != NULL) {
+            if(obj->class == pc[2].ptr)
+                ostack[-1] = TRUE;
+            else if((ostack[-1] = isInstanceOf((Class*)pc[1].ptr, obj->class)))
+                pc[2].ptr = obj->class;
+        }
         pc += 3;
         DISPATCH(pc)
     }
@@ -1548,7 +2235,7 @@ unused:
 
     DEF_OPC(OPC_WIDE)
     {
-       int opcode = pc[1];
+       int opcode = pc[1].operand;
         switch(opcode) {
             case OPC_ILOAD:
             case OPC_FLOAD:
@@ -1585,7 +2272,7 @@ unused:
 		break;
 
             case OPC_RET:
-                pc = (unsigned char*)lvars[CP_DINDEX((pc+1))];
+                pc = (Instruction*)lvars[CP_DINDEX((pc+1))];
 		break;
 
             case OPC_IINC:
@@ -1599,10 +2286,10 @@ unused:
     DEF_OPC(OPC_MULTIANEWARRAY)
     {
         Class *class;
-        int dim = pc[3];
+        int dim = pc[3].operand;
 	Object *ob;
 
-        frame->last_pc = (unsigned char*)pc;
+        frame->last_pc = (Instruction*)pc;
         class = resolveClass(mb->class, CP_DINDEX(pc), FALSE);
 
         if(exceptionOccured0(ee))
@@ -1622,7 +2309,7 @@ unused:
     {
         int v = *--ostack;
         if(v == 0) {
-           pc += BRANCH(pc);
+           pc = BRANCH(pc);
         } else 
            pc += 3;
         DISPATCH(pc)
@@ -1632,31 +2319,32 @@ unused:
     {
         int v = *--ostack;
         if(v != 0) {
-           pc += BRANCH(pc);
+           pc = BRANCH(pc);
         } else 
            pc += 3;
         DISPATCH(pc)
     }
 
     DEF_OPC(OPC_GOTO_W)
-        pc += BRANCH_W(pc);
+        BACKEDGE(BRANCH(pc));
+        pc = BRANCH(pc);
         DISPATCH(pc)
 
     DEF_OPC(OPC_JSR_W)
-        *ostack++ = (u4)pc+3;
-        pc += BRANCH_W(pc);
+        *ostack++ = (u4)(pc+5);
+        pc = BRANCH(pc);
         DISPATCH(pc)
 
     DEF_OPC(OPC_LOCK)
         DISPATCH(pc)
 
     DEF_OPC(OPC_INVOKEVIRTUAL_QUICK)
-        arg1 = ostack - pc[2];
+        arg1 = ostack - pc[2].operand;
 
-	NULL_POINTER_CHECK(*arg1);
+	IMPLICIT_NULL_CHECK(*arg1);
 
         new_class = (*(Object **)arg1)->class;
-        new_mb = CLASS_CB(new_class)->method_table[pc[1]];
+        new_mb = CLASS_CB(new_class)->method_table[pc[1].operand];
 
 invokeMethod:
 {
@@ -1675,8 +2363,11 @@ invokeMethod:
     new_frame->lvars = arg1;
     new_frame->ostack = (u4*)(new_frame+1);
     new_frame->prev = frame;
-    frame->last_pc = (unsigned char*)pc;
+    frame->last_pc = (Instruction*)pc;
 
+    /* The gc uses last_pc to find the caller's stack map, so it
+       must be set before the new frame becomes visible */
+    WMBARRIER();
     ee->last_frame = new_frame;
 
     if(new_mb->access_flags & ACC_SYNCHRONIZED) {
@@ -1684,7 +2375,7 @@ invokeMethod:
 	objectLock(sync_ob);
     }
 
-    if(new_mb->access_flags & ACC_NATIVE) {
+    if(new_mb->native_invoker != NULL) {
         ostack = (*(u4 *(*)(Class*, MethodBlock*, u4*))new_mb->native_invoker)(new_mb->class, new_mb, arg1);
 
 	if(sync_ob)
@@ -1694,20 +2385,38 @@ invokeMethod:
 
 	if(exceptionOccured0(ee))
             goto throwException;
-	pc += *pc == OPC_INVOKEINTERFACE ? 5 : 3;
+	pc += INVOKE_LENGTH(mb, pc);
     } else {
         frame = new_frame;
         mb = new_mb;
         lvars = new_frame->lvars;
         this = (Object*)lvars[0];
         ostack = new_frame->ostack;
-        pc = mb->code;
+
+        if(mb->threaded_code == NULL)
+            prepareMethod(mb, HANDLERS);
+        INVOKED(mb);
+        pc = mb->threaded_code;
         cp = &(CLASS_CB(mb->class)->constant_pool);
     }
     DISPATCH(pc)
 }
 
 methodReturn:
+    /* Return from an inlined method to its caller, which is still
+       running on the current frame.  The result is already in place */
+
+    if(inline_pc != NULL) {
+        mb = inline_mb;
+        ostack = lvars;
+        lvars = inline_lvars;
+        this = (Object*)lvars[0];
+        pc = inline_pc + 3;
+        cp = &(CLASS_CB(mb->class)->constant_pool);
+        inline_pc = NULL;
+        DISPATCH(pc)
+    }
+
     /* Set interpreter state to previous frame */
 
     frame = frame->prev;
@@ -1715,6 +2424,9 @@ methodReturn:
     if(frame->mb == NULL) {
         /* The previous frame is a dummy frame - this indicates
            top of this Java invocation. */
+#ifdef IMPLICIT_NULL_CHECKS
+        ee->null_check_env = prev_null_check;
+#endif
         return ostack;
     }
 
@@ -1728,7 +2440,7 @@ methodReturn:
     lvars = frame->lvars;
     this = (Object*)lvars[0];
     pc = frame->last_pc;
-    pc += *pc == OPC_INVOKEINTERFACE ? 5 : 3;
+    pc += INVOKE_LENGTH(mb, pc);
     cp = &(CLASS_CB(mb->class)->constant_pool);
 
     /* Pop frame */ 
@@ -1744,6 +2456,9 @@ throwException:
 
         if(pc == NULL) {
             ee->exception = excep;
+#ifdef IMPLICIT_NULL_CHECKS
+            ee->null_check_env = prev_null_check;
+#endif
             return;
         }
 
@@ -29,6 +29,15 @@
 static int noasyncgc = FALSE;
 static int verbosegc = FALSE;
 static int verboseclass = FALSE;
+static int gc_threads = 1;
+static int lazysweep = FALSE;
+static int compact = FALSE;
+static int concurrent = FALSE;
+static int picstats = FALSE;
+static int jit = FALSE;
+static int verbosejit = FALSE;
+static char *aot_output = NULL;
+static char *aot_library = NULL;
 
 #define KB 1024
 #define MB (KB*KB)
@@ -38,6 +47,8 @@ static int verboseclass = FALSE;
 static int java_stack = 64*KB;
 static int min_heap   = 256*KB;
 static int max_heap   = 16*MB;
+static int nursery    = 0;
+static int jit_cache  = 1*MB;
 
 char VM_initing = TRUE;
 
@@ -45,14 +56,17 @@ void initVM() {
    Class *class;
    MethodBlock *mb;
 
-   initialiseAlloc(min_heap, max_heap, verbosegc);
+   initialiseAlloc(min_heap, max_heap, nursery, verbosegc);
    initialiseClass(verboseclass);
+   initialiseInvokeCaches(picstats);
+   initialiseJIT(jit, jit_cache, verbosejit);
    initialiseDll();
+   initialiseAOT(aot_library);
    initialiseUtf8();
    initialiseMonitor();
    initialiseMainThread(java_stack);
    initialiseString();
-   initialiseGC(noasyncgc);
+   initialiseGC(noasyncgc, gc_threads, lazysweep, compact, concurrent);
    initialiseJNI();
 
    /* No need to check for exception - if one occurs, signalException aborts VM */
@@ -74,6 +88,7 @@ void initVM() {
     
 void showUsage(char *name) {
     printf("Usage: %s [-options] class [arg1 arg2 ...]\n", name);
+    printf("       %s [-options] -aot <library> class [class ...]\n", name);
     printf("\nwhere options include:\n");
     printf("\t-help\t\tprint out this message\n");
     printf("\t-version\tprint out version number and copyright information\n");
@@ -82,7 +97,18 @@ void showUsage(char *name) {
     printf("\t-noasyncgc\tturn off asynchronous garbage collection\n");
     printf("\t-ms<number>\tset the initial size of the heap (default = %dK)\n", min_heap/KB);
     printf("\t-mx<number>\tset the maximum size of the heap (default = %dM)\n", max_heap/MB);
+    printf("\t-mn<number>\tset the size of the nursery (default = 0, no nursery)\n");
     printf("\t-ss<number>\tset the Java stack size for each thread (default = %dK)\n",java_stack/KB);
+    printf("\t-gcthreads<number>\tset the number of threads used for marking and sweeping (default = %d)\n", gc_threads);
+    printf("\t-lazysweep\tsweep the heap on demand after garbage collection\n");
+    printf("\t-compact\tcompact the heap when it becomes fragmented\n");
+    printf("\t-concgc\t\tmark the heap concurrently with the program\n");
+    printf("\t-picstats\tprint inline cache statistics on exit\n");
+    printf("\t-jit\t\tcompile hot methods into native code\n");
+    printf("\t-jitcache<number>\tset the size of the JIT code cache (default = %dM)\n", jit_cache/MB);
+    printf("\t-verbosejit\tprint out information about JIT compilation\n");
+    printf("\t-aot <library>\tcompile the classes ahead-of-time into a shared library\n");
+    printf("\t-aotlib <library>\tuse methods compiled ahead-of-time from the library\n");
 }
 
 int parseMemValue(char *str) {
@@ -146,6 +172,38 @@ int parseCommandLine(int argc, char *argv[]) {
         else if(strcmp(argv[i], "-noasyncgc") == 0)
             noasyncgc = TRUE;
 
+        else if(strcmp(argv[i], "-lazysweep") == 0)
+            lazysweep = TRUE;
+
+        else if(strcmp(argv[i], "-compact") == 0)
+            compact = TRUE;
+
+        else if(strcmp(argv[i], "-concgc") == 0)
+            concurrent = TRUE;
+
+        else if(strcmp(argv[i], "-picstats") == 0)
+            picstats = TRUE;
+
+        else if(strcmp(argv[i], "-jit") == 0)
+            jit = TRUE;
+
+        else if(strcmp(argv[i], "-verbosejit") == 0)
+            verbosejit = TRUE;
+
+        else if(strcmp(argv[i], "-aot") == 0 && i+1 < argc)
+            aot_output = argv[++i];
+
+        else if(strcmp(argv[i], "-aotlib") == 0 && i+1 < argc)
+            aot_library = argv[++i];
+
+        else if(strncmp(argv[i], "-jitcache", 9) == 0) {
+            jit_cache = parseMemValue(argv[i]+9);
+	    if(jit_cache < MIN_HEAP) {
+                printf("Invalid JIT code cache size: %s (min is %dK)\n", argv[i], MIN_HEAP/KB);
+	        exit(0);
+            }
+        }
+
         else if(strncmp(argv[i], "-ms", 3) == 0) {
             min_heap = parseMemValue(argv[i]+3);
 	    if(min_heap < MIN_HEAP) {
@@ -158,12 +216,24 @@ int parseCommandLine(int argc, char *argv[]) {
                 printf("Invalid maximum heap size: %s (min is %dK)\n", argv[i], MIN_HEAP/KB);
 	        exit(0);
             }
+	} else if(strncmp(argv[i], "-mn", 3) == 0) {
+            nursery = parseMemValue(argv[i]+3);
+	    if(nursery < MIN_HEAP) {
+                printf("Invalid nursery size: %s (min is %dK)\n", argv[i], MIN_HEAP/KB);
+	        exit(0);
+            }
 	} else if(strncmp(argv[i], "-ss", 3) == 0) {
             java_stack = parseMemValue(argv[i]+3);
 	    if(java_stack < MIN_STACK) {
                 printf("Invalid Java stack size: %s\n", argv[i]);
 	        exit(0);
             }
+	} else if(strncmp(argv[i], "-gcthreads", 10) == 0) {
+            gc_threads = strtol(argv[i]+10, NULL, 0);
+	    if(gc_threads < 1) {
+                printf("Invalid number of gc threads: %s\n", argv[i]);
+	        exit(0);
+            }
 	} else {
             printf("Unrecognised command line option: %s\n", argv[i]);
 	    break;
@@ -186,6 +256,9 @@ int main(int argc, char *argv[]) {
 
     initVM();
 
+    if(aot_output != NULL)
+        exit(compileAOT(aot_output, &argv[class_arg], argc-class_arg) ? 0 : 1);
+
     for(cpntr = argv[class_arg]; *cpntr; cpntr++)
         if(*cpntr == '.')
             *cpntr = '/';
@@ -207,8 +280,10 @@ int main(int argc, char *argv[]) {
     array = allocArray(findSystemClass("java/lang/String"), argc-class_arg-1, 4);
     args = INST_DATA(array)-class_arg;
 
-    for(i = class_arg+1; i < argc; i++)
+    for(i = class_arg+1; i < argc; i++) {
         args[i] = (u4)Cstr2String(argv[i]);
+        WRITE_BARRIER(array);
+    }
 
     /* Call the main method */
     executeStaticMethod(class, mb, array);
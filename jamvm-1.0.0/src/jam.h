@@ -20,6 +20,10 @@
 
 #include <stdarg.h>
 
+#ifdef IMPLICIT_NULL_CHECKS
+#include <setjmp.h>
+#endif
+
 #ifndef	TRUE
 #define		TRUE	1
 #define 	FALSE	0
@@ -241,14 +245,97 @@
 #define OPC_INVOKEVIRTUAL_QUICK		214
 #define OPC_INVOKENONVIRTUAL_QUICK	215
 #define OPC_INVOKESUPER_QUICK		216
-#define OPC_INVOKEVIRTUAL_QUICK_W	226
-#define OPC_GETFIELD_QUICK_W		227
-#define OPC_PUTFIELD_QUICK_W		228
+#define OPC_INVOKEINTERFACE_QUICK	217
+#define OPC_INVOKEVIRTUAL_CACHED	218
+#define OPC_CHECKCAST_QUICK		219
+#define OPC_INSTANCEOF_QUICK		220
+#define OPC_ANEWARRAY_QUICK		221
+#define OPC_NEW_QUICK			222
+#define OPC_INVOKE_EMPTY		223
+#define OPC_INVOKE_INLINE		224
 #define OPC_GETFIELD_THIS		229
 #define OPC_LOCK			230
 #define OPC_ALOAD_THIS			231
 #define OPC_INVOKESTATIC_QUICK		232
 
+/* Superinstructions - internal opcodes beyond the range of the
+   bytecodes, which only appear in prepared code (see prepare.c) */
+
+#define OPC_IINC_GOTO			256
+#define OPC_ILOAD_ILOAD_IF_ICMPEQ_2	257
+#define OPC_ILOAD_ILOAD_IF_ICMPEQ_3	258
+#define OPC_ILOAD_ILOAD_IF_ICMPEQ_4	259
+#define OPC_ILOAD_ILOAD_IF_ICMPNE_2	260
+#define OPC_ILOAD_ILOAD_IF_ICMPNE_3	261
+#define OPC_ILOAD_ILOAD_IF_ICMPNE_4	262
+#define OPC_ILOAD_ILOAD_IF_ICMPLT_2	263
+#define OPC_ILOAD_ILOAD_IF_ICMPLT_3	264
+#define OPC_ILOAD_ILOAD_IF_ICMPLT_4	265
+#define OPC_ILOAD_ILOAD_IF_ICMPGE_2	266
+#define OPC_ILOAD_ILOAD_IF_ICMPGE_3	267
+#define OPC_ILOAD_ILOAD_IF_ICMPGE_4	268
+#define OPC_ILOAD_ILOAD_IF_ICMPGT_2	269
+#define OPC_ILOAD_ILOAD_IF_ICMPGT_3	270
+#define OPC_ILOAD_ILOAD_IF_ICMPGT_4	271
+#define OPC_ILOAD_ILOAD_IF_ICMPLE_2	272
+#define OPC_ILOAD_ILOAD_IF_ICMPLE_3	273
+#define OPC_ILOAD_ILOAD_IF_ICMPLE_4	274
+
+/* Top-of-stack caching variants (see prepare.c).  A _TOS variant takes
+   its top operand from the cached register, and leaves an int result
+   there.  A _TOS_FLUSH variant writes its result back to the stack */
+
+#define OPC_ILOAD_TOS			275
+#define OPC_ILOAD_0_TOS			276
+#define OPC_ILOAD_1_TOS			277
+#define OPC_ILOAD_2_TOS			278
+#define OPC_ILOAD_3_TOS			279
+#define OPC_ICONST_0_TOS		280
+#define OPC_ICONST_1_TOS		281
+#define OPC_BIPUSH_TOS			282
+#define OPC_IADD_TOS			283
+#define OPC_IADD_TOS_FLUSH		284
+#define OPC_ISUB_TOS			285
+#define OPC_ISUB_TOS_FLUSH		286
+#define OPC_IMUL_TOS			287
+#define OPC_IMUL_TOS_FLUSH		288
+#define OPC_IAND_TOS			289
+#define OPC_IAND_TOS_FLUSH		290
+#define OPC_IOR_TOS			291
+#define OPC_IOR_TOS_FLUSH		292
+#define OPC_IXOR_TOS			293
+#define OPC_IXOR_TOS_FLUSH		294
+#define OPC_ISHL_TOS			295
+#define OPC_ISHL_TOS_FLUSH		296
+#define OPC_ISHR_TOS			297
+#define OPC_ISHR_TOS_FLUSH		298
+#define OPC_IUSHR_TOS			299
+#define OPC_IUSHR_TOS_FLUSH		300
+#define OPC_IALOAD_TOS			301
+#define OPC_IALOAD_TOS_FLUSH		302
+#define OPC_ISTORE_TOS			303
+#define OPC_ISTORE_0_TOS		304
+#define OPC_ISTORE_1_TOS		305
+#define OPC_ISTORE_2_TOS		306
+#define OPC_ISTORE_3_TOS		307
+#define OPC_IFEQ_TOS			308
+#define OPC_IFNE_TOS			309
+#define OPC_IFLT_TOS			310
+#define OPC_IFGE_TOS			311
+#define OPC_IFGT_TOS			312
+#define OPC_IFLE_TOS			313
+#define OPC_IF_ICMPEQ_TOS		314
+#define OPC_IF_ICMPNE_TOS		315
+#define OPC_IF_ICMPLT_TOS		316
+#define OPC_IF_ICMPGE_TOS		317
+#define OPC_IF_ICMPGT_TOS		318
+#define OPC_IF_ICMPLE_TOS		319
+#define OPC_IASTORE_TOS			320
+
+/* Virtual invoke devirtualised by the JIT (see jit.c) */
+
+#define OPC_INVOKEVIRTUAL_DIRECT	321
+
 #define	CONSTANT_Utf8			1
 #define CONSTANT_Integer		3
 #define	CONSTANT_Float			4
@@ -328,6 +415,33 @@ typedef struct object {
    struct class *class;
 } Object;
 
+/* Reference map of a method's frame at each invoke.  The bits
+   of entry i cover the locals followed by the operand stack */
+
+typedef struct stack_map {
+    int size;
+    int words;
+    u2 *pcs;
+    u2 *heights;
+    unsigned int *bits;
+} StackMap;
+
+/* Prepared code.  A method's bytecode is translated when it is first
+   invoked into a direct-threaded form, with one word for each byte of
+   the bytecode - an instruction at a bytecode offset is at the same
+   offset in the prepared code, so the exception, line number and stack
+   map tables can be used unchanged.  The first word of an instruction
+   holds its handler (its opcode when the interpreter isn't threaded),
+   and the words after it hold its operands, decoded */
+
+typedef union instruction {
+   const void *handler;
+   int opcode;
+   int operand;
+   void *ptr;
+   union instruction *target;
+} Instruction;
+
 typedef struct methodblock {
    Class *class;
    char *name;
@@ -342,12 +456,62 @@ typedef struct methodblock {
    u2 native_extra_args;
    void *native_invoker;
    unsigned char *code;
+   int code_size;
+   Instruction *threaded_code;
+   StackMap *stack_map;
    u2 *throw_table;
    ExceptionTableEntry *exception_table;
    LineNoTableEntry *line_no_table;
    int method_table_index;
+   int invoke_count;
+   int backedge_count;
+   int compiled;
+   int optimised;
+   int overridden;
+   int trivial;
+   int trivial_index;
 } MethodBlock;
 
+/* Methods whose calls can be replaced by the equivalent instruction
+   (see trivialInvoke).  trivial_index holds the field's cp index */
+
+#define TRIVIAL_EMPTY	1
+#define TRIVIAL_GETTER	2
+#define TRIVIAL_SETTER	3
+
+/* Interface method table entry.  methods holds, for each method
+   of the interface (in declaration order), the implementing method
+   in the class, or NULL if it has none */
+
+typedef struct itable_entry {
+   Class *interface;
+   MethodBlock **methods;
+} ITableEntry;
+
+/* Inline cache for an invokevirtual or invokeinterface call site,
+   holding the classes of the receivers seen so far and the methods
+   they dispatch to.  An entry is never modified once it is installed
+   (a miss installs a new, larger one), so it can be read without
+   locking */
+
+#define PIC_SIZE 4
+
+typedef struct invoke_cache_entry {
+   int size;
+   Class *classes[PIC_SIZE];
+   MethodBlock *mbs[PIC_SIZE];
+} InvokeCacheEntry;
+
+typedef struct invoke_cache {
+   MethodBlock *mb;
+   InvokeCacheEntry * volatile entry;
+   int megamorphic;
+   unsigned int hits;
+   unsigned int misses;
+   MethodBlock *caller;
+   int pc;
+} InvokeCache;
+
 typedef struct fieldblock {
    char *name;
    char *type;
@@ -355,8 +519,13 @@ typedef struct fieldblock {
    u2 constant;
    u4 static_value;
    u4 offset;
+   struct class *class;
 } FieldBlock;
 
+/* Depth of the superclass display (see cast.c) */
+
+#define DISPLAY_SIZE 8
+
 typedef struct classblock {
    int pad[2];
    char *name;
@@ -376,16 +545,28 @@ typedef struct classblock {
    ConstantPool constant_pool;
    int method_table_size;
    MethodBlock **method_table;
+   int imethod_table_size;
+   ITableEntry *imethod_table;
    MethodBlock *finalizer;
    Class *element_class;
    int initing_tid;
    int dim;
    Object *class_loader;
+   int ref_count;
+   int *ref_offsets;
+   int static_ref_count;
+   u4 **static_refs;
+   u4 checksum;
+   int depth;
+   Class *display[DISPLAY_SIZE];
+   int interface_id;
+   u4 *interface_bits;
+   Class *array_class;
 } ClassBlock;
 
 typedef struct frame {
    MethodBlock *mb;
-   unsigned char *last_pc;
+   Instruction *last_pc;
    u4 *lvars;
    u4 *ostack;
    struct frame *prev;
@@ -405,8 +586,16 @@ typedef struct exec_env {
     char *stack_end;
     Frame *last_frame;
     Object *thread;
+#ifdef IMPLICIT_NULL_CHECKS
+    sigjmp_buf *null_check_env;
+#endif
 } ExecEnv;
 
+/* With implicit null checks, an access to an object within this many
+   bytes of NULL is assumed to fault */
+
+#define NULL_PAGE_SIZE 4096
+
 #define CLASS_CB(classRef)		((ClassBlock*)(classRef+1))
 #define INST_DATA(objectRef)		((u4*)(objectRef+1))
 
@@ -436,20 +625,54 @@ typedef struct exec_env {
 #define CP_LONG(cp,i)			*(long long *)&(cp->info[i])
 #define CP_DOUBLE(cp,i)			*(double *)&(cp->info[i])
 
+/* Card marking write barrier.  The generational collector finds
+   references from the old generation into the nursery by scanning the
+   objects which start within dirty cards.  Every store of a reference
+   into an object must be followed by WRITE_BARRIER on the object (for
+   static fields, the class object).  The card table is biased, so the
+   card of an address is found by a shift */
+
+#define LOG_CARD_SIZE			9
+#define CARD_SIZE			(1<<LOG_CARD_SIZE)
+#define CARD_CLEAN			0
+#define CARD_DIRTY			1
+
+extern unsigned char *card_table_base;
+
+#define WRITE_BARRIER(ob) \
+    card_table_base[((unsigned int)(ob))>>LOG_CARD_SIZE] = CARD_DIRTY
+
+/* Snapshot-at-the-beginning barrier.  While the heap is being marked
+   concurrently, the value about to be overwritten by a reference store
+   must be recorded.  SATB_BARRIER on the address of the slot must
+   therefore precede every store into a reference field or array
+   element of an existing object (or a reference static) */
+
+extern volatile int satb_marking;
+extern void satbEnqueue(Object *ob);
+
+#define SATB_BARRIER(addr)                      \
+{                                               \
+    if(satb_marking && *(u4*)(addr) != 0)       \
+        satbEnqueue((Object*)*(u4*)(addr));     \
+}
+
 /* --------------------- Function prototypes  --------------------------- */
 
 /* Alloc */
 
-extern void initialiseAlloc(int min, int max, int verbose);
-extern void initialiseGC(int noasyncgc);
+extern void initialiseAlloc(int min, int max, int nursery, int verbose);
+extern void initialiseGC(int noasyncgc, int gcthreads, int lazysweep, int compact, int concurrent);
 extern Class *allocClass();
 extern Object *allocHandle();
 extern Object *allocObject(Class *class);
+extern int tlabObjectSize(Class *class);
 extern Object *allocTypeArray(int type, int size);
 extern Object *allocArray(Class *class, int size, int el_size);
 extern Object *allocMultiArray(Class *array_class, int dim, int *count);
 
 extern Object *cloneObject(Object *ob);
+extern void pinObject(Object *ob);
 
 extern int gc0();
 extern int gc1();
@@ -469,6 +692,7 @@ extern Class *findSystemClass0(char *);
 extern Class *loadSystemClass(char *);
 
 extern Class *findArrayClassFromClassLoader(char *, Object *);
+extern Class *arrayClassOf(Class *class);
 
 #define findArrayClassFromClass(name, class) \
                     findArrayClassFromClassLoader(name, CLASS_CB(class)->class_loader)
@@ -481,6 +705,48 @@ extern Class *findClassFromClassLoader(char *, Object *);
 extern char *getClassPath();
 extern void initialiseClass(int verbose);
 
+/* Stack maps */
+
+extern StackMap *buildStackMap(MethodBlock *mb);
+extern unsigned int *findStackMap(StackMap *map, int pc, int *height);
+
+/* Prepare */
+
+extern void prepareMethod(MethodBlock *mb, const void **handlers);
+extern int instructionLength(unsigned char *code, int pc);
+
+/* JIT */
+
+#define JIT_INVOKE_THRESHOLD	1000
+#define JIT_BACKEDGE_THRESHOLD	10000
+#define JIT_OPTIMISE_THRESHOLD	10000
+
+/* Slots beyond its max_stack which the top frame may use while running
+   an inlined method.  The gc scans them too */
+#define JIT_INLINE_SLOTS	16
+
+extern int jit_enabled;
+extern int jit_copying;
+extern void initialiseJIT(int enabled, int cache_size, int verbose);
+extern void compileMethod(MethodBlock *mb, const void *templates[][2]);
+extern void optimiseMethod(MethodBlock *mb, const void **handlers);
+extern void methodOverridden(MethodBlock *mb);
+
+/* AOT */
+
+typedef struct aot_method {
+    char *class_name;
+    char *name;
+    char *type;
+    u4 checksum;
+    void *code;
+} AOTMethod;
+
+extern u4 classChecksum(unsigned char *data, int len);
+extern int compileAOT(char *output, char **classes, int count);
+extern int bindAOTMethod(MethodBlock *mb, u4 checksum);
+extern void initialiseAOT(char *library);
+
 /* From jam - should be resolve? */
 
 extern FieldBlock *findField(Class *, char *, char *);
@@ -490,8 +756,19 @@ extern MethodBlock *lookupMethod(Class *class, char *methodname, char *type);
 extern Class *resolveClass(Class *class, int index, int init);
 extern MethodBlock *resolveMethod(Class *class, int index);
 extern MethodBlock *resolveInterfaceMethod(Class *class, int index);
+extern MethodBlock *lookupInterfaceMethod(Class *class, MethodBlock *imb);
+extern InvokeCache *newInvokeCache(MethodBlock *mb, MethodBlock *caller, int pc);
+extern MethodBlock *invokeCacheMiss(InvokeCache *cache, Class *class);
+extern void initialiseInvokeCaches(int stats);
+
+#define INVOKE_CACHE_CHUNK 256
+extern InvokeCache *invoke_caches[];
+extern int invoke_cache_stats;
+#define INVOKE_CACHE(index) (&invoke_caches[(index)>>8][(index)&0xff])
 extern FieldBlock *resolveField(Class *class, int index);
+extern int trivialInvoke(MethodBlock *mb, int resolve, int *operand);
 extern char isInstanceOf(Class *class, Class *test);
+extern void linkSupertypes(Class *class);
 
 /* From jam - should be execute? */
 
@@ -509,10 +786,11 @@ extern void *executeMethodList(Object *ob, Class *class, MethodBlock *mb, u8 *ar
 
 extern Object *exceptionOccured();
 extern void signalException(char *excep_name, char *excep_mess);
+extern void clearException();
 extern void setException(Object *excep);
 extern void clearExceptiom();
 extern void printException();
-extern unsigned char *findCatchBlock(Class *exception);
+extern Instruction *findCatchBlock(Class *exception);
 extern void setStackTrace(Object *excep);
 extern void printStackTrace(Object *excep, Object *writer);
 
@@ -522,6 +800,8 @@ extern void printStackTrace(Object *excep, Object *writer);
 /* interp */
 
 extern u4 *executeJava();
+extern u4 *executeJavaShadow();
+extern int isInterpreterCode(void *addr);
 
 /* String */
 
@@ -0,0 +1,549 @@
+/*
+ * Copyright (C) 2003 Robert Lougher <rob@lougher.demon.co.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jam.h"
+#include "thread.h"
+#include "lock_md.h"
+
+/* Trace method compilation */
+#ifdef TRACEJIT
+#define TRACE(x) printf x
+#else
+#define TRACE(x)
+#endif
+
+/* There are two tiers, both driven by the invocation and backward
+   branch counters in the interpreter.  The first copies the machine
+   code of the interpreter's handlers, and the second devirtualises
+   and inlines call sites using class hierarchy analysis */
+
+/* Baseline compiler.  A hot method is compiled by stitching together
+   copies of the interpreter's own handlers (the templates).  Each run
+   of two or more straight-line instructions in the prepared code is
+   copied into the code cache as one block of native code, followed by
+   a jump to the end of the last instruction's handler, which dispatches
+   as normal.  The block then replaces the handler of the first
+   instruction in the run.
+
+   Only handlers which can't branch, call, throw or allocate are given
+   templates (see executeJava), so compiled code runs on the normal
+   interpreter frame - the frame layout, exception handling, stack
+   traces and stack scanning are unchanged.  A branch into the middle
+   of a block runs the original handlers.
+
+   Both ends of a template are labels whose address is taken, and so
+   are possible targets of every dispatch.  gcc must therefore have the
+   interpreter's state (pc, ostack, tos, etc.) in the same place at the
+   end of one template as at the start of the next.
+
+   Nothing else about the code gcc generates can be relied on - a
+   handler may contain pc-relative branches, calls or data references,
+   or be tail-merged with code elsewhere.  Templates are therefore
+   checked against a second copy of the interpreter, compiled with
+   different padding between the handlers (see shadow.c).  Any
+   reference from a template to something outside it is encoded
+   differently in the two copies, and such templates are not copied.
+
+   The jump is the only code generated, and is the only machine
+   dependent part */
+
+#define MAX_TEMPLATE_SIZE 256
+#define MIN_BLOCK_LENGTH  2
+
+#if defined(THREADED) && defined(__i386__)
+#define JUMP_SIZE 5
+
+static void emitJump(char *pntr, const void *target) {
+    pntr[0] = 0xe9;
+    *(int*)&pntr[1] = (char*)target - (pntr + JUMP_SIZE);
+}
+#elif defined(THREADED) && defined(__x86_64__)
+#define JUMP_SIZE 14
+
+static void emitJump(char *pntr, const void *target) {
+    pntr[0] = 0xff;
+    pntr[1] = 0x25;
+    *(int*)&pntr[2] = 0;
+    *(const void**)&pntr[6] = target;
+}
+#endif
+
+int jit_enabled = FALSE;
+
+/* Whether hot methods are compiled by the first tier.  Cleared if
+   no template can be copied or the code cache fills, so the
+   interpreter stops counting backward branches for nothing */
+int jit_copying = FALSE;
+
+static int verbose;
+static VMLock jit_lock;
+
+#ifdef JUMP_SIZE
+#define PAD_BYTE 0x90
+
+static char *code_cache, *cache_pntr, *cache_end;
+static int methods_compiled, blocks_compiled, cache_full;
+static char *template_ok;
+
+static int templateSize(const void *templates[][2], int i) {
+    int size = (char*)templates[i][1] - (char*)templates[i][0];
+    return size > 0 && size <= MAX_TEMPLATE_SIZE ? size : 0;
+}
+
+/* The shadow's template must be the same code, preceded by the padding
+   at the start of the handler */
+
+static int checkTemplate(const void *templates[][2], const void *shadow[][2], int i) {
+    int size = templateSize(templates, i);
+    int pad = (char*)shadow[i][1] - (char*)shadow[i][0] - size;
+    unsigned char *copy = (unsigned char*)shadow[i][0];
+    int j;
+
+    if(size == 0 || pad <= 0 || pad > MAX_TEMPLATE_SIZE)
+        return FALSE;
+
+    for(j = 0; j < pad; j++)
+        if(copy[j] != PAD_BYTE)
+            return FALSE;
+
+    return memcmp(copy + pad, templates[i][0], size) == 0;
+}
+
+static void checkTemplates(const void *templates[][2]) {
+    Thread *self = threadSelf();
+    Frame *last = self->ee->last_frame;
+    const void *(*shadow)[2];
+    int i, count, ok = 0;
+
+    /* Called with no frame, the shadow interpreter returns its templates.
+       The thread mustn't be suspended and scanned meanwhile */
+
+    deferSuspend(self);
+    self->ee->last_frame = NULL;
+    shadow = (const void *(*)[2])executeJavaShadow();
+    self->ee->last_frame = last;
+    undeferSuspend(self);
+
+    for(count = 0; templates[count][0] != NULL; count++);
+    template_ok = (char*)malloc(count);
+
+    for(i = 0; i < count; i++) {
+        template_ok[i] = checkTemplate(templates, shadow, i);
+        ok += template_ok[i];
+    }
+
+    if(verbose)
+        printf("<JIT: %d of %d templates can be copied>\n", ok, count);
+
+    if(ok == 0)
+        jit_copying = FALSE;
+}
+
+static int findTemplate(const void *templates[][2], const void *handler) {
+    int i;
+
+    for(i = 0; templates[i][0] != NULL; i++)
+        if(templates[i][0] == handler)
+            return template_ok[i] ? i : -1;
+
+    return -1;
+}
+
+/* Copy the run of instructions from start, of the given size, into
+   the code cache.  Returns FALSE if the cache is full */
+
+static int emitBlock(MethodBlock *mb, const void *templates[][2], int start,
+                     int length, int size) {
+    Instruction *prepared = mb->threaded_code;
+    char *block = cache_pntr;
+    int pc, i, t = 0;
+
+    if(cache_pntr + size + JUMP_SIZE > cache_end)
+        return FALSE;
+
+    for(pc = start, i = 0; i < length; i++, pc += instructionLength(mb->code, pc)) {
+        t = findTemplate(templates, prepared[pc].handler);
+        memcpy(cache_pntr, templates[t][0], templateSize(templates, t));
+        cache_pntr += templateSize(templates, t);
+    }
+
+    emitJump(cache_pntr, templates[t][1]);
+    cache_pntr += JUMP_SIZE;
+
+    /* The code must be visible before the handler is replaced, as
+       other threads may be running the method */
+
+    MBARRIER();
+    prepared[start].handler = block;
+    blocks_compiled++;
+
+    TRACE(("Compiled block %s.%s@%d (%d instructions, %d bytes)\n",
+           CLASS_CB(mb->class)->name, mb->name, start, length, size));
+    return TRUE;
+}
+
+void compileMethod(MethodBlock *mb, const void *templates[][2]) {
+    Thread *self = threadSelf();
+    int pc, start = 0, length = 0, size = 0;
+    int code_size = mb->code_size;
+
+    lockVMLock(jit_lock, self);
+
+    if(mb->compiled || code_cache == NULL || cache_full) {
+        unlockVMLock(jit_lock, self);
+        return;
+    }
+
+    mb->compiled = TRUE;
+
+    if(template_ok == NULL)
+        checkTemplates(templates);
+
+    for(pc = 0; pc <= code_size; pc += instructionLength(mb->code, pc)) {
+        int t = pc < code_size ? findTemplate(templates, mb->threaded_code[pc].handler) : -1;
+
+        if(t != -1) {
+            if(length++ == 0)
+                start = pc;
+            size += templateSize(templates, t);
+            continue;
+        }
+
+        if(length >= MIN_BLOCK_LENGTH && !emitBlock(mb, templates, start, length, size)) {
+            if(verbose)
+                printf("<JIT: code cache full, compilation disabled>\n");
+            cache_full = TRUE;
+            jit_copying = FALSE;
+            break;
+        }
+
+        length = size = 0;
+        if(pc == code_size)
+            break;
+    }
+
+    methods_compiled++;
+
+    if(verbose)
+        printf("<JIT: compiled %s.%s%s (%d methods, %d blocks, %d bytes used)>\n",
+               CLASS_CB(mb->class)->name, mb->name, mb->type, methods_compiled,
+               blocks_compiled, cache_pntr - code_cache);
+
+    unlockVMLock(jit_lock, self);
+}
+
+static void initialiseCodeCache(int cache_size) {
+    code_cache = mmap(NULL, cache_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(code_cache == MAP_FAILED) {
+        printf("Couldn't allocate JIT code cache of %d bytes - only devirtualising\n",
+               cache_size);
+        code_cache = NULL;
+        return;
+    }
+
+    cache_pntr = code_cache;
+    cache_end = code_cache + cache_size;
+    jit_copying = TRUE;
+}
+#else
+void compileMethod(MethodBlock *mb, const void *templates[][2]) {
+}
+
+static void initialiseCodeCache(int cache_size) {
+    printf("Code copying needs the threaded interpreter on x86 - only devirtualising\n");
+}
+#endif
+
+/* Optimising tier.  When a method becomes hot again its virtual call
+   sites are devirtualised using class hierarchy analysis.  If the
+   method a site resolved to hasn't been overridden by any class
+   linked so far, every receiver must dispatch to it, and the site is
+   rewritten to call it directly (needing only a null check), or if
+   it is small enough, to run its body inline.
+
+   This is an assumption about the classes loaded so far - linkClass
+   calls methodOverridden when a new class overrides a method, and any
+   sites which were devirtualised to it are deoptimised, by restoring
+   the quickened virtual invoke they were rewritten from.  As a class
+   is linked before any instance of it can exist, no receiver of the
+   new class can reach a direct call.  Frames are always interpreter
+   frames, so nothing else needs to be undone.
+
+   Checking and recording the assumption, and deoptimising are done
+   under the JIT lock, so a class can't be linked in between */
+
+#define SET_INS(ins, op)                       \
+    if(handlers)                               \
+        (ins)->handler = handlers[op];         \
+    else                                       \
+        (ins)->opcode = op
+
+#define IS_OPCODE(ins, op) \
+    (handlers ? (ins)->handler == handlers[op] : (ins)->opcode == op)
+
+typedef struct dependency {
+    MethodBlock *mb;
+    Instruction *site;
+    Instruction saved[3];
+    struct dependency *next;
+} Dependency;
+
+static Dependency *dependencies = NULL;
+static Instruction lock_ins;
+static int sites_devirtualised, sites_inlined, sites_deoptimised;
+
+/* Inlining.  An inlined method runs on its caller's frame, with its
+   locals starting at the arguments as in a normal call, and its code
+   run in place (see OPC_INVOKE_INLINE in interp.c).  As it has no frame
+   of its own, frame->mb is still the caller while it runs.  It mustn't
+   be able to call, throw, allocate or branch backwards - nothing must
+   look at the frame (an exception, a stack trace, or a stack map
+   lookup would all be charged to the caller), and the interpreter
+   mustn't reach the JIT's counters.  The only thing which can see it
+   running is the gc, if the thread is suspended.  The top frame is
+   scanned conservatively up to JIT_INLINE_SLOTS beyond the caller's
+   max_stack, so the callee's locals and operand stack must fit within
+   that */
+
+#define MAX_INLINE_SIZE 32
+
+/* Instructions which can't call, throw or allocate.  Field accesses
+   are checked separately */
+
+static int inlineOpcode(int op) {
+    switch(op) {
+        case OPC_LDC: case OPC_LDC_W: case OPC_LDC2_W:
+        case OPC_IDIV: case OPC_LDIV: case OPC_IREM: case OPC_LREM:
+        case OPC_JSR: case OPC_RET: case OPC_TABLESWITCH: case OPC_LOOKUPSWITCH:
+            return FALSE;
+
+        case OPC_GETFIELD: case OPC_PUTFIELD:
+        case OPC_IFNULL: case OPC_IFNONNULL:
+            return TRUE;
+    }
+
+    if(op >= OPC_IALOAD && op <= OPC_SALOAD)
+        return FALSE;
+
+    if(op >= OPC_IASTORE && op <= OPC_SASTORE)
+        return FALSE;
+
+    return op <= OPC_RETURN;
+}
+
+static int storesLocal0(unsigned char *code, int pc) {
+    int op = code[pc];
+
+    if(op >= OPC_ISTORE && op <= OPC_ASTORE)
+        return code[pc+1] == 0;
+
+    return op >= OPC_ISTORE_0 && op <= OPC_ASTORE_3 && (op - OPC_ISTORE_0) % 4 == 0;
+}
+
+static int pushOpcode(int op) {
+    return (op >= OPC_ACONST_NULL && op <= OPC_SIPUSH) ||
+           (op >= OPC_ILOAD && op <= OPC_ALOAD_3);
+}
+
+/* A field access is allowed only if its object is this, which can't
+   be null (the site checks the receiver) - i.e. aload_0 is directly
+   before a getfield, or before the single instruction pushing the
+   value of a putfield, with no branch in between.  Local 0 must never
+   be stored to, and the field must already have been resolved */
+
+static int inlineable(MethodBlock *caller, int site, MethodBlock *mb,
+                      const void **handlers) {
+    unsigned char *code = mb->code;
+    char target[MAX_INLINE_SIZE];
+    int pc, height, prev = -1, prev2 = -1;
+
+    if((mb->access_flags & (ACC_SYNCHRONIZED | ACC_NATIVE)) || mb->threaded_code == NULL ||
+               mb->code_size > MAX_INLINE_SIZE || mb->exception_table_size != 0)
+        return FALSE;
+
+    if(caller->stack_map == NULL || findStackMap(caller->stack_map, site, &height) == NULL ||
+               height - mb->args_count + mb->max_locals + mb->max_stack >
+                       caller->max_stack + JIT_INLINE_SLOTS)
+        return FALSE;
+
+    memset(target, FALSE, sizeof(target));
+
+    for(pc = 0; pc < mb->code_size; pc += instructionLength(code, pc)) {
+        int op = code[pc];
+
+        if(!inlineOpcode(op) || storesLocal0(code, pc))
+            return FALSE;
+
+        if((op >= OPC_IFEQ && op <= OPC_GOTO) || op == OPC_IFNULL || op == OPC_IFNONNULL) {
+            int dest = pc + (signed short)((code[pc+1]<<8)|code[pc+2]);
+
+            if(dest <= pc || dest >= mb->code_size)
+                return FALSE;
+            target[dest] = TRUE;
+        }
+    }
+
+    for(pc = 0; pc < mb->code_size; prev2 = prev, prev = pc, pc += instructionLength(code, pc)) {
+        Instruction *ins = &mb->threaded_code[pc];
+
+        switch(code[pc]) {
+            case OPC_GETFIELD:
+                if(prev == -1 || code[prev] != OPC_ALOAD_0 || target[pc] ||
+                       !(IS_OPCODE(ins, OPC_GETFIELD_QUICK) || IS_OPCODE(ins, OPC_GETFIELD2_QUICK)))
+                    return FALSE;
+                break;
+
+            case OPC_PUTFIELD:
+                if(prev2 == -1 || code[prev2] != OPC_ALOAD_0 || !pushOpcode(code[prev]) ||
+                       target[prev] || target[pc] ||
+                       !(IS_OPCODE(ins, OPC_PUTFIELD_QUICK) || IS_OPCODE(ins, OPC_PUTFIELD2_QUICK)))
+                    return FALSE;
+                break;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Rewrite a site using the same protocol as the interpreter's
+   quickening (see OPCODE_REWRITE_OPERAND2 in interp.c) */
+
+static void rewriteSite(Instruction *site, Instruction *ins) {
+    site[0] = lock_ins;
+    MBARRIER();
+    site[1] = ins[1];
+    site[2] = ins[2];
+    WMBARRIER();
+    site[0] = ins[0];
+}
+
+void optimiseMethod(MethodBlock *mb, const void **handlers) {
+    ConstantPool *cp = &(CLASS_CB(mb->class)->constant_pool);
+    Instruction *prepared = mb->threaded_code;
+    Thread *self = threadSelf();
+    int pc, count = 0;
+
+    lockVMLock(jit_lock, self);
+    SET_INS(&lock_ins, OPC_LOCK);
+
+    for(pc = 0; pc < mb->code_size; pc += instructionLength(mb->code, pc)) {
+        Instruction *site = &prepared[pc];
+        Instruction direct[3];
+        MethodBlock *target;
+        Dependency *dep;
+        int op, operand;
+
+        if(mb->code[pc] != OPC_INVOKEVIRTUAL)
+            continue;
+
+        if(IS_OPCODE(site, OPC_INVOKEVIRTUAL_QUICK))
+            target = (MethodBlock*)CP_INFO(cp, (mb->code[pc+1]<<8)|mb->code[pc+2]);
+        else if(IS_OPCODE(site, OPC_INVOKEVIRTUAL_CACHED))
+            target = ((InvokeCache*)site[1].ptr)->mb;
+        else
+            continue;
+
+        if(target->overridden || (target->access_flags & ACC_ABSTRACT))
+            continue;
+
+        dep = (Dependency*)malloc(sizeof(Dependency));
+        dep->mb = target;
+        dep->site = site;
+        memcpy(dep->saved, site, sizeof(dep->saved));
+        dep->next = dependencies;
+        dependencies = dep;
+
+        /* Calls to empty methods and accessors are replaced by their
+           body (the accessor's field must already be resolved, as the
+           JIT lock is held) */
+
+        if((op = trivialInvoke(target, FALSE, &operand)) != -1) {
+            SET_INS(&direct[0], op);
+            direct[1].operand = operand;
+        } else if(inlineable(mb, pc, target, handlers)) {
+            SET_INS(&direct[0], OPC_INVOKE_INLINE);
+            direct[1].ptr = target;
+            sites_inlined++;
+        } else {
+            SET_INS(&direct[0], OPC_INVOKEVIRTUAL_DIRECT);
+            direct[1].ptr = target;
+        }
+        direct[2] = site[2];
+
+        rewriteSite(site, direct);
+        count++;
+    }
+
+    sites_devirtualised += count;
+
+    if(verbose && count)
+        printf("<JIT: devirtualised %d call sites in %s.%s%s (%d in total, %d inlined)>\n",
+               count, CLASS_CB(mb->class)->name, mb->name, mb->type, sites_devirtualised,
+               sites_inlined);
+
+    unlockVMLock(jit_lock, self);
+}
+
+void methodOverridden(MethodBlock *mb) {
+    Thread *self = threadSelf();
+    Dependency *dep, **prev;
+
+    if(mb->overridden)
+        return;
+
+    if(!jit_enabled) {
+        mb->overridden = TRUE;
+        return;
+    }
+
+    lockVMLock(jit_lock, self);
+    mb->overridden = TRUE;
+
+    for(prev = &dependencies; (dep = *prev) != NULL;)
+        if(dep->mb == mb) {
+            TRACE(("Deoptimising call to %s.%s%s\n", CLASS_CB(mb->class)->name,
+                   mb->name, mb->type));
+
+            rewriteSite(dep->site, dep->saved);
+            sites_deoptimised++;
+            *prev = dep->next;
+            free(dep);
+        } else
+            prev = &dep->next;
+
+    unlockVMLock(jit_lock, self);
+}
+
+void initialiseJIT(int enabled, int cache_size, int verbosejit) {
+    if(!enabled)
+        return;
+
+    initVMLock(jit_lock);
+    verbose = verbosejit;
+    initialiseCodeCache(cache_size);
+    jit_enabled = TRUE;
+}
@@ -350,15 +350,8 @@ jobject Jam_NewObjectV(JNIEnv *env, jclass clazz, jmethodID methodID, va_list ar
 
 jarray Jam_NewObjectArray(JNIEnv *env, jsize length, jclass elementClass, jobject initialElement) {
     Class *class = (Class*)elementClass;
-    Class *array_class;
-    char ac_name[256];
+    Class *array_class = arrayClassOf(class);
 
-    if(CLASS_CB(class)->name[0] == '[')
-        strcat(strcpy(ac_name, "["), CLASS_CB(class)->name);
-    else
-        strcat(strcat(strcpy(ac_name, "[L"), CLASS_CB(class)->name), ";");
-
-    array_class = findArrayClass(ac_name);
     if(array_class) {
         Object *array = allocArray(array_class, length, 4);
 	if(array && initialElement) {
@@ -366,6 +359,7 @@ jarray Jam_NewObjectArray(JNIEnv *env, jsize length, jclass elementClass, jobjec
 
 	    while(length--)
                *data++ = (u4) initialElement;
+            WRITE_BARRIER(array);
         }
 	return (jarray) addJNILref(array);
     }
@@ -377,7 +371,9 @@ jarray Jam_GetObjectArrayElement(JNIEnv *env, jobjectArray array, jsize index) {
 }
 
 void Jam_SetObjectArrayElement(JNIEnv *env, jobjectArray array, jsize index, jobject value) {
+    SATB_BARRIER(&INST_DATA((Object*)array)[index+1]);
     INST_DATA((Object*)array)[index+1] = (u4)value;
+    WRITE_BARRIER(array);
 }
 
 jint Jam_RegisterNatives(JNIEnv *env, jclass clazz, const JNINativeMethod *methods, jint nMethods) {
@@ -453,7 +449,9 @@ jobject Jam_GetObjectField(JNIEnv *env, jobject obj, jfieldID fieldID) {
 void Jam_SetObjectField(JNIEnv *env, jobject obj, jfieldID fieldID, jobject value) {
     Object *ob = (Object*) obj;
     FieldBlock *fb = (FieldBlock *) fieldID;
+    SATB_BARRIER(&INST_DATA(ob)[fb->offset]);
     INST_DATA(ob)[fb->offset] = (u4)value;
+    WRITE_BARRIER(ob);
 }
 
 jobject Jam_GetStaticObjectField(JNIEnv *env, jclass clazz, jfieldID fieldID) {
@@ -463,7 +461,9 @@ jobject Jam_GetStaticObjectField(JNIEnv *env, jclass clazz, jfieldID fieldID) {
 
 void Jam_SetStaticObjectField(JNIEnv *env, jclass clazz, jfieldID fieldID, jobject value) {
     FieldBlock *fb = (FieldBlock *) fieldID;
+    SATB_BARRIER(&fb->static_value);
     fb->static_value = (u4)value;
+    WRITE_BARRIER(fb->class);
 }
 
 #define VIRTUAL_METHOD(type, native_type)                                                        \
@@ -98,6 +98,20 @@ u4 *arraycopy(Class *class, MethodBlock *mb, u4 *ostack) {
             return ostack;
 	}
 
+        /* The destination's card is dirtied both before and after
+           copying - a collection during the copy must see the
+           references already copied, and those copied after it */
+        WRITE_BARRIER(dest);
+
+        /* The references about to be overwritten must be
+           recorded if the heap is being marked concurrently */
+        if(satb_marking && (dcb->name[1] == 'L' || dcb->name[1] == '[')) {
+            int i;
+
+            for(i = 0; i < length; i++)
+                SATB_BARRIER(&ddata[start2+i+1]);
+        }
+
         if(isInstanceOf(dest->class, src->class)) {
             int size;
 
@@ -156,15 +170,25 @@ u4 *arraycopy(Class *class, MethodBlock *mb, u4 *ostack) {
                     *dob++ = *sob++;
 	        }
 	}
+
+        WRITE_BARRIER(dest);
     }
     return ostack;
 
 storeExcep:
+    WRITE_BARRIER(dest);
     signalException("java/lang/ArrayStoreException", NULL);
     return ostack;
 }
 
 u4 *identityHashCode(Class *class, MethodBlock *mb, u4 *ostack) {
+    Object *ob = (Object*)*ostack;
+
+    /* The hash code is the object's address, so
+       once taken the object must never be moved */
+    if(ob != NULL)
+        pinObject(ob);
+
     return ++ostack;
 }
 
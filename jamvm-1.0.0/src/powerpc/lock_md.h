@@ -35,3 +35,14 @@
     : "cc", "memory");                           \
     result;                                      \
 })
+
+/* Full memory barrier, and barrier ordering stores */
+
+#define MBARRIER() __asm__ __volatile__ ("sync" ::: "memory")
+#define WMBARRIER() __asm__ __volatile__ ("eieio" ::: "memory")
+
+/* The address of the faulting instruction, given the context passed
+   to an SA_SIGINFO signal handler */
+
+#define FAULT_PC(context) \
+    ((void*)((ucontext_t*)(context))->uc_mcontext.regs->nip)
@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2003 Robert Lougher <rob@lougher.demon.co.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jam.h"
+#include "lock_md.h"
+
+/* Trace method preparation */
+#ifdef TRACEPREPARE
+#define TRACE(x) printf x
+#else
+#define TRACE(x)
+#endif
+
+/* Translate a method's bytecode into prepared code (see jam.h).  The
+   operands are decoded into native-endian words at the offset of the
+   first byte of the operand in the bytecode, and branch offsets are
+   resolved into pointers to the target instruction.  The switch
+   instructions are laid out as :
+
+       tableswitch    [1] default  [2] low  [3] high  [4...] targets
+       lookupswitch   [1] default  [2] npairs  [3...] match, target pairs
+
+   Further passes then fuse common sequences of instructions into
+   superinstructions, and select the top-of-stack caching variants of
+   the integer instructions (see fuseInstructions and cacheTopOfStack
+   below).
+
+   The bytecode is assumed to have been verified.  The prepared code is
+   built without locking - if two threads prepare the same method at
+   once, one of them throws its copy away */
+
+#define U2(p)	(((p)[0]<<8)|(p)[1])
+#define S2(p)	((((signed char)(p)[0])<<8)|(p)[1])
+#define S4(p)	((((signed char)(p)[0])<<24)|((p)[1]<<16)|((p)[2]<<8)|(p)[3])
+
+#define SET_HANDLER(ins, op)                   \
+    if(handlers)                               \
+        (ins)->handler = handlers[op];         \
+    else                                       \
+        (ins)->opcode = op
+
+/* Per-instruction flags used while preparing */
+#define INS_LEADER	1	/* branch target or exception handler */
+#define INS_FUSED	2	/* part of a superinstruction */
+
+/* Returns the length in bytes of the instruction at pc */
+
+int instructionLength(unsigned char *code, int pc) {
+    switch(code[pc]) {
+        case OPC_BIPUSH: case OPC_LDC: case OPC_ILOAD: case OPC_LLOAD:
+        case OPC_FLOAD: case OPC_DLOAD: case OPC_ALOAD: case OPC_ISTORE:
+        case OPC_LSTORE: case OPC_FSTORE: case OPC_DSTORE: case OPC_ASTORE:
+        case OPC_RET: case OPC_NEWARRAY:
+            return 2;
+
+        case OPC_SIPUSH: case OPC_IINC: case OPC_LDC_W: case OPC_LDC2_W:
+        case OPC_GETSTATIC: case OPC_PUTSTATIC: case OPC_GETFIELD:
+        case OPC_PUTFIELD: case OPC_INVOKEVIRTUAL: case OPC_INVOKESPECIAL:
+        case OPC_INVOKESTATIC: case OPC_NEW: case OPC_ANEWARRAY:
+        case OPC_CHECKCAST: case OPC_INSTANCEOF: case OPC_IFEQ: case OPC_IFNE:
+        case OPC_IFLT: case OPC_IFGE: case OPC_IFGT: case OPC_IFLE:
+        case OPC_IF_ICMPEQ: case OPC_IF_ICMPNE: case OPC_IF_ICMPLT:
+        case OPC_IF_ICMPGE: case OPC_IF_ICMPGT: case OPC_IF_ICMPLE:
+        case OPC_IF_ACMPEQ: case OPC_IF_ACMPNE: case OPC_GOTO: case OPC_JSR:
+        case OPC_IFNULL: case OPC_IFNONNULL:
+            return 3;
+
+        case OPC_MULTIANEWARRAY:
+            return 4;
+
+        case OPC_INVOKEINTERFACE: case OPC_GOTO_W: case OPC_JSR_W:
+            return 5;
+
+        case OPC_WIDE:
+            return code[pc+1] == OPC_IINC ? 6 : 4;
+
+        case OPC_TABLESWITCH: {
+            int base = (pc+4)&~3;
+            int low = S4(&code[base+4]);
+            int high = S4(&code[base+8]);
+
+            return base + 12 + (high-low+1)*4 - pc;
+        }
+
+        case OPC_LOOKUPSWITCH: {
+            int base = (pc+4)&~3;
+            int npairs = S4(&code[base+4]);
+
+            return base + 8 + npairs*8 - pc;
+        }
+    }
+    return 1;
+}
+
+/* Returns the local variable loaded by an iload at pc, or -1 if the
+   instruction isn't an iload */
+
+static int iloadIndex(unsigned char *code, int pc) {
+    switch(code[pc]) {
+        case OPC_ILOAD:
+            return code[pc+1];
+
+        case OPC_ILOAD_0: case OPC_ILOAD_1:
+        case OPC_ILOAD_2: case OPC_ILOAD_3:
+            return code[pc] - OPC_ILOAD_0;
+    }
+    return -1;
+}
+
+/* The superinstructions are chosen from a static profile of the
+   instruction pairs and triples which dominate loops :
+
+       iinc; goto                     - the increment at the end of a loop
+       iload; iload; if_icmp<cond>    - the loop test
+
+   A superinstruction replaces the handler of the first instruction in
+   the sequence only.  The rest of the sequence is left untouched, so
+   the fused handler reads its operands from the original instructions,
+   and a branch into the middle of the sequence executes the remaining
+   instructions individually.  None of the instructions fused can be
+   quickened, or throw an exception.
+
+   The iload/iload/if_icmp forms pack both local variable indexes into
+   the unused second operand word of the branch.  As the branch may be
+   2, 3 or 4 words into the sequence (depending on whether the loads
+   are the short forms) there are three opcodes for each condition */
+
+static void fuseInstructions(unsigned char *code, Instruction *prepared, int *starts,
+                             int count, char *flags, const void **handlers) {
+    int i, fused = 0;
+
+    for(i = 0; i < count - 1; i++) {
+        int pc = starts[i];
+        int next = starts[i+1];
+        int idx1, idx2;
+
+        if(code[pc] == OPC_IINC && code[next] == OPC_GOTO) {
+            SET_HANDLER(&prepared[pc], OPC_IINC_GOTO);
+            flags[pc] |= INS_FUSED;
+            flags[next] |= INS_FUSED;
+            fused++;
+            i++;
+
+        } else if(i < count - 2 && (idx1 = iloadIndex(code, pc)) != -1
+                                && (idx2 = iloadIndex(code, next)) != -1
+                                && code[starts[i+2]] >= OPC_IF_ICMPEQ
+                                && code[starts[i+2]] <= OPC_IF_ICMPLE) {
+            int branch = starts[i+2];
+            int op = OPC_ILOAD_ILOAD_IF_ICMPEQ_2 +
+                         (code[branch] - OPC_IF_ICMPEQ) * 3 + branch - pc - 2;
+
+            prepared[branch+2].operand = (idx1<<16) | idx2;
+            SET_HANDLER(&prepared[pc], op);
+            flags[pc] |= INS_FUSED;
+            flags[next] |= INS_FUSED;
+            flags[branch] |= INS_FUSED;
+            fused++;
+            i += 2;
+        }
+    }
+
+    TRACE(("Fused %d superinstructions\n", fused));
+}
+
+/* Top-of-stack caching.  Within a run of integer instructions the
+   top of the operand stack is kept in a register (tos in executeJava)
+   rather than being written to the stack and read back.  There are
+   two cache states - empty, and holding the top slot - and each
+   instruction which can run with the cache full has variants for the
+   states it enters and leaves :
+
+       TOS_PUSH     empty -> full   (iload, iconst_0/1, bipush)
+       TOS_BINARY   full  -> full, or full -> empty if _FLUSH
+                                    (int arithmetic, iaload)
+       TOS_POP      full  -> empty  (istore, if<cond>, if_icmp<cond>,
+                                     iastore)
+
+   All other instructions (including the superinstructions) expect the
+   cache to be empty.  The cache is always empty at a branch target or
+   exception handler, so states only need to be tracked along the
+   fall-through path.  Only ints are cached, so the garbage collector
+   never misses a reference held in the register */
+
+#define TOS_PUSH	1
+#define TOS_BINARY	2
+#define TOS_POP		3
+
+typedef struct tos_variant {
+    int opcode;
+    int kind;
+    int cached;
+    int flush;
+} TOSVariant;
+
+static TOSVariant tos_variants[] = {
+    {OPC_ILOAD,     TOS_PUSH,   OPC_ILOAD_TOS,     0},
+    {OPC_ILOAD_0,   TOS_PUSH,   OPC_ILOAD_0_TOS,   0},
+    {OPC_ILOAD_1,   TOS_PUSH,   OPC_ILOAD_1_TOS,   0},
+    {OPC_ILOAD_2,   TOS_PUSH,   OPC_ILOAD_2_TOS,   0},
+    {OPC_ILOAD_3,   TOS_PUSH,   OPC_ILOAD_3_TOS,   0},
+    {OPC_ICONST_0,  TOS_PUSH,   OPC_ICONST_0_TOS,  0},
+    {OPC_ICONST_1,  TOS_PUSH,   OPC_ICONST_1_TOS,  0},
+    {OPC_BIPUSH,    TOS_PUSH,   OPC_BIPUSH_TOS,    0},
+    {OPC_IADD,      TOS_BINARY, OPC_IADD_TOS,      OPC_IADD_TOS_FLUSH},
+    {OPC_ISUB,      TOS_BINARY, OPC_ISUB_TOS,      OPC_ISUB_TOS_FLUSH},
+    {OPC_IMUL,      TOS_BINARY, OPC_IMUL_TOS,      OPC_IMUL_TOS_FLUSH},
+    {OPC_IAND,      TOS_BINARY, OPC_IAND_TOS,      OPC_IAND_TOS_FLUSH},
+    {OPC_IOR,       TOS_BINARY, OPC_IOR_TOS,       OPC_IOR_TOS_FLUSH},
+    {OPC_IXOR,      TOS_BINARY, OPC_IXOR_TOS,      OPC_IXOR_TOS_FLUSH},
+    {OPC_ISHL,      TOS_BINARY, OPC_ISHL_TOS,      OPC_ISHL_TOS_FLUSH},
+    {OPC_ISHR,      TOS_BINARY, OPC_ISHR_TOS,      OPC_ISHR_TOS_FLUSH},
+    {OPC_IUSHR,     TOS_BINARY, OPC_IUSHR_TOS,     OPC_IUSHR_TOS_FLUSH},
+    {OPC_IALOAD,    TOS_BINARY, OPC_IALOAD_TOS,    OPC_IALOAD_TOS_FLUSH},
+    {OPC_ISTORE,    TOS_POP,    OPC_ISTORE_TOS,    0},
+    {OPC_ISTORE_0,  TOS_POP,    OPC_ISTORE_0_TOS,  0},
+    {OPC_ISTORE_1,  TOS_POP,    OPC_ISTORE_1_TOS,  0},
+    {OPC_ISTORE_2,  TOS_POP,    OPC_ISTORE_2_TOS,  0},
+    {OPC_ISTORE_3,  TOS_POP,    OPC_ISTORE_3_TOS,  0},
+    {OPC_IFEQ,      TOS_POP,    OPC_IFEQ_TOS,      0},
+    {OPC_IFNE,      TOS_POP,    OPC_IFNE_TOS,      0},
+    {OPC_IFLT,      TOS_POP,    OPC_IFLT_TOS,      0},
+    {OPC_IFGE,      TOS_POP,    OPC_IFGE_TOS,      0},
+    {OPC_IFGT,      TOS_POP,    OPC_IFGT_TOS,      0},
+    {OPC_IFLE,      TOS_POP,    OPC_IFLE_TOS,      0},
+    {OPC_IF_ICMPEQ, TOS_POP,    OPC_IF_ICMPEQ_TOS, 0},
+    {OPC_IF_ICMPNE, TOS_POP,    OPC_IF_ICMPNE_TOS, 0},
+    {OPC_IF_ICMPLT, TOS_POP,    OPC_IF_ICMPLT_TOS, 0},
+    {OPC_IF_ICMPGE, TOS_POP,    OPC_IF_ICMPGE_TOS, 0},
+    {OPC_IF_ICMPGT, TOS_POP,    OPC_IF_ICMPGT_TOS, 0},
+    {OPC_IF_ICMPLE, TOS_POP,    OPC_IF_ICMPLE_TOS, 0},
+    {OPC_IASTORE,   TOS_POP,    OPC_IASTORE_TOS,   0},
+    {0}
+};
+
+static TOSVariant *findTOSVariant(unsigned char *code, char *flags, int pc) {
+    TOSVariant *v;
+
+    if(flags[pc] & INS_FUSED)
+        return NULL;
+
+    for(v = tos_variants; v->cached; v++)
+        if(v->opcode == code[pc])
+            return v;
+
+    return NULL;
+}
+
+static void cacheTopOfStack(unsigned char *code, Instruction *prepared, int *starts,
+                            int count, char *flags, const void **handlers) {
+    int i, cached = 0, full = FALSE;
+
+    for(i = 0; i < count; i++) {
+        int pc = starts[i];
+        TOSVariant *v = findTOSVariant(code, flags, pc);
+        TOSVariant *next = NULL;
+
+        /* Instructions with no variant, and any but a push when the
+           cache is empty, run the normal handler */
+
+        if(v == NULL || (!full && v->kind != TOS_PUSH))
+            continue;
+
+        if(i < count - 1 && !(flags[starts[i+1]] & INS_LEADER))
+            next = findTOSVariant(code, flags, starts[i+1]);
+
+        if(next && next->kind == TOS_PUSH)
+            next = NULL;
+
+        switch(v->kind) {
+            case TOS_PUSH:
+                if(next) {
+                    SET_HANDLER(&prepared[pc], v->cached);
+                    full = TRUE;
+                }
+                break;
+
+            case TOS_BINARY:
+                if(next) {
+                    SET_HANDLER(&prepared[pc], v->cached);
+                } else {
+                    SET_HANDLER(&prepared[pc], v->flush);
+                    full = FALSE;
+                }
+                break;
+
+            case TOS_POP:
+                SET_HANDLER(&prepared[pc], v->cached);
+                full = FALSE;
+                break;
+        }
+        cached++;
+    }
+
+    TRACE(("Cached top-of-stack in %d instructions\n", cached));
+}
+
+void prepareMethod(MethodBlock *mb, const void **handlers) {
+    unsigned char *code = mb->code;
+    int size = mb->code_size;
+    Instruction *prepared = (Instruction*)calloc(size, sizeof(Instruction));
+    int *starts = (int*)malloc(size * sizeof(int));
+    char *flags = (char*)calloc(size, sizeof(char));
+    int pc, len, i, count = 0;
+
+    TRACE(("Preparing %s.%s%s\n", CLASS_CB(mb->class)->name, mb->name, mb->type));
+
+    for(pc = 0; pc < size; pc += len) {
+        Instruction *ins = &prepared[pc];
+        int op = code[pc];
+
+        len = instructionLength(code, pc);
+        starts[count++] = pc;
+        SET_HANDLER(ins, op);
+
+        switch(op) {
+            case OPC_BIPUSH:
+                ins[1].operand = (signed char)code[pc+1];
+                break;
+
+            case OPC_LDC: case OPC_ILOAD: case OPC_LLOAD: case OPC_FLOAD:
+            case OPC_DLOAD: case OPC_ALOAD: case OPC_ISTORE: case OPC_LSTORE:
+            case OPC_FSTORE: case OPC_DSTORE: case OPC_ASTORE: case OPC_RET:
+            case OPC_NEWARRAY:
+                ins[1].operand = code[pc+1];
+                break;
+
+            case OPC_SIPUSH:
+                ins[1].operand = S2(&code[pc+1]);
+                break;
+
+            case OPC_IINC:
+                ins[1].operand = code[pc+1];
+                ins[2].operand = (signed char)code[pc+2];
+                break;
+
+            case OPC_LDC_W: case OPC_LDC2_W: case OPC_GETSTATIC:
+            case OPC_PUTSTATIC: case OPC_GETFIELD: case OPC_PUTFIELD:
+            case OPC_INVOKEVIRTUAL: case OPC_INVOKESPECIAL: case OPC_INVOKESTATIC:
+            case OPC_NEW: case OPC_ANEWARRAY: case OPC_CHECKCAST:
+            case OPC_INSTANCEOF:
+                ins[1].operand = U2(&code[pc+1]);
+                break;
+
+            case OPC_INVOKEINTERFACE:
+                ins[1].operand = U2(&code[pc+1]);
+                break;
+
+            case OPC_MULTIANEWARRAY:
+                ins[1].operand = U2(&code[pc+1]);
+                ins[3].operand = code[pc+3];
+                break;
+
+            case OPC_IFEQ: case OPC_IFNE: case OPC_IFLT: case OPC_IFGE:
+            case OPC_IFGT: case OPC_IFLE: case OPC_IF_ICMPEQ: case OPC_IF_ICMPNE:
+            case OPC_IF_ICMPLT: case OPC_IF_ICMPGE: case OPC_IF_ICMPGT:
+            case OPC_IF_ICMPLE: case OPC_IF_ACMPEQ: case OPC_IF_ACMPNE:
+            case OPC_GOTO: case OPC_JSR: case OPC_IFNULL: case OPC_IFNONNULL:
+                ins[1].target = &prepared[pc + S2(&code[pc+1])];
+                flags[pc + S2(&code[pc+1])] |= INS_LEADER;
+                break;
+
+            case OPC_GOTO_W: case OPC_JSR_W:
+                ins[1].target = &prepared[pc + S4(&code[pc+1])];
+                flags[pc + S4(&code[pc+1])] |= INS_LEADER;
+                break;
+
+            case OPC_WIDE:
+                ins[1].operand = code[pc+1];
+                ins[2].operand = U2(&code[pc+2]);
+
+                if(code[pc+1] == OPC_IINC)
+                    ins[4].operand = S2(&code[pc+4]);
+                break;
+
+            case OPC_TABLESWITCH: {
+                int base = (pc+4)&~3;
+                int low = S4(&code[base+4]);
+                int high = S4(&code[base+8]);
+
+                ins[1].target = &prepared[pc + S4(&code[base])];
+                flags[pc + S4(&code[base])] |= INS_LEADER;
+                ins[2].operand = low;
+                ins[3].operand = high;
+
+                for(i = 0; i <= high - low; i++) {
+                    ins[i+4].target = &prepared[pc + S4(&code[base+12+i*4])];
+                    flags[pc + S4(&code[base+12+i*4])] |= INS_LEADER;
+                }
+
+                break;
+            }
+
+            case OPC_LOOKUPSWITCH: {
+                int base = (pc+4)&~3;
+                int npairs = S4(&code[base+4]);
+
+                ins[1].target = &prepared[pc + S4(&code[base])];
+                flags[pc + S4(&code[base])] |= INS_LEADER;
+                ins[2].operand = npairs;
+
+                for(i = 0; i < npairs; i++) {
+                    ins[i*2+3].operand = S4(&code[base+8+i*8]);
+                    ins[i*2+4].target = &prepared[pc + S4(&code[base+12+i*8])];
+                    flags[pc + S4(&code[base+12+i*8])] |= INS_LEADER;
+                }
+
+                /* The keys are sorted, so the interpreter does a binary
+                   search.  If they're dense, turn it into a tableswitch
+                   instead - the instruction has a slot for each of its
+                   8 bytes per pair, so there's always room for the table */
+
+                if(npairs > 0) {
+                    int low = S4(&code[base+8]);
+                    int high = S4(&code[base+8+(npairs-1)*8]);
+
+                    if((long long)high - low < 2 * npairs) {
+                        SET_HANDLER(ins, OPC_TABLESWITCH);
+                        ins[2].operand = low;
+                        ins[3].operand = high;
+
+                        for(i = 0; i <= high - low; i++)
+                            ins[i+4].target = ins[1].target;
+
+                        for(i = 0; i < npairs; i++)
+                            ins[S4(&code[base+8+i*8]) - low + 4].target =
+                                            &prepared[pc + S4(&code[base+12+i*8])];
+                    }
+                }
+
+                break;
+            }
+
+        }
+    }
+
+    for(i = 0; i < mb->exception_table_size; i++)
+        flags[mb->exception_table[i].handler_pc] |= INS_LEADER;
+
+    fuseInstructions(code, prepared, starts, count, flags, handlers);
+    cacheTopOfStack(code, prepared, starts, count, flags, handlers);
+    free(starts);
+    free(flags);
+
+    if(!COMPARE_AND_SWAP(&mb->threaded_code, NULL, prepared))
+        free(prepared);
+}
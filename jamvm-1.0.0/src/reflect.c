@@ -132,7 +132,7 @@ Object *invoke(Object *ob, Class *class, MethodBlock *mb, Object *arg_array) {
     if(mb->access_flags & ACC_SYNCHRONIZED)
         objectLock(ob ? ob : (Object*)mb->class);
 
-    if(mb->access_flags & ACC_NATIVE)
+    if(mb->native_invoker != NULL)
         (*(u4 *(*)(Class*, MethodBlock*, u4*))mb->native_invoker)(class, mb, ret);
     else
         executeJava();
@@ -19,7 +19,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "jam.h"
+#include "thread.h"
+#include "lock_md.h"
 
 MethodBlock *findMethod(Class *class, char *methodname, char *type) {
    ClassBlock *cb = CLASS_CB(class);
@@ -54,7 +58,7 @@ FieldBlock *findField(Class *class, char *fieldname, char *type) {
 MethodBlock *lookupMethod(Class *class, char *methodname, char *type) {
     MethodBlock *mb;
 
-    if(mb = findMethod(class, methodname, type))
+    if((mb = findMethod(class, methodname, type)))
        return mb;
 
     if (CLASS_CB(class)->super)
@@ -66,7 +70,7 @@ MethodBlock *lookupMethod(Class *class, char *methodname, char *type) {
 FieldBlock *lookupField(Class *class, char *fieldname, char *type) {
     FieldBlock *fb;
 
-    if(fb = findField(class, fieldname, type))
+    if((fb = findField(class, fieldname, type)))
        return fb;
 
     if (CLASS_CB(class)->super)
@@ -208,6 +212,170 @@ retry:
     return mb;
 }
 
+/* Find the method implementing the interface method imb in class,
+   using the class's interface method table.  Methods inherited by
+   the interface from Object are dispatched through the method table */
+
+MethodBlock *lookupInterfaceMethod(Class *class, MethodBlock *imb) {
+    ClassBlock *cb = CLASS_CB(class);
+    ClassBlock *icb = CLASS_CB(imb->class);
+    MethodBlock *mb = NULL;
+    int i;
+
+    if(!(icb->access_flags & ACC_INTERFACE))
+        mb = cb->method_table[imb->method_table_index];
+    else
+        for(i = 0; i < cb->imethod_table_size; i++)
+            if(cb->imethod_table[i].interface == imb->class) {
+                mb = cb->imethod_table[i].methods[imb - icb->methods];
+                break;
+            }
+
+    /* Array classes have no table of their own, and the class may
+       not implement the interface at all - fall back to a search */
+
+    if(mb == NULL)
+        mb = lookupMethod(class, imb->name, imb->type);
+
+    if(mb == NULL)
+        signalException("java/lang/AbstractMethodError", imb->name);
+
+    return mb;
+}
+
+/* Inline caches are allocated in chunks from a table, so that they
+   can be found again for the statistics.  Chunks are never moved or
+   freed, so a call site can hold a pointer to its cache */
+
+#define MAX_INVOKE_CACHES (INVOKE_CACHE_CHUNK*INVOKE_CACHE_CHUNK)
+
+InvokeCache *invoke_caches[INVOKE_CACHE_CHUNK];
+static int invoke_caches_count = 0;
+
+/* The hit and miss counts are only kept with -picstats, as otherwise
+   every cached call would write to memory shared between threads */
+int invoke_cache_stats = FALSE;
+static VMLock invoke_cache_lock;
+
+InvokeCache *newInvokeCache(MethodBlock *mb, MethodBlock *caller, int pc) {
+    Thread *self = threadSelf();
+    InvokeCache *cache = NULL;
+    int idx;
+
+    lockVMLock(invoke_cache_lock, self);
+
+    if((idx = invoke_caches_count) < MAX_INVOKE_CACHES) {
+        if((idx & (INVOKE_CACHE_CHUNK-1)) == 0)
+            invoke_caches[idx/INVOKE_CACHE_CHUNK] =
+                    (InvokeCache*)malloc(INVOKE_CACHE_CHUNK * sizeof(InvokeCache));
+
+        cache = INVOKE_CACHE(idx);
+        cache->mb = mb;
+        cache->entry = NULL;
+        cache->megamorphic = FALSE;
+        cache->hits = cache->misses = 0;
+        cache->caller = caller;
+        cache->pc = pc;
+
+        invoke_caches_count++;
+    }
+
+    unlockVMLock(invoke_cache_lock, self);
+
+    return cache;
+}
+
+/* Find the method the receiver's class dispatches to, and add it to
+   the cache.  Once PIC_SIZE classes have been seen the site is
+   megamorphic, and the cache is no longer updated.  The entry is
+   replaced rather than updated, and the old entry is never freed, as
+   other threads may still be searching it without locking */
+
+MethodBlock *invokeCacheMiss(InvokeCache *cache, Class *class) {
+    MethodBlock *mb = cache->mb;
+    InvokeCacheEntry *entry, *new_entry;
+
+    if(invoke_cache_stats)
+        cache->misses++;
+
+    if(CLASS_CB(mb->class)->access_flags & ACC_INTERFACE)
+        mb = lookupInterfaceMethod(class, mb);
+    else
+        mb = CLASS_CB(class)->method_table[mb->method_table_index];
+
+    if(mb == NULL || cache->megamorphic)
+        return mb;
+
+    entry = cache->entry;
+    if(entry && entry->size == PIC_SIZE) {
+        cache->megamorphic = TRUE;
+        return mb;
+    }
+
+    new_entry = (InvokeCacheEntry*)malloc(sizeof(InvokeCacheEntry));
+    new_entry->size = 0;
+
+    if(entry)
+        memcpy(new_entry, entry, sizeof(InvokeCacheEntry));
+
+    new_entry->classes[new_entry->size] = class;
+    new_entry->mbs[new_entry->size++] = mb;
+
+    /* Another thread may have installed a new entry in the meantime -
+       if so, leave it as it is rather than lose its classes */
+
+    if(!COMPARE_AND_SWAP(&cache->entry, entry, new_entry))
+        free(new_entry);
+
+    return mb;
+}
+
+static void dumpInvokeCacheStats() {
+    unsigned long long hits = 0, misses = 0;
+    int mono = 0, poly = 0, mega = 0;
+    int i;
+
+    printf("<PIC: Polymorphic and megamorphic call sites:>\n");
+
+    for(i = 0; i < invoke_caches_count; i++) {
+        InvokeCache *cache = INVOKE_CACHE(i);
+        InvokeCacheEntry *entry = cache->entry;
+        int size = entry ? entry->size : 0;
+
+        hits += cache->hits;
+        misses += cache->misses;
+
+        if(cache->megamorphic)
+            mega++;
+        else if(size > 1)
+            poly++;
+        else {
+            mono++;
+            continue;
+        }
+
+        printf("<PIC: %s.%s%s pc %d -> %s.%s%s: %s, %d classes, %u hits, %u misses>\n",
+               CLASS_CB(cache->caller->class)->name, cache->caller->name,
+               cache->caller->type, cache->pc, CLASS_CB(cache->mb->class)->name,
+               cache->mb->name, cache->mb->type,
+               cache->megamorphic ? "megamorphic" : "polymorphic", size,
+               cache->hits, cache->misses);
+    }
+
+    printf("<PIC: %d call sites (%d monomorphic, %d polymorphic, %d megamorphic)>\n",
+           invoke_caches_count, mono, poly, mega);
+    printf("<PIC: %llu hits, %llu misses>\n", hits, misses);
+}
+
+void initialiseInvokeCaches(int stats) {
+    initVMLock(invoke_cache_lock);
+
+    if(stats) {
+        invoke_cache_stats = TRUE;
+        atexit(dumpInvokeCacheStats);
+    }
+}
+
 FieldBlock *resolveField(Class *class, int cp_index) {
     ConstantPool *cp = &(CLASS_CB(class)->constant_pool);
     FieldBlock *fb;
@@ -253,6 +421,51 @@ retry:
     return fb;
 }
 
+/* The instruction a call to a trivial method can be replaced with
+   (see findTrivial in class.c), and its operand, or -1.  The only
+   exception the replacement can throw is a NullPointerException on
+   the receiver, which the call would also throw before entering the
+   method, so stack traces are unchanged.  If the accessor's field
+   can't be resolved the call is left alone, so any error is thrown
+   from within the method.  If resolve is FALSE the field must already
+   be resolved */
+
+int trivialInvoke(MethodBlock *mb, int resolve, int *operand) {
+    ConstantPool *cp = &(CLASS_CB(mb->class)->constant_pool);
+    FieldBlock *fb;
+    int wide;
+
+    switch(mb->trivial) {
+        case TRIVIAL_EMPTY:
+            *operand = mb->args_count;
+            return OPC_INVOKE_EMPTY;
+
+        case TRIVIAL_GETTER:
+        case TRIVIAL_SETTER:
+            if(CP_TYPE(cp, mb->trivial_index) == CONSTANT_Resolved)
+                fb = (FieldBlock*)CP_INFO(cp, mb->trivial_index);
+            else if(!resolve)
+                return -1;
+            else if((fb = resolveField(mb->class, mb->trivial_index)) == NULL) {
+                clearException();
+                return -1;
+            }
+
+            if(fb->access_flags & ACC_STATIC)
+                return -1;
+
+            *operand = fb->offset;
+            wide = (*fb->type == 'J') || (*fb->type == 'D');
+
+            if(mb->trivial == TRIVIAL_GETTER)
+                return wide ? OPC_GETFIELD2_QUICK : OPC_GETFIELD_QUICK;
+
+            return wide ? OPC_PUTFIELD2_QUICK : OPC_PUTFIELD_QUICK;
+    }
+
+    return -1;
+}
+
 u4 resolveSingleConstant(Class *class, int cp_index) {
     ConstantPool *cp = &(CLASS_CB(class)->constant_pool);
 
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2003 Robert Lougher <rob@lougher.demon.co.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* A second copy of the interpreter, padded between its handlers.  It
+   is never run - the JIT compares its templates with those of the real
+   interpreter to find the ones which can safely be copied (see jit.c) */
+
+#if defined(THREADED) && (defined(__i386__) || defined(__x86_64__))
+#define JIT_SHADOW
+#define executeJava executeJavaShadow
+
+#include "interp.c"
+#endif
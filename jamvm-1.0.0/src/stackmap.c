@@ -0,0 +1,865 @@
+/*
+ * Copyright (C) 2003 Robert Lougher <rob@lougher.demon.co.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jam.h"
+#include "sig.h"
+
+/* Trace stack map construction */
+#ifdef TRACESTACKMAP
+#define TRACE(x) printf x
+#else
+#define TRACE(x)
+#endif
+
+/* Stack maps.  When a method is linked its bytecode is abstractly
+   interpreted to find which local variables and operand stack slots
+   hold references at each invoke.  A frame which has called another
+   Java method is stopped at the invoke, so the gc can use the map to
+   scan it precisely.
+
+   The only distinction made is whether a slot holds a reference or not.
+   Where control flow merges a slot is a reference only if it is on all
+   paths - a verified method can't use a slot of conflicting type as a
+   reference, so it needn't be scanned.  Methods using subroutines (jsr
+   and ret) aren't mapped, as the type of a slot after a ret depends on
+   the caller - their frames are always scanned conservatively */
+
+#define VAL 0
+#define REF 1
+
+#define U2(p)	(((p)[0]<<8)|(p)[1])
+#define S2(p)	((((signed char)(p)[0])<<8)|(p)[1])
+#define S4(p)	((((signed char)(p)[0])<<24)|((p)[1]<<16)|((p)[2]<<8)|(p)[3])
+
+typedef struct analysis {
+    MethodBlock *mb;
+    ConstantPool *cp;
+    int slots;
+    int *block;
+    int *block_pc;
+    char *visited;
+    int *height;
+    char *types;
+    int *worklist;
+    char *queued;
+    int work;
+
+    /* the map, as it is built */
+    int size;
+    int capacity;
+    u2 *pcs;
+    u2 *heights;
+    unsigned int *bits;
+} Analysis;
+
+#define BLOCK_TYPES(a, b) (&(a)->types[(b)*(a)->slots])
+
+/* Return the length of the instruction at pc, or 0 if it
+   isn't one which can appear in a mapped method */
+
+static int insnLength(unsigned char *code, int pc) {
+    int op = code[pc];
+
+    switch(op) {
+        case OPC_BIPUSH: case OPC_LDC: case OPC_ILOAD: case OPC_LLOAD:
+        case OPC_FLOAD: case OPC_DLOAD: case OPC_ALOAD: case OPC_ISTORE:
+        case OPC_LSTORE: case OPC_FSTORE: case OPC_DSTORE: case OPC_ASTORE:
+        case OPC_NEWARRAY:
+            return 2;
+
+        case OPC_SIPUSH: case OPC_LDC_W: case OPC_LDC2_W: case OPC_IINC:
+        case OPC_GETSTATIC: case OPC_PUTSTATIC: case OPC_GETFIELD:
+        case OPC_PUTFIELD: case OPC_INVOKEVIRTUAL: case OPC_INVOKESPECIAL:
+        case OPC_INVOKESTATIC: case OPC_NEW: case OPC_ANEWARRAY:
+        case OPC_CHECKCAST: case OPC_INSTANCEOF: case OPC_IFNULL:
+        case OPC_IFNONNULL: case OPC_GOTO:
+            return 3;
+
+        case OPC_MULTIANEWARRAY:
+            return 4;
+
+        case OPC_INVOKEINTERFACE: case OPC_GOTO_W:
+            return 5;
+
+        case OPC_WIDE:
+            return code[pc+1] == OPC_IINC ? 6 : 4;
+
+        case OPC_TABLESWITCH: {
+            int base = (pc+4)&~3;
+            int low = S4(&code[base+4]);
+            int high = S4(&code[base+8]);
+
+            return base + 12 + (high-low+1)*4 - pc;
+        }
+
+        case OPC_LOOKUPSWITCH: {
+            int base = (pc+4)&~3;
+            return base + 8 + S4(&code[base+4])*8 - pc;
+        }
+
+        case OPC_JSR: case OPC_RET: case OPC_JSR_W:
+            return 0;
+
+        default:
+            if(op >= OPC_IFEQ && op <= OPC_IF_ACMPNE)
+                return 3;
+
+            return op <= OPC_MONITOREXIT && op != 186 ? 1 : 0;
+    }
+}
+
+/* Return the signature of the field or method referenced by a
+   constant pool entry.  Entries may already have been resolved */
+
+static char *memberType(ConstantPool *cp, int idx, int field) {
+    switch(CP_TYPE(cp, idx)) {
+        case CONSTANT_Fieldref:
+        case CONSTANT_Methodref:
+        case CONSTANT_InterfaceMethodref:
+            return CP_UTF8(cp, CP_NAME_TYPE_TYPE(cp, CP_METHOD_NAME_TYPE(cp, idx)));
+
+        case CONSTANT_Resolved:
+            return field ? ((FieldBlock*)CP_INFO(cp, idx))->type :
+                           ((MethodBlock*)CP_INFO(cp, idx))->type;
+    }
+
+    return NULL;
+}
+
+/* Merge a state into a block's entry state, queueing the
+   block if it changes.  Returns FALSE if the stack heights
+   don't match */
+
+static int mergeState(Analysis *a, int b, char *types, int height) {
+    char *dst = BLOCK_TYPES(a, b);
+    int changed = FALSE;
+    int i;
+
+    if(!a->visited[b]) {
+        memcpy(dst, types, a->slots);
+        a->height[b] = height;
+        a->visited[b] = changed = TRUE;
+    } else {
+        if(a->height[b] != height)
+            return FALSE;
+
+        for(i = 0; i < a->mb->max_locals + height; i++)
+            if(dst[i] == REF && types[i] != REF) {
+                dst[i] = VAL;
+                changed = TRUE;
+            }
+    }
+
+    if(changed && !a->queued[b]) {
+        a->worklist[a->work++] = b;
+        a->queued[b] = TRUE;
+    }
+
+    return TRUE;
+}
+
+static void recordInvoke(Analysis *a, int pc, char *types, int height) {
+    int words = (a->slots+31)>>5;
+    unsigned int *bits;
+    int i;
+
+    if(a->size == a->capacity) {
+        a->capacity = a->capacity ? a->capacity*2 : 16;
+        a->pcs = (u2*)realloc(a->pcs, a->capacity*sizeof(u2));
+        a->heights = (u2*)realloc(a->heights, a->capacity*sizeof(u2));
+        a->bits = (unsigned int*)realloc(a->bits, a->capacity*words*sizeof(unsigned int));
+    }
+
+    bits = &a->bits[a->size*words];
+    memset(bits, 0, words*sizeof(unsigned int));
+
+    for(i = 0; i < a->mb->max_locals + height; i++)
+        if(types[i] == REF)
+            bits[i>>5] |= 1<<(i&31);
+
+    a->pcs[a->size] = pc;
+    a->heights[a->size++] = height;
+}
+
+/* Abstractly interpret a basic block from its entry state.  If record
+   is TRUE the state at each invoke is added to the map.  Returns FALSE
+   if the bytecode can't be analysed */
+
+static int interpretBlock(Analysis *a, int b, char *cur, int record) {
+    MethodBlock *mb = a->mb;
+    unsigned char *code = mb->code;
+    char *lv = cur;
+    char *st = cur + mb->max_locals;
+    int sp = a->height[b];
+    int pc = a->block_pc[b];
+    int i;
+
+    memcpy(cur, BLOCK_TYPES(a, b), a->slots);
+
+#define PUSH(t)		{ if(sp == mb->max_stack) return FALSE; st[sp++] = t; }
+#define POP(n)		{ if((sp -= (n)) < 0) return FALSE; }
+#define LOCAL(n)	{ if((n) >= mb->max_locals) return FALSE; }
+#define BRANCH_TO(t)	{ int target = (t);                                  \
+                          if(target < 0 || target >= mb->code_size ||        \
+                             a->block[target] == -1 ||                       \
+                             !mergeState(a, a->block[target], cur, sp))      \
+                              return FALSE; }
+
+    for(;;) {
+        int op = code[pc];
+        int len = insnLength(code, pc);
+
+        if(len == 0 || pc + len > mb->code_size)
+            return FALSE;
+
+        /* Any exception thrown here is caught with the current locals
+           and the exception as the only thing on the stack */
+
+        for(i = 0; i < mb->exception_table_size; i++) {
+            ExceptionTableEntry *entry = &mb->exception_table[i];
+
+            if(pc >= entry->start_pc && pc < entry->end_pc) {
+                int h = entry->handler_pc;
+                char save = st[0];
+                int merged;
+
+                if(mb->max_stack == 0 || h >= mb->code_size || a->block[h] == -1)
+                    return FALSE;
+
+                st[0] = REF;
+                merged = mergeState(a, a->block[h], cur, 1);
+                st[0] = save;
+
+                if(!merged)
+                    return FALSE;
+            }
+        }
+
+        switch(op) {
+            case OPC_NOP: case OPC_IINC: case OPC_INEG: case OPC_LNEG:
+            case OPC_FNEG: case OPC_DNEG: case OPC_I2F: case OPC_F2I:
+            case OPC_L2D: case OPC_D2L: case OPC_I2B: case OPC_I2C:
+            case OPC_I2S:
+                break;
+
+            case OPC_ACONST_NULL:
+                PUSH(REF);
+                break;
+
+            case OPC_ICONST_M1: case OPC_ICONST_0: case OPC_ICONST_1:
+            case OPC_ICONST_2: case OPC_ICONST_3: case OPC_ICONST_4:
+            case OPC_ICONST_5: case OPC_FCONST_0: case OPC_FCONST_1:
+            case OPC_FCONST_2: case OPC_BIPUSH: case OPC_SIPUSH:
+            case OPC_ILOAD: case OPC_FLOAD: case OPC_ILOAD_0: case OPC_ILOAD_1:
+            case OPC_ILOAD_2: case OPC_ILOAD_3: case OPC_FLOAD_0:
+            case OPC_FLOAD_1: case OPC_FLOAD_2: case OPC_FLOAD_3:
+                PUSH(VAL);
+                break;
+
+            case OPC_LCONST_0: case OPC_LCONST_1: case OPC_DCONST_0:
+            case OPC_DCONST_1: case OPC_LDC2_W: case OPC_LLOAD: case OPC_DLOAD:
+            case OPC_LLOAD_0: case OPC_LLOAD_1: case OPC_LLOAD_2:
+            case OPC_LLOAD_3: case OPC_DLOAD_0: case OPC_DLOAD_1:
+            case OPC_DLOAD_2: case OPC_DLOAD_3:
+                PUSH(VAL);
+                PUSH(VAL);
+                break;
+
+            case OPC_LDC:
+            case OPC_LDC_W: {
+                int idx = op == OPC_LDC ? code[pc+1] : U2(&code[pc+1]);
+                int type = CP_TYPE(a->cp, idx);
+
+                PUSH(type == CONSTANT_Integer || type == CONSTANT_Float ? VAL : REF);
+                break;
+            }
+
+            case OPC_ALOAD:
+                LOCAL(code[pc+1]);
+                PUSH(lv[code[pc+1]]);
+                break;
+
+            case OPC_ALOAD_0: case OPC_ALOAD_1: case OPC_ALOAD_2: case OPC_ALOAD_3:
+                LOCAL(op-OPC_ALOAD_0);
+                PUSH(lv[op-OPC_ALOAD_0]);
+                break;
+
+            case OPC_IALOAD: case OPC_FALOAD: case OPC_BALOAD:
+            case OPC_CALOAD: case OPC_SALOAD:
+                POP(2);
+                PUSH(VAL);
+                break;
+
+            case OPC_LALOAD: case OPC_DALOAD:
+                POP(2);
+                PUSH(VAL);
+                PUSH(VAL);
+                break;
+
+            case OPC_AALOAD:
+                POP(2);
+                PUSH(REF);
+                break;
+
+            case OPC_ISTORE: case OPC_FSTORE:
+                LOCAL(code[pc+1]);
+                POP(1);
+                lv[code[pc+1]] = VAL;
+                break;
+
+            case OPC_ISTORE_0: case OPC_ISTORE_1: case OPC_ISTORE_2: case OPC_ISTORE_3:
+                LOCAL(op-OPC_ISTORE_0);
+                POP(1);
+                lv[op-OPC_ISTORE_0] = VAL;
+                break;
+
+            case OPC_FSTORE_0: case OPC_FSTORE_1: case OPC_FSTORE_2: case OPC_FSTORE_3:
+                LOCAL(op-OPC_FSTORE_0);
+                POP(1);
+                lv[op-OPC_FSTORE_0] = VAL;
+                break;
+
+            case OPC_LSTORE: case OPC_DSTORE:
+                LOCAL(code[pc+1]+1);
+                POP(2);
+                lv[code[pc+1]] = lv[code[pc+1]+1] = VAL;
+                break;
+
+            case OPC_LSTORE_0: case OPC_LSTORE_1: case OPC_LSTORE_2: case OPC_LSTORE_3:
+                LOCAL(op-OPC_LSTORE_0+1);
+                POP(2);
+                lv[op-OPC_LSTORE_0] = lv[op-OPC_LSTORE_0+1] = VAL;
+                break;
+
+            case OPC_DSTORE_0: case OPC_DSTORE_1: case OPC_DSTORE_2: case OPC_DSTORE_3:
+                LOCAL(op-OPC_DSTORE_0+1);
+                POP(2);
+                lv[op-OPC_DSTORE_0] = lv[op-OPC_DSTORE_0+1] = VAL;
+                break;
+
+            case OPC_ASTORE:
+                LOCAL(code[pc+1]);
+                POP(1);
+                lv[code[pc+1]] = st[sp];
+                break;
+
+            case OPC_ASTORE_0: case OPC_ASTORE_1: case OPC_ASTORE_2: case OPC_ASTORE_3:
+                LOCAL(op-OPC_ASTORE_0);
+                POP(1);
+                lv[op-OPC_ASTORE_0] = st[sp];
+                break;
+
+            case OPC_IASTORE: case OPC_FASTORE: case OPC_AASTORE:
+            case OPC_BASTORE: case OPC_CASTORE: case OPC_SASTORE:
+                POP(3);
+                break;
+
+            case OPC_LASTORE: case OPC_DASTORE:
+                POP(4);
+                break;
+
+            case OPC_POP: case OPC_MONITORENTER: case OPC_MONITOREXIT:
+                POP(1);
+                break;
+
+            case OPC_POP2:
+                POP(2);
+                break;
+
+            case OPC_DUP: {
+                char v1;
+
+                POP(1);
+                v1 = st[sp];
+                PUSH(v1); PUSH(v1);
+                break;
+            }
+
+            case OPC_DUP_X1: {
+                char v1, v2;
+
+                POP(2);
+                v2 = st[sp]; v1 = st[sp+1];
+                PUSH(v1); PUSH(v2); PUSH(v1);
+                break;
+            }
+
+            case OPC_DUP_X2: {
+                char v1, v2, v3;
+
+                POP(3);
+                v3 = st[sp]; v2 = st[sp+1]; v1 = st[sp+2];
+                PUSH(v1); PUSH(v3); PUSH(v2); PUSH(v1);
+                break;
+            }
+
+            case OPC_DUP2: {
+                char v1, v2;
+
+                POP(2);
+                v2 = st[sp]; v1 = st[sp+1];
+                PUSH(v2); PUSH(v1); PUSH(v2); PUSH(v1);
+                break;
+            }
+
+            case OPC_DUP2_X1: {
+                char v1, v2, v3;
+
+                POP(3);
+                v3 = st[sp]; v2 = st[sp+1]; v1 = st[sp+2];
+                PUSH(v2); PUSH(v1); PUSH(v3); PUSH(v2); PUSH(v1);
+                break;
+            }
+
+            case OPC_DUP2_X2: {
+                char v1, v2, v3, v4;
+
+                POP(4);
+                v4 = st[sp]; v3 = st[sp+1]; v2 = st[sp+2]; v1 = st[sp+3];
+                PUSH(v2); PUSH(v1); PUSH(v4); PUSH(v3); PUSH(v2); PUSH(v1);
+                break;
+            }
+
+            case OPC_SWAP: {
+                char v;
+
+                POP(2);
+                v = st[sp]; st[sp] = st[sp+1]; st[sp+1] = v;
+                sp += 2;
+                break;
+            }
+
+            case OPC_IADD: case OPC_FADD: case OPC_ISUB: case OPC_FSUB:
+            case OPC_IMUL: case OPC_FMUL: case OPC_IDIV: case OPC_FDIV:
+            case OPC_IREM: case OPC_FREM: case OPC_ISHL: case OPC_ISHR:
+            case OPC_IUSHR: case OPC_IAND: case OPC_IOR: case OPC_IXOR:
+            case OPC_L2I: case OPC_L2F: case OPC_D2I: case OPC_D2F:
+            case OPC_FCMPL: case OPC_FCMPG:
+                POP(2);
+                PUSH(VAL);
+                break;
+
+            case OPC_LADD: case OPC_DADD: case OPC_LSUB: case OPC_DSUB:
+            case OPC_LMUL: case OPC_DMUL: case OPC_LDIV: case OPC_DDIV:
+            case OPC_LREM: case OPC_DREM: case OPC_LAND: case OPC_LOR:
+            case OPC_LXOR:
+                POP(4);
+                PUSH(VAL);
+                PUSH(VAL);
+                break;
+
+            case OPC_LSHL: case OPC_LSHR: case OPC_LUSHR:
+                POP(3);
+                PUSH(VAL);
+                PUSH(VAL);
+                break;
+
+            case OPC_I2L: case OPC_I2D: case OPC_F2L: case OPC_F2D:
+                POP(1);
+                PUSH(VAL);
+                PUSH(VAL);
+                break;
+
+            case OPC_LCMP: case OPC_DCMPL: case OPC_DCMPG:
+                POP(4);
+                PUSH(VAL);
+                break;
+
+            case OPC_IFNULL: case OPC_IFNONNULL:
+                POP(1);
+                BRANCH_TO(pc + S2(&code[pc+1]));
+                break;
+
+            case OPC_GOTO:
+                BRANCH_TO(pc + S2(&code[pc+1]));
+                return TRUE;
+
+            case OPC_GOTO_W:
+                BRANCH_TO(pc + S4(&code[pc+1]));
+                return TRUE;
+
+            case OPC_TABLESWITCH: {
+                int base = (pc+4)&~3;
+                int low = S4(&code[base+4]);
+                int high = S4(&code[base+8]);
+
+                POP(1);
+                BRANCH_TO(pc + S4(&code[base]));
+                for(i = 0; i <= high-low; i++)
+                    BRANCH_TO(pc + S4(&code[base+12+i*4]));
+                return TRUE;
+            }
+
+            case OPC_LOOKUPSWITCH: {
+                int base = (pc+4)&~3;
+                int npairs = S4(&code[base+4]);
+
+                POP(1);
+                BRANCH_TO(pc + S4(&code[base]));
+                for(i = 0; i < npairs; i++)
+                    BRANCH_TO(pc + S4(&code[base+12+i*8]));
+                return TRUE;
+            }
+
+            case OPC_IRETURN: case OPC_LRETURN: case OPC_FRETURN:
+            case OPC_DRETURN: case OPC_ARETURN: case OPC_RETURN:
+            case OPC_ATHROW:
+                return TRUE;
+
+            case OPC_GETSTATIC: case OPC_PUTSTATIC:
+            case OPC_GETFIELD: case OPC_PUTFIELD: {
+                char *type = memberType(a->cp, U2(&code[pc+1]), TRUE);
+                int size;
+
+                if(type == NULL)
+                    return FALSE;
+
+                size = *type == 'J' || *type == 'D' ? 2 : 1;
+
+                if(op == OPC_GETFIELD)
+                    POP(1);
+
+                if(op == OPC_GETSTATIC || op == OPC_GETFIELD) {
+                    PUSH(*type == 'L' || *type == '[' ? REF : VAL);
+                    if(size == 2)
+                        PUSH(VAL);
+                } else
+                    POP(op == OPC_PUTFIELD ? size + 1 : size);
+                break;
+            }
+
+            case OPC_INVOKEVIRTUAL: case OPC_INVOKESPECIAL:
+            case OPC_INVOKESTATIC: case OPC_INVOKEINTERFACE: {
+                char *sig = memberType(a->cp, U2(&code[pc+1]), FALSE);
+                int args = op == OPC_INVOKESTATIC ? 0 : 1;
+
+                if(sig == NULL)
+                    return FALSE;
+
+                if(record)
+                    recordInvoke(a, pc, cur, sp);
+
+                SCAN_SIG(sig, args+=2, args++);
+                POP(args);
+
+                if(*sig == 'L' || *sig == '[') {
+                    PUSH(REF);
+                } else if(*sig == 'J' || *sig == 'D') {
+                    PUSH(VAL);
+                    PUSH(VAL);
+                } else if(*sig != 'V')
+                    PUSH(VAL);
+                break;
+            }
+
+            case OPC_NEW:
+                PUSH(REF);
+                break;
+
+            case OPC_NEWARRAY: case OPC_ANEWARRAY: case OPC_CHECKCAST:
+                POP(1);
+                PUSH(REF);
+                break;
+
+            case OPC_ARRAYLENGTH: case OPC_INSTANCEOF:
+                POP(1);
+                PUSH(VAL);
+                break;
+
+            case OPC_MULTIANEWARRAY:
+                POP(code[pc+3]);
+                PUSH(REF);
+                break;
+
+            case OPC_WIDE: {
+                int idx = U2(&code[pc+2]);
+
+                switch(code[pc+1]) {
+                    case OPC_ILOAD: case OPC_FLOAD:
+                        LOCAL(idx);
+                        PUSH(VAL);
+                        break;
+
+                    case OPC_LLOAD: case OPC_DLOAD:
+                        LOCAL(idx+1);
+                        PUSH(VAL);
+                        PUSH(VAL);
+                        break;
+
+                    case OPC_ALOAD:
+                        LOCAL(idx);
+                        PUSH(lv[idx]);
+                        break;
+
+                    case OPC_ISTORE: case OPC_FSTORE:
+                        LOCAL(idx);
+                        POP(1);
+                        lv[idx] = VAL;
+                        break;
+
+                    case OPC_LSTORE: case OPC_DSTORE:
+                        LOCAL(idx+1);
+                        POP(2);
+                        lv[idx] = lv[idx+1] = VAL;
+                        break;
+
+                    case OPC_ASTORE:
+                        LOCAL(idx);
+                        POP(1);
+                        lv[idx] = st[sp];
+                        break;
+
+                    case OPC_IINC:
+                        break;
+
+                    default:
+                        return FALSE;
+                }
+                break;
+            }
+
+            default:
+                if(op >= OPC_IFEQ && op <= OPC_IFLE) {
+                    POP(1);
+                    BRANCH_TO(pc + S2(&code[pc+1]));
+                } else if(op >= OPC_IF_ICMPEQ && op <= OPC_IF_ACMPNE) {
+                    POP(2);
+                    BRANCH_TO(pc + S2(&code[pc+1]));
+                } else
+                    return FALSE;
+        }
+
+        /* Fall through into the next block */
+
+        if((pc += len) >= mb->code_size)
+            return FALSE;
+
+        if(a->block[pc] != -1) {
+            BRANCH_TO(pc);
+            return TRUE;
+        }
+    }
+}
+
+/* Find the basic blocks.  A block starts at the method entry,
+   each branch target and exception handler, and after each
+   branch.  Returns FALSE if the method can't be mapped */
+
+static int findBlocks(Analysis *a) {
+    MethodBlock *mb = a->mb;
+    unsigned char *code = mb->code;
+    char *insn = (char*)calloc(mb->code_size, 1);
+    char *leader = (char*)calloc(mb->code_size, 1);
+    int pc, len, i, blocks = 0;
+    int ok = FALSE;
+
+#define LEADER(t)	{ int target = (t);                                  \
+                          if(target < 0 || target >= mb->code_size)          \
+                              goto out;                                      \
+                          leader[target] = TRUE; }
+
+    leader[0] = TRUE;
+
+    for(pc = 0; pc < mb->code_size; pc += len) {
+        int op = code[pc];
+
+        if((len = insnLength(code, pc)) == 0 || pc + len > mb->code_size)
+            goto out;
+
+        insn[pc] = TRUE;
+
+        if((op >= OPC_IFEQ && op <= OPC_GOTO) || op == OPC_IFNULL || op == OPC_IFNONNULL) {
+            LEADER(pc + S2(&code[pc+1]));
+        } else if(op == OPC_GOTO_W) {
+            LEADER(pc + S4(&code[pc+1]));
+        } else if(op == OPC_TABLESWITCH) {
+            int base = (pc+4)&~3;
+            int low = S4(&code[base+4]);
+            int high = S4(&code[base+8]);
+
+            LEADER(pc + S4(&code[base]));
+            for(i = 0; i <= high-low; i++)
+                LEADER(pc + S4(&code[base+12+i*4]));
+        } else if(op == OPC_LOOKUPSWITCH) {
+            int base = (pc+4)&~3;
+            int npairs = S4(&code[base+4]);
+
+            LEADER(pc + S4(&code[base]));
+            for(i = 0; i < npairs; i++)
+                LEADER(pc + S4(&code[base+12+i*8]));
+        } else if(!(op >= OPC_IRETURN && op <= OPC_RETURN) && op != OPC_ATHROW)
+            continue;
+
+        if(pc + len < mb->code_size)
+            leader[pc + len] = TRUE;
+    }
+
+    for(i = 0; i < mb->exception_table_size; i++)
+        LEADER(mb->exception_table[i].handler_pc);
+
+    a->block = (int*)malloc(mb->code_size * sizeof(int));
+
+    for(pc = 0; pc < mb->code_size; pc++)
+        if(leader[pc]) {
+            if(!insn[pc])
+                goto out;
+            a->block[pc] = blocks++;
+        } else
+            a->block[pc] = -1;
+
+    a->block_pc = (int*)malloc(blocks * sizeof(int));
+
+    for(pc = 0; pc < mb->code_size; pc++)
+        if(leader[pc])
+            a->block_pc[a->block[pc]] = pc;
+
+    a->visited = (char*)calloc(blocks, 1);
+    a->queued = (char*)calloc(blocks, 1);
+    a->height = (int*)calloc(blocks, sizeof(int));
+    a->worklist = (int*)malloc(blocks * sizeof(int));
+    a->types = (char*)malloc(blocks * a->slots);
+    a->work = 0;
+    ok = TRUE;
+
+out:
+    free(insn);
+    free(leader);
+    return ok;
+}
+
+static StackMap *analyse(Analysis *a) {
+    MethodBlock *mb = a->mb;
+    char *cur = (char*)malloc(a->slots);
+    StackMap *map = NULL;
+    char *sig = mb->type;
+    int words = (a->slots+31)>>5;
+    int local = 0;
+    int b, pc, len;
+
+    if(mb->args_count > mb->max_locals || !findBlocks(a))
+        goto out;
+
+    /* The entry state - the arguments are the first locals */
+
+    memset(cur, VAL, a->slots);
+
+    if(!(mb->access_flags & ACC_STATIC))
+        cur[local++] = REF;
+
+    SCAN_SIG(sig, local+=2, cur[local++] = (*sig == 'L' || *sig == '[') ? REF : VAL);
+
+    if(!mergeState(a, 0, cur, 0))
+        goto out;
+
+    while(a->work > 0) {
+        b = a->worklist[--a->work];
+        a->queued[b] = FALSE;
+
+        if(!interpretBlock(a, b, cur, FALSE))
+            goto out;
+    }
+
+    /* Now the entry state of every block is known, so
+       the states at the invokes can be recorded */
+
+    for(pc = 0; pc < mb->code_size; pc++)
+        if((b = a->block[pc]) != -1 && a->visited[b] && !interpretBlock(a, b, cur, TRUE))
+            goto out;
+
+    len = sizeof(StackMap) + a->size*(2*sizeof(u2) + words*sizeof(unsigned int));
+    map = (StackMap*)malloc(len);
+
+    map->size = a->size;
+    map->words = words;
+    map->bits = (unsigned int*)(map+1);
+    map->pcs = (u2*)(map->bits + a->size*words);
+    map->heights = map->pcs + a->size;
+
+    memcpy(map->bits, a->bits, a->size*words*sizeof(unsigned int));
+    memcpy(map->pcs, a->pcs, a->size*sizeof(u2));
+    memcpy(map->heights, a->heights, a->size*sizeof(u2));
+
+    TRACE(("Stack map for %s.%s%s has %d entries\n", CLASS_CB(mb->class)->name,
+           mb->name, mb->type, map->size));
+
+out:
+    free(cur);
+    return map;
+}
+
+/* Build the stack map of a method.  Returns NULL if the method
+   has no bytecode, or it can't be mapped */
+
+StackMap *buildStackMap(MethodBlock *mb) {
+    Analysis a;
+    StackMap *map;
+
+    if(mb->code == NULL || mb->code_size == 0 ||
+                 (mb->access_flags & (ACC_NATIVE|ACC_ABSTRACT)))
+        return NULL;
+
+    memset(&a, 0, sizeof(a));
+    a.mb = mb;
+    a.cp = &(CLASS_CB(mb->class)->constant_pool);
+    a.slots = mb->max_locals + mb->max_stack;
+
+    if((map = analyse(&a)) == NULL)
+        TRACE(("Can't map %s.%s%s\n", CLASS_CB(mb->class)->name, mb->name, mb->type));
+
+    free(a.block);
+    free(a.block_pc);
+    free(a.visited);
+    free(a.queued);
+    free(a.height);
+    free(a.worklist);
+    free(a.types);
+    free(a.pcs);
+    free(a.heights);
+    free(a.bits);
+
+    return map;
+}
+
+/* Return the reference bits of the locals and operand stack at an
+   invoke, and the stack height, or NULL if the pc isn't mapped */
+
+unsigned int *findStackMap(StackMap *map, int pc, int *height) {
+    int low = 0, high = map->size-1;
+
+    while(low <= high) {
+        int mid = (low+high)>>1;
+
+        if(map->pcs[mid] == pc) {
+            *height = map->heights[mid];
+            return &map->bits[mid*map->words];
+        }
+
+        if(map->pcs[mid] < pc)
+            low = mid+1;
+        else
+            high = mid-1;
+    }
+
+    return NULL;
+}
@@ -94,6 +94,7 @@ Object *createString(unsigned char *utf8) {
 
     INST_DATA(ob)[count_offset] = len; 
     INST_DATA(ob)[value_offset] = (u4)array; 
+    WRITE_BARRIER(ob);
 
     return ob;
 }
@@ -189,6 +190,7 @@ Object *createStringFromUnicode(short *unicode, int len) {
 
     INST_DATA(ob)[count_offset] = len; 
     INST_DATA(ob)[value_offset] = (u4)array; 
+    WRITE_BARRIER(ob);
     return ob;
 }
 
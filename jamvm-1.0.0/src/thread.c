@@ -18,6 +18,11 @@
  * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#ifdef IMPLICIT_NULL_CHECKS
+#define _GNU_SOURCE
+#include <ucontext.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +31,7 @@
 #include "jam.h"
 #include "thread.h"
 #include "lock.h"
+#include "lock_md.h"
 
 #ifdef TRACETHREAD
 #define TRACE(x) printf x
@@ -243,7 +249,7 @@ void *threadStart(void *arg) {
      * is of type java.lang.Throwable */
 
     group = (Object *)INST_DATA(jThread)[group_offset];
-    if(excep = exceptionOccured()) {
+    if((excep = exceptionOccured())) {
         Class *throwable;
 	MethodBlock *uncaught_exp;
        
@@ -268,6 +274,7 @@ void *threadStart(void *arg) {
     objectUnlock(jThread);
 
     disableSuspend0(thread, &group);
+    retireThreadBuffers(thread);
     pthread_mutex_lock(&lock);
 
     /* remove from thread list... */
@@ -378,6 +385,7 @@ Thread *attachThread(char *name, char is_daemon, void *stack_base) {
     INST_DATA(ee->thread)[group_offset] = INST_DATA(main_ee.thread)[group_offset];
     INST_DATA(ee->thread)[priority_offset] = 5;
     INST_DATA(ee->thread)[vmData_offset] = (u4)thread;
+    WRITE_BARRIER(ee->thread);
 
     /* add to thread list... */
 
@@ -499,7 +507,44 @@ static void suspendLoop(Thread *thread) {
 
 static void suspendHandler(int sig) {
     Thread *thread = threadSelf();
-    suspendLoop(thread);
+
+    /* If the thread is within a suspend-deferred sequence
+       it will suspend itself on leaving it */
+    if(!thread->defer_suspend)
+        suspendLoop(thread);
+}
+
+#ifdef IMPLICIT_NULL_CHECKS
+/* A fault on an access near NULL made by the interpreter is a null
+   pointer exception - jump back into the interpreter to throw it.
+   Anything else is a genuine crash, so the default action is
+   restored, and the access faults again on return */
+
+static void nullPointerHandler(int sig, siginfo_t *info, void *context) {
+    Thread *thread = threadSelf();
+
+    if(thread != NULL && thread->ee->null_check_env != NULL &&
+               (unsigned long)info->si_addr < NULL_PAGE_SIZE &&
+               isInterpreterCode(FAULT_PC(context)))
+        siglongjmp(*thread->ee->null_check_env, 1);
+
+    signal(SIGSEGV, SIG_DFL);
+}
+#endif
+
+void deferredSuspend(Thread *thread) {
+    sigset_t mask;
+
+    /* Block the suspend signal, so that the resume
+       can't be lost before we reach sigsuspend */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if(thread->suspend)
+        suspendLoop(thread);
+
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
 }
 
 void disableSuspend0(Thread *thread, void *stack_top) {
@@ -563,6 +608,14 @@ static void initialiseSignals() {
     act.sa_flags = 0;
     sigaction(SIGUSR1, &act, NULL);
 
+#ifdef IMPLICIT_NULL_CHECKS
+    /* The handler doesn't return to the faulting access, so SIGSEGV
+       mustn't be left blocked */
+    act.sa_sigaction = nullPointerHandler;
+    act.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigaction(SIGSEGV, &act, NULL);
+#endif
+
     sigemptyset(&mask);
     sigaddset(&mask, SIGQUIT);
     sigaddset(&mask, SIGINT);
@@ -574,6 +627,7 @@ static void initialiseSignals() {
 /* garbage collection support */
 
 extern void scanThread(Thread *thread);
+extern void updateThread(Thread *thread);
 
 void scanThreads() {
     Thread *thread;
@@ -582,6 +636,27 @@ void scanThreads() {
         scanThread(thread);
 }
 
+void updateThreads() {
+    Thread *thread;
+
+    for(thread = &main; thread != NULL; thread = thread->next)
+        updateThread(thread);
+}
+
+void retireTLABs() {
+    Thread *thread;
+
+    for(thread = &main; thread != NULL; thread = thread->next)
+        retireTLAB(thread);
+}
+
+void flushSATBBuffers() {
+    Thread *thread;
+
+    for(thread = &main; thread != NULL; thread = thread->next)
+        flushSATBBuffer(thread);
+}
+
 int systemIdle(Thread *self) {
     Thread *thread;
 
@@ -667,6 +742,7 @@ void initialiseMainThread(int stack_size) {
     INST_DATA(main_ee.thread)[name_offset] = (u4)Cstr2String("main");
     INST_DATA(main_ee.thread)[group_offset] = root->static_value;
     INST_DATA(main_ee.thread)[priority_offset] = 5;
+    WRITE_BARRIER(main_ee.thread);
 
     INST_DATA(main_ee.thread)[vmData_offset] = (u4)&main;
 
@@ -51,6 +51,7 @@ struct thread {
     char interrupting;
     char suspend;
     char blocking;
+    volatile char defer_suspend;
     pthread_t tid;
     int id;
     ExecEnv *ee;
@@ -58,6 +59,11 @@ struct thread {
     void *stack_base;
     Monitor *wait_mon;
     Thread *prev, *next;
+    char *tlab_start;
+    char *tlab_top;
+    char *tlab_limit;
+    Object **satb_buf;
+    int satb_top;
 };
 
 extern Thread *threadSelf();
@@ -73,6 +79,32 @@ extern int systemIdle(Thread *self);
 extern void disableSuspend0(Thread *thread, void *stack_top);
 extern void enableSuspend(Thread *thread);
 
+extern void deferredSuspend(Thread *thread);
+
+/* The thread's allocation and SATB buffers (see alloc.c) */
+
+extern void retireTLAB(Thread *thread);
+extern void flushSATBBuffer(Thread *thread);
+extern void retireThreadBuffers(Thread *thread);
+
+/* Short sequences which must not be interrupted by suspension, but
+   which are too frequent to pay for disableSuspend (e.g. allocating
+   from the thread's TLAB) defer suspension instead.  The thread is
+   still waited for by suspendAllThreads - a suspend request arriving
+   within the sequence is acted upon at the end of it */
+
+#define deferSuspend(thread) {                  \
+    thread->defer_suspend = TRUE;               \
+    __asm__ __volatile__ ("" ::: "memory");     \
+}
+
+#define undeferSuspend(thread) {                \
+    __asm__ __volatile__ ("" ::: "memory");     \
+    thread->defer_suspend = FALSE;              \
+    if(*(volatile char*)&thread->suspend)       \
+        deferredSuspend(thread);                \
+}
+
 #define disableSuspend(thread)          \
 {                                       \
     sigjmp_buf *env;                    \
@@ -110,4 +142,5 @@ typedef pthread_mutex_t VMLock;
     self->state = RUNNING;                             \
 }
 #define notifyVMWaitLock(wait_lock, self) pthread_cond_signal(&wait_lock.cv)
+#define notifyAllVMWaitLock(wait_lock, self) pthread_cond_broadcast(&wait_lock.cv)
 #endif